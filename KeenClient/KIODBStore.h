@@ -7,14 +7,339 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "KIOEventBatch.h"
+#import "KIOEventStore.h"
 
-@interface KIODBStore : NSObject
+/**
+ Durability profiles for the underlying SQLite database. Each profile sets the
+ journal_mode, synchronous, wal_autocheckpoint, cache_size and temp_store pragmas
+ when the database is opened.
+ */
+typedef NS_ENUM(NSInteger, KIODBStoreDurability) {
+    // Rollback journal with synchronous=FULL. Every commit is synced to disk before it returns.
+    KIODBStoreDurabilityStrict,
+    // WAL journal with synchronous=NORMAL. Survives app crashes, but a power loss can drop the most recent commits.
+    KIODBStoreDurabilityBalanced,
+    // WAL journal with synchronous=OFF. Fastest, but leaves flushing to the OS entirely.
+    KIODBStoreDurabilityRelaxed
+};
+
+/**
+ Codecs for compressing stored event data. The codec is recorded with each event, so
+ events stored with one setting can still be read after it changes.
+ */
+typedef NS_ENUM(NSInteger, KIODBStoreCompression) {
+    // Event data is stored as is.
+    KIODBStoreCompressionNone,
+    // Event data is compressed with zlib's deflate.
+    KIODBStoreCompressionDeflate
+};
+
+/**
+ Keys for the options passed to initWithDatabasePath:options:. Each takes an NSNumber and, unless
+ noted otherwise, sets the property of the same name before the database is opened.
+ */
+extern NSString *const kKIODBStoreOptionDurability;      // KIODBStoreDurability, sets durability
+extern NSString *const kKIODBStoreOptionConcurrentReads; // BOOL, sets concurrentReadsEnabled
+extern NSString *const kKIODBStoreOptionGroupCommit;     // BOOL, sets groupCommitEnabled
+extern NSString *const kKIODBStoreOptionCompression;     // KIODBStoreCompression, sets compression
+extern NSString *const kKIODBStoreOptionAsyncWarmUp;     // BOOL, opens the database in the background, see ready
+extern NSString *const kKIODBStoreOptionMmapSize;        // unsigned long long, sets mmapSize
+extern NSString *const kKIODBStoreOptionPageSize;        // NSUInteger, sets pageSize
+extern NSString *const kKIODBStoreOptionProfiling;       // BOOL, sets profilingEnabled
+
+/**
+ Keys of the dictionary returned by profileSnapshot. The statements are keyed by their SQL, and
+ each set of timings is a dictionary of the count, total time and histogram keys.
+ */
+extern NSString *const kKIODBStoreProfileStatements; // NSDictionary of SQL to timings for each statement
+extern NSString *const kKIODBStoreProfileQueueWait;  // Timings of how long blocks waited for the dbQueue
+extern NSString *const kKIODBStoreProfileQueueRun;   // Timings of how long blocks ran on the dbQueue
+extern NSString *const kKIODBStoreProfileCount;      // NSNumber, how many times it ran
+extern NSString *const kKIODBStoreProfileTotalTime;  // NSNumber, the time it took in total, in seconds
+extern NSString *const kKIODBStoreProfileHistogram;  // NSArray of NSNumber counts, see profileHistogramBounds
+
+@interface KIODBStore : NSObject <KIOEventStore>
 
 /**
  Singleton instance of this class.
  */
 + (KIODBStore *)sharedInstance;
 
+/**
+ Set the options sharedInstance is created with, such as kKIODBStoreOptionAsyncWarmUp to keep
+ opening the database off the thread that first touches the SDK. Only takes effect if called
+ before sharedInstance, and therefore [KeenClient sharedClient], is first used.
+
+ @param options kKIODBStoreOption keys and values, or nil for the defaults.
+ */
++ (void)setSharedInstanceOptions:(NSDictionary<NSString *, id> *)options;
+
+/**
+ Create a store with its own database, connection and queue, independent of sharedInstance.
+ Stores opened on different paths don't wait on each other, so each project or tenant can have
+ its own. Only one store should be open on a path at a time.
+
+ @param databasePath The database file, created along with its directory if it doesn't exist.
+ @param options kKIODBStoreOption keys and values, or nil for the defaults.
+ */
+- (instancetype)initWithDatabasePath:(NSString *)databasePath options:(NSDictionary<NSString *, id> *)options;
+
+/**
+ The database file of the store.
+ */
+@property (nonatomic, readonly) NSString *databasePath;
+
+/**
+ Create a store that keeps its database in memory instead of in keenEvents.sqlite. Nothing is
+ written to disk, so events are lost when the store is closed or the app exits. Meant for event
+ streams that can tolerate losing events, and for benchmarks that shouldn't measure disk I/O.
+ Each in-memory store has its own database.
+ */
+- (instancetype)initInMemory;
+
+/**
+ Whether the store keeps its database in memory.
+ */
+@property (nonatomic, readonly) BOOL inMemory;
+
+/**
+ How much of the database file SQLite reads through a memory map instead of read calls, in
+ bytes, set with kKIODBStoreOptionMmapSize. Applies to the write and read connections. 0, the
+ default, keeps SQLite's own setting.
+ */
+@property (nonatomic, readonly) unsigned long long mmapSize;
+
+/**
+ The page size new databases are created with, in bytes, set with kKIODBStoreOptionPageSize. A
+ power of two from 512 to 65536. Existing databases keep the page size they were created with.
+ 0, the default, keeps SQLite's own setting.
+ */
+@property (nonatomic, readonly) NSUInteger pageSize;
+
+/**
+ Whether the database has finished opening. Stores created with kKIODBStoreOptionAsyncWarmUp
+ return from init straight away and open, create and migrate the database in the background.
+ Until then added events are held in memory and written as soon as the store is ready, while
+ anything else that needs the database waits for it. Other stores are ready once init returns.
+ */
+@property (readonly, getter=isReady) BOOL ready;
+
+/**
+ Call a block on the main queue once the store is ready, or right away if it already is.
+
+ @param readyBlock Called with whether the database was opened. If it wasn't, events added
+                   while warming up were dropped.
+ */
+- (void)whenReady:(void (^)(BOOL opened))readyBlock;
+
+/**
+ How long init kept the calling thread waiting, in seconds. With kKIODBStoreOptionAsyncWarmUp
+ this leaves out the open, which openDuration measures on its own.
+ */
+@property (readonly) NSTimeInterval initDuration;
+
+/**
+ The durability profile used for the database. Defaults to KIODBStoreDurabilityBalanced.
+ Changing it applies the new profile immediately if the database is open.
+ */
+@property (nonatomic) KIODBStoreDurability durability;
+
+/**
+ When enabled, addEvent: queues events and returns without waiting for them to be written.
+ Queued events are written together in a single transaction once groupCommitBatchSize events
+ or groupCommitInterval seconds have accumulated. Counts and getEvents flush the queue first,
+ so they always see every added event. Defaults to NO.
+ */
+@property (nonatomic) BOOL groupCommitEnabled;
+
+/**
+ The number of queued events that triggers a group commit. Defaults to 64.
+ */
+@property (nonatomic) NSUInteger groupCommitBatchSize;
+
+/**
+ The longest an event waits in the group commit queue, in seconds. Defaults to 0.05.
+ */
+@property (nonatomic) NSTimeInterval groupCommitInterval;
+
+/**
+ The codec used to compress event data as it's added. Defaults to KIODBStoreCompressionNone.
+ Events that don't get any smaller are stored uncompressed.
+ */
+@property (nonatomic) KIODBStoreCompression compression;
+
+/**
+ An optional preset dictionary for deflate, e.g. a sample event with the global properties
+ every event shares. Each compressed event records the checksum of its dictionary, and every
+ dictionary set here stays registered for reading, so it can change while events are stored.
+ */
+@property (copy) NSData *compressionDictionary;
+
+/**
+ Register a dictionary that stored events may have been compressed with, e.g. the
+ compressionDictionary an earlier launch of the app used. Events whose dictionary isn't
+ registered are skipped when claiming, but left in the store until it is.
+
+ @param dictionary The dictionary to read events with.
+ */
+- (void)addDecompressionDictionary:(NSData *)dictionary;
+
+/**
+ When enabled, reads that don't change anything (event and query counts, and getQuery) stop
+ waiting behind writes on the database queue. Event counts are answered from the counts kept
+ in memory, and query reads use a second, read-only connection with its own queue. The read
+ connection is only opened while the durability profile uses WAL. Reads still go through the
+ database queue while it has writes from earlier calls left to finish, so they always see
+ them. The read connection is never opened for an in-memory store. Defaults to NO.
+ */
+@property (nonatomic) BOOL concurrentReadsEnabled;
+
+/**
+ The most events kept in each collection of a project, unless a collection has its own cap set
+ with setMaxEvents:forCollection:. Adding an event to a full collection evicts that collection's
+ oldest events, leaving every other collection alone. 0 means no cap. Defaults to 0.
+ */
+@property (nonatomic) NSUInteger maxEventsPerCollection;
+
+/**
+ How many events are evicted from a full collection at once, so a collection that stays full
+ doesn't evict on every add. At least enough events are evicted to make room. Defaults to 1.
+ */
+@property (nonatomic) NSUInteger eventsToEvictPerCollection;
+
+/**
+ The most bytes of event data kept for each project. Adding an event that would go over evicts the
+ project's oldest events first. 0 means no budget. Defaults to kKeenMaxBytesPerProject, 20 MB.
+ */
+@property (nonatomic) NSUInteger maxBytesPerProject;
+
+/**
+ How many bytes under a budget the store evicts down to once an event would go over it, so a
+ budget that stays full doesn't evict on every add. Defaults to kKeenBytesToEvictOverBudget, 512 KB.
+ */
+@property (nonatomic) NSUInteger bytesToEvictOverBudget;
+
+/**
+ The most bytes of event data kept across every project. Adding an event that would go over evicts
+ the oldest events in the store first. 0 means no budget. Defaults to kKeenMaxTotalBytes, 50 MB.
+
+ Events larger than either budget on their own aren't added. Budgets count the bytes as stored,
+ after compression. Leased events are on their way to the server and are never evicted, so a
+ budget can be exceeded while they're in flight.
+ */
+@property (nonatomic) NSUInteger maxTotalBytes;
+
+/**
+ When enabled, the store does some upkeep on the database file once it has gone
+ maintenanceIdleInterval seconds without being used: free pages left behind by deleted events are
+ given back to the file system, and the WAL is checkpointed. A database created before the store
+ used incremental auto-vacuum only gets its WAL checkpointed, until performMaintenance converts it.
+ Defaults to YES.
+ */
+@property (nonatomic) BOOL maintenanceEnabled;
+
+/**
+ How long the store must go unused before maintenance runs, in seconds. Defaults to 30.
+ */
+@property (nonatomic) NSTimeInterval maintenanceIdleInterval;
+
+/**
+ The most free pages given back to the file system by each maintenance run, so a run never holds
+ the database for long. 0 is treated as 1. Defaults to 256.
+ */
+@property (nonatomic) NSUInteger maintenancePagesPerRun;
+
+/**
+ How many times maintenance has run.
+ */
+@property (readonly) NSUInteger maintenanceRunCount;
+
+/**
+ How many pages maintenance has given back to the file system in total.
+ */
+@property (readonly) NSUInteger maintenancePagesReclaimed;
+
+/**
+ How long maintenance has spent running in total, in seconds.
+ */
+@property (readonly) NSTimeInterval maintenanceTimeSpent;
+
+/**
+ Run maintenance now, without waiting for the store to go idle.
+
+ A database created before the store used incremental auto-vacuum is rebuilt to switch it over,
+ which reclaims every free page at once. That rewrites the whole file and holds the database
+ until it's done, so call this when the app can afford the wait. It only happens once.
+ */
+- (void)performMaintenance;
+
+/**
+ How long opening, migrating and configuring the database took when the store was created, in
+ seconds, or 0 if it isn't ready yet. Statements aren't prepared until they're first used, so
+ they don't count towards it.
+ */
+@property (readonly) NSTimeInterval openDuration;
+
+/**
+ How long after init started the first event was written, in seconds, or 0 if no event has been
+ written yet. Includes the open and whatever the app did before adding its first event.
+ */
+@property (readonly) NSTimeInterval timeToFirstEvent;
+
+/**
+ The number of statements currently prepared on the write connection. Statements are prepared
+ the first time they're used and kept until the database is closed.
+ */
+@property (readonly) NSUInteger preparedStatementCount;
+
+/**
+ Whether the store times each statement run on the write connection, and how long each block
+ handed to the database queue waits and runs, for profileSnapshot. Off by default, and cheap
+ enough to leave on for a slow device in the field. Doesn't log anything.
+ */
+@property (nonatomic) BOOL profilingEnabled;
+
+/**
+ The timings collected since profiling was turned on, or since the last resetProfile. Stays
+ empty unless profilingEnabled is set.
+
+ @return kKIODBStoreProfile keys and values.
+ */
+- (NSDictionary<NSString *, id> *)profileSnapshot;
+
+/**
+ Drop the timings collected so far.
+ */
+- (void)resetProfile;
+
+/**
+ The upper bound of each histogram bucket in a profile snapshot, in seconds. The histograms have
+ one more bucket, for anything slower. SQLite only times statements to the millisecond, so
+ statements faster than that land in the first bucket.
+ */
++ (NSArray<NSNumber *> *)profileHistogramBounds;
+
+/**
+ Set the cap for one collection, overriding maxEventsPerCollection and any cap set for its project.
+
+ @param maxEvents The most events kept in the collection. 0 means no cap.
+ @param collection The collection to cap.
+ */
+- (void)setMaxEvents:(NSUInteger)maxEvents forCollection:(NSString *)collection;
+
+/**
+ The cap for a collection, which is maxEventsPerCollection unless it has its own.
+
+ @param collection The collection.
+ */
+- (NSUInteger)maxEventsForCollection:(NSString *)collection;
+
+/**
+ Write any events queued by group commit, returning once they have been committed.
+ */
+- (void)flush;
+
 /**
  Reset any pending events so they can be resent.
  */
@@ -35,12 +360,105 @@
  */
 - (BOOL)addEvent:(NSData *)eventData collection:(NSString *)eventCollection projectID:(NSString *)projectID;
 
+/**
+ Add an event to the store without waiting on the database queue. The event is compressed on the
+ calling thread, then written in the background.
+
+ @param eventData Your event data.
+ @param eventCollection Your event collection.
+ @param projectID Project ID to add the event to.
+ @param completionQueue The queue the completion handler is called on. Pass nil for the main queue.
+ @param completionHandler Called with whether the event was stored, once it has been written or
+                          dropped. With group commit, that's when its batch is written. May be nil.
+ */
+- (void)addEvent:(NSData *)eventData
+           collection:(NSString *)eventCollection
+            projectID:(NSString *)projectID
+      completionQueue:(dispatch_queue_t)completionQueue
+    completionHandler:(void (^)(BOOL stored))completionHandler;
+
 /**
  Get a dictionary of events keyed by id that are ready to send to Keen. Events
  that are returned have been flagged as pending in the underlying store.
  */
 - (NSMutableDictionary *)getEventsWithMaxAttempts:(int)maxAttempts andProjectID:(NSString *)projectID;
 
+/**
+ Claim a batch of events for upload under a lease. Events that are leased are flagged as
+ pending and won't be claimed again until the lease expires or is released, so an upload
+ that crashes or hangs gives its events back on its own.
+
+ @param maxAttempts Only events with fewer attempts than this are claimed.
+ @param projectID Project ID to claim events from.
+ @param limit The most events to claim, oldest first. 0 claims every event available.
+ @param leaseDuration How long, in seconds, the events are held.
+ @param leaseID Set to the id of the new lease, or nil if nothing was claimed.
+ @return A dictionary of collections to dictionaries of event data keyed by id.
+ */
+- (NSMutableDictionary *)claimEventsWithMaxAttempts:(int)maxAttempts
+                                          projectID:(NSString *)projectID
+                                              limit:(NSUInteger)limit
+                                      leaseDuration:(NSTimeInterval)leaseDuration
+                                            leaseID:(NSNumber **)leaseID;
+
+/**
+ Claim one page of events for upload under a lease. Paging through the store a page at a
+ time keeps the memory held by claimed events bounded no matter how many are stored.
+
+ @param maxAttempts Only events with fewer attempts than this are claimed.
+ @param projectID Project ID to claim events from.
+ @param afterEventID Only events with a greater id are claimed. Pass nil to start from the oldest event.
+ @param maxEvents The most events to claim, oldest first. 0 means no limit.
+ @param maxBytes The most event data to claim, in bytes. At least one event is claimed
+                 even if it is larger than this. 0 means no limit.
+ @param leaseDuration How long, in seconds, the events are held.
+ @param leaseID Set to the id of the new lease, or nil if nothing was claimed.
+ @param lastEventID Set to the id of the last event claimed, or nil if nothing was claimed.
+                    Pass it as afterEventID to claim the next page.
+ @return A dictionary of collections to dictionaries of event data keyed by id.
+ */
+- (NSMutableDictionary *)claimEventsWithMaxAttempts:(int)maxAttempts
+                                          projectID:(NSString *)projectID
+                                       afterEventID:(NSNumber *)afterEventID
+                                          maxEvents:(NSUInteger)maxEvents
+                                           maxBytes:(NSUInteger)maxBytes
+                                      leaseDuration:(NSTimeInterval)leaseDuration
+                                            leaseID:(NSNumber **)leaseID
+                                        lastEventID:(NSNumber **)lastEventID;
+
+/**
+ Claim one page of events for upload under a lease, like claimEvents, but return them as a
+ single KIOEventBatch. The event data is copied from the database into one buffer instead of
+ an NSData per event, which keeps allocations flat as pages get larger.
+
+ @param maxAttempts Only events with fewer attempts than this are claimed.
+ @param projectID Project ID to claim events from.
+ @param afterEventID Only events with a greater id are claimed. Pass nil to start from the oldest event.
+ @param maxEvents The most events to claim, oldest first. 0 means no limit.
+ @param maxBytes The most event data to claim, in bytes. At least one event is claimed
+                 even if it is larger than this. 0 means no limit.
+ @param leaseDuration How long, in seconds, the events are held.
+ @param leaseID Set to the id of the new lease, or nil if nothing was claimed.
+ @param lastEventID Set to the id of the last event claimed, or nil if nothing was claimed.
+ @return The claimed events, which is empty if nothing was claimed.
+ */
+- (KIOEventBatch *)claimEventBatchWithMaxAttempts:(int)maxAttempts
+                                        projectID:(NSString *)projectID
+                                     afterEventID:(NSNumber *)afterEventID
+                                        maxEvents:(NSUInteger)maxEvents
+                                         maxBytes:(NSUInteger)maxBytes
+                                    leaseDuration:(NSTimeInterval)leaseDuration
+                                          leaseID:(NSNumber **)leaseID
+                                      lastEventID:(NSNumber **)lastEventID;
+
+/**
+ Release a lease taken by claimEvents, making any of its events that are still in the
+ store available to be claimed again.
+
+ @param leaseID The lease id returned by claimEvents.
+ */
+- (void)releaseLease:(NSNumber *)leaseID;
+
 /**
  Get a count of pending events.
  */
@@ -51,6 +469,27 @@
  */
 - (NSUInteger)getTotalEventCountWithProjectID:(NSString *)projectID;
 
+/**
+ Get a count of the events in one collection, pending or not.
+
+ @param projectID Your project ID.
+ @param collection Your event collection.
+ */
+- (NSUInteger)getEventCountWithProjectID:(NSString *)projectID collection:(NSString *)collection;
+
+/**
+ Get the bytes of event data stored for a project, as stored after compression. Kept up to date
+ as events are added and deleted, so it doesn't scan the table.
+
+ @param projectID Your project ID.
+ */
+- (unsigned long long)getBytesUsedWithProjectID:(NSString *)projectID;
+
+/**
+ Get the bytes of event data stored across every project, as stored after compression.
+ */
+- (unsigned long long)getTotalBytesUsed;
+
 /**
  Purge pending events that were returned from a previous call to getEvents.
  */
@@ -63,6 +502,13 @@
  */
 - (void)deleteEvent:(NSNumber *)eventId;
 
+/**
+ Delete a set of events from the store in a single transaction.
+
+ @param eventIds The ids of the events to delete.
+ */
+- (void)deleteEvents:(NSArray<NSNumber *> *)eventIds;
+
 /**
  Delete all events from the store
  */
@@ -74,9 +520,18 @@
 - (void)incrementEventUploadAttempts:(NSNumber *)eventId;
 
 /**
- Delete events starting at an offset. Helps to keep the "queue" bounded.
+ Increment the `attempts` column of a set of events in a single transaction.
+
+ @param eventIds The ids of the events to increment.
+ */
+- (void)incrementUploadAttemptsForEvents:(NSArray<NSNumber *> *)eventIds;
+
+/**
+ Delete the oldest events so only the newest `offset` are kept, across every project and
+ collection. The SDK never calls this itself; it's only for apps that want to trim the store
+ by hand. Use maxEventsPerCollection to keep each collection bounded on its own.
 
- @param offset The offset to start deleting events from.
+ @param offset The number of events, newest first, to keep.
  */
 - (void)deleteEventsFromOffset:(NSNumber *)offset;
 
@@ -84,6 +539,7 @@
  Add a query to the store.
 
  @param queryData Your query data.
+ @param queryType The type of query, such as `count`.
  @param eventCollection Your event collection.
  @param projectID Your project ID.
  */
@@ -96,6 +552,7 @@
  Get a dictionary of the found query parameters.
 
  @param queryData Your query data.
+ @param queryType The type of query, such as `count`.
  @param eventCollection Your event collection.
  @param projectID Your project ID.
  */
@@ -115,6 +572,7 @@
  Helper method to find or update the `attempts` column of a query.
 
  @param queryData Your query data.
+ @param queryType The type of query, such as `count`.
  @param eventCollection Your event collection.
  @param projectID Your project ID.
  */
@@ -123,6 +581,22 @@
                collection:(NSString *)eventCollection
                 projectID:(NSString *)projectID;
 
+/**
+ Like findOrUpdateQuery:queryType:collection:projectID:, but a stored query older than queryTTL
+ is treated as missing, so a new row is added instead of its attempts being incremented.
+
+ @param queryData Your query data.
+ @param queryType The type of query, such as `count`.
+ @param eventCollection Your event collection.
+ @param projectID Your project ID.
+ @param queryTTL The age in seconds past which stored queries are ignored.
+ */
+- (void)findOrUpdateQuery:(NSData *)queryData
+                queryType:(NSString *)queryType
+               collection:(NSString *)eventCollection
+                projectID:(NSString *)projectID
+                 queryTTL:(int)queryTTL;
+
 /**
  Get a count of total queries.
 
@@ -135,10 +609,12 @@
  the maxAttempts value.
 
  @param queryData Your query data.
+ @param queryType The type of query, such as `count`.
  @param eventCollection Your event collection.
  @param projectID Your project ID.
  @param maxAttempts The threshold for trying a query API call.
- @param queryTTL The threshold in seconds for deleting old queries.
+ @param queryTTL The threshold in seconds for deleting old queries. Older queries are ignored, and
+                 deleted in the background at most once every querySweepInterval seconds.
  */
 - (BOOL)hasQueryWithMaxAttempts:(NSData *)queryData
                       queryType:(NSString *)queryType
@@ -147,6 +623,12 @@
                     maxAttempts:(int)maxAttempts
                        queryTTL:(int)queryTTL;
 
+/**
+ How often hasQueryWithMaxAttempts: sweeps queries older than its queryTTL out of the database,
+ in seconds. Defaults to 60.
+ */
+@property NSTimeInterval querySweepInterval;
+
 /**
  Delete all the queries older than X seconds.
 
@@ -9,8 +9,251 @@
 #import "KeenClient.h"
 #import "KIODBStore.h"
 #import "KIODBStorePrivate.h"
+#import "KeenConstants.h"
 #import "keen_io_sqlite3.h"
 
+#import <zlib.h>
+
+// The number of ids bound to each of the bulk event statements.
+static const int kKIOBulkStatementSize = 100;
+
+// The path SQLite opens as a private, in-memory database.
+static NSString *const kKIOInMemoryDatabasePath = @":memory:";
+
+// SQLite's page cache is preallocated as one block of slots shared by every connection, instead of
+// a malloc per page. A slot holds a 4 KB page plus SQLite's per-page header. Databases with larger
+// pages, and pages past the last slot, fall back to malloc.
+static const int kKIOPageCacheSlotSize = 4096 + 512;
+static const int kKIOPageCacheSlotCount = 256;
+
+// LOOKUP STATEMENTS
+
+// Events refer to their project and collection by the integer key of a row in these tables.
+static NSString *const kKIOFindProjectKeySQL = @"SELECT id FROM projects WHERE projectID=?";
+static NSString *const kKIOInsertProjectSQL = @"INSERT INTO projects (projectID) VALUES (?)";
+static NSString *const kKIOFindCollectionKeySQL = @"SELECT id FROM collections WHERE collection=?";
+static NSString *const kKIOInsertCollectionSQL = @"INSERT INTO collections (collection) VALUES (?)";
+
+// EVENT STATEMENTS
+
+// This statement inserts events into the table.
+static NSString *const kKIOInsertEventSQL =
+    @"INSERT INTO events (projectKey, collectionKey, eventData, pending, attempts, codec) "
+    @"VALUES (?, ?, ?, 0, 0, ?)";
+
+// This statement finds events that aren't leased, or whose lease has expired.
+static NSString *const kKIOFindEventSQL =
+    @"SELECT events.id, collections.collection, eventData, pending, codec FROM events "
+    @"LEFT JOIN collections ON collections.id=collectionKey WHERE projectKey=? AND "
+    @"leaseExpiry<=? AND attempts<? AND events.id>? ORDER BY events.id LIMIT ?";
+
+// This statement finds the project and pending state of a specific event.
+static NSString *const kKIOFindEventByIDSQL =
+    @"SELECT projects.projectID, pending, collections.collection, length(eventData) FROM events "
+    @"LEFT JOIN projects ON projects.id=projectKey LEFT JOIN collections ON collections.id=collectionKey "
+    @"WHERE events.id=?";
+
+// This statement counts the total number of events (pending or not)
+static NSString *const kKIOCountAllEventsSQL = @"SELECT count(*) FROM events WHERE projectKey=?";
+
+// This statement counts the number of pending events.
+static NSString *const kKIOCountPendingEventsSQL = @"SELECT count(*) FROM events WHERE pending=1 AND projectKey=?";
+
+// These statements count events the same way on the read connection, which looks the project's key up
+// itself since the keys cached for the writer are only touched on the dbQueue.
+static NSString *const kKIOReadCountAllEventsSQL =
+    @"SELECT count(*) FROM events WHERE projectKey=(SELECT id FROM projects WHERE projectID=?)";
+
+static NSString *const kKIOReadCountPendingEventsSQL =
+    @"SELECT count(*) FROM events WHERE pending=1 AND projectKey=(SELECT id FROM projects WHERE projectID=?)";
+
+// This statement leases a batch of claimable events, marking them pending.
+static NSString *const kKIOClaimEventsSQL =
+    @"UPDATE events SET pending=1, leaseID=?, leaseExpiry=? WHERE projectKey=? AND "
+    @"leaseExpiry<=? AND attempts<? AND id>? AND id<=?";
+
+// This statement expires a lease so its events can be claimed again.
+static NSString *const kKIOReleaseLeaseSQL = @"UPDATE events SET leaseExpiry=0 WHERE leaseID=?";
+
+// This statement resets pending events back to normal.
+static NSString *const kKIOResetPendingEventsSQL =
+    @"UPDATE events SET pending=0, leaseID=NULL, leaseExpiry=0 WHERE pending=1 AND "
+    @"projectKey=?";
+
+// This statement purges all pending events.
+static NSString *const kKIOPurgeEventsSQL = @"DELETE FROM events WHERE pending=1 AND projectKey=?";
+
+// This statement deletes a specific event.
+static NSString *const kKIODeleteEventSQL = @"DELETE FROM events WHERE id=?";
+
+// This statement deletes all events.
+static NSString *const kKIODeleteAllEventsSQL = @"DELETE FROM events";
+
+// This statement deletes every event up to and including a watermark id, found with
+// kKIOFindAgeOutWatermarkSQL.
+static NSString *const kKIOAgeOutEventsSQL = @"DELETE FROM events WHERE id <= ?";
+
+// This statement finds the newest event to age out, counting up from the oldest event so it only
+// walks the events being aged out.
+static NSString *const kKIOFindAgeOutWatermarkSQL = @"SELECT id FROM events ORDER BY id LIMIT 1 OFFSET ?";
+
+// This statement counts the events, and their bytes, up to an id by project, pending state and collection.
+static NSString *const kKIOCountEventsThroughIDSQL =
+    @"SELECT projects.projectID, pending, count(*), collections.collection, total(length(eventData)) FROM events "
+    @"LEFT JOIN projects ON projects.id=projectKey LEFT JOIN collections ON collections.id=collectionKey "
+    @"WHERE events.id <= ? GROUP BY projectKey, pending, collectionKey";
+
+// This statement counts every event.
+static NSString *const kKIOCountEveryEventSQL = @"SELECT count(*) FROM events";
+
+// This statement counts the events in a collection.
+static NSString *const kKIOCountCollectionEventsSQL =
+    @"SELECT count(*) FROM events WHERE projectKey=? AND collectionKey=?";
+
+// This statement finds the oldest events in a collection.
+static NSString *const kKIOFindOldestCollectionEventsSQL =
+    @"SELECT id, pending, length(eventData) FROM events WHERE projectKey=? AND collectionKey=? "
+    @"ORDER BY id LIMIT ?";
+
+// This statement deletes the events in a collection up to an id.
+static NSString *const kKIOEvictCollectionEventsSQL =
+    @"DELETE FROM events WHERE projectKey=? AND collectionKey=? AND id<=?";
+
+// This statement sums the bytes of a project's events.
+static NSString *const kKIOSumProjectBytesSQL = @"SELECT total(length(eventData)) FROM events WHERE projectKey=?";
+
+// This statement sums the bytes of every event.
+static NSString *const kKIOSumAllBytesSQL = @"SELECT total(length(eventData)) FROM events";
+
+// These statements find the oldest events that aren't leased in a project, or across every project.
+// They're stepped only until enough bytes are found, so the project's are read from an index already
+// in id order rather than sorted.
+static NSString *const kKIOFindOldestProjectEventsSQL =
+    @"SELECT events.id, projects.projectID, pending, length(eventData), collections.collection FROM events "
+    @"INDEXED BY events_projectKey_id "
+    @"LEFT JOIN projects ON projects.id=projectKey LEFT JOIN collections ON collections.id=collectionKey "
+    @"WHERE projectKey=? AND leaseExpiry<=? ORDER BY events.id";
+
+static NSString *const kKIOFindOldestEventsSQL =
+    @"SELECT events.id, projects.projectID, pending, length(eventData), collections.collection FROM events "
+    @"LEFT JOIN projects ON projects.id=projectKey LEFT JOIN collections ON collections.id=collectionKey "
+    @"WHERE leaseExpiry<=? ORDER BY events.id";
+
+// These statements delete the events that aren't leased in a project, or across every project, up to an id.
+static NSString *const kKIOEvictProjectEventsSQL =
+    @"DELETE FROM events WHERE projectKey=? AND leaseExpiry<=? AND id<=?";
+
+static NSString *const kKIOEvictEventsSQL = @"DELETE FROM events WHERE leaseExpiry<=? AND id<=?";
+
+// This statement increments the attempts count of an event.
+static NSString *const kKIOIncrementEventAttemptsSQL = @"UPDATE events SET attempts = attempts + 1 WHERE id=?";
+
+// QUERY STATEMENTS
+
+// This statement inserts queries into the table.
+static NSString *const kKIOInsertQuerySQL =
+    @"INSERT INTO queries (projectID, collection, queryData, queryType, attempts, queryHash) VALUES "
+    @"(?, ?, ?, ?, 0, ?)";
+
+// This statement counts the total number of queries
+static NSString *const kKIOCountAllQueriesSQL = @"SELECT count(*) FROM queries WHERE projectID=?";
+
+// This statement searches for and returns a query. The query's hash finds the candidate rows, and
+// the rest confirm the match. Without the index hint SQLite prefers the index with more columns.
+// When a TTL is bound, queries past it that haven't been swept yet are skipped; a NULL TTL matches any age.
+static NSString *const kKIOGetQuerySQL =
+    @"SELECT id, collection, queryData, queryType, attempts FROM queries INDEXED BY queries_queryHash WHERE "
+    @"projectID=? AND collection=? AND queryData=? AND queryType=? AND queryHash=? AND "
+    @"(?6 IS NULL OR dateCreated > datetime('now', ?6))";
+
+// This statement searches for and returns a query given an attempts value. Looked up the same way,
+// skipping queries past their TTL that haven't been swept yet.
+static NSString *const kKIOGetQueryWithAttemptsSQL =
+    @"SELECT id FROM queries INDEXED BY queries_queryHash WHERE projectID=? AND collection=? AND queryData=? AND "
+    @"queryType=? AND attempts >=? AND queryHash=? AND dateCreated > datetime('now', ?)";
+
+// This statement increments the attempts count of a query.
+static NSString *const kKIOIncrementQueryAttemptsSQL = @"UPDATE queries SET attempts = attempts + 1 WHERE id=?";
+
+// This statement deletes all queries.
+static NSString *const kKIODeleteAllQueriesSQL = @"DELETE FROM queries";
+
+// This statement deletes old queries at a given time.
+static NSString *const kKIOAgeOutQueriesSQL = @"DELETE FROM queries WHERE dateCreated <= datetime('now', ?)";
+
+// 64-bit FNV-1a, used to hash queries.
+static const uint64_t kKIOFNVOffsetBasis = 14695981039346656037ULL;
+static const uint64_t kKIOFNVPrime = 1099511628211ULL;
+
+static uint64_t KIOHashBytes(uint64_t hash, const void *bytes, size_t length) {
+    const uint8_t *byte = bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= byte[i];
+        hash *= kKIOFNVPrime;
+    }
+    return hash;
+}
+
+// Includes the terminating NUL, so consecutive strings can't run together.
+static uint64_t KIOHashString(uint64_t hash, NSString *string) {
+    const char *stringUTF8 = string.UTF8String ?: "";
+    return KIOHashBytes(hash, stringUTF8, strlen(stringUTF8) + 1);
+}
+
+// Hashes a parsed JSON value, visiting dictionary keys in sorted order so the hash doesn't depend
+// on the order they were serialized in.
+static uint64_t KIOHashJSONObject(uint64_t hash, id object) {
+    if ([object isKindOfClass:[NSDictionary class]]) {
+        hash = KIOHashBytes(hash, "{", 1);
+        for (NSString *key in [[object allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+            hash = KIOHashString(hash, key);
+            hash = KIOHashJSONObject(hash, [object objectForKey:key]);
+        }
+        return KIOHashBytes(hash, "}", 1);
+    } else if ([object isKindOfClass:[NSArray class]]) {
+        hash = KIOHashBytes(hash, "[", 1);
+        for (id element in object) {
+            hash = KIOHashJSONObject(hash, element);
+        }
+        return KIOHashBytes(hash, "]", 1);
+    } else if ([object isKindOfClass:[NSString class]]) {
+        return KIOHashString(KIOHashBytes(hash, "\"", 1), object);
+    } else if ([object isKindOfClass:[NSNumber class]]) {
+        return KIOHashString(KIOHashBytes(hash, "#", 1), [object stringValue]);
+    }
+    return KIOHashBytes(hash, "null", 4);
+}
+
+// The bulk statements take a fixed number of ids, with NULL bound to any that aren't used. They're
+// built once, in +initialize.
+static NSString *kKIOCountEventsByIDsSQL;
+static NSString *kKIODeleteEventsByIDsSQL;
+static NSString *kKIOIncrementEventsAttemptsByIDsSQL;
+
+NSString *const kKIODBStoreOptionDurability = @"durability";
+NSString *const kKIODBStoreOptionConcurrentReads = @"concurrentReads";
+NSString *const kKIODBStoreOptionGroupCommit = @"groupCommit";
+NSString *const kKIODBStoreOptionCompression = @"compression";
+NSString *const kKIODBStoreOptionAsyncWarmUp = @"asyncWarmUp";
+NSString *const kKIODBStoreOptionMmapSize = @"mmapSize";
+NSString *const kKIODBStoreOptionPageSize = @"pageSize";
+NSString *const kKIODBStoreOptionProfiling = @"profiling";
+
+NSString *const kKIODBStoreProfileStatements = @"statements";
+NSString *const kKIODBStoreProfileQueueWait = @"queueWait";
+NSString *const kKIODBStoreProfileQueueRun = @"queueRun";
+NSString *const kKIODBStoreProfileCount = @"count";
+NSString *const kKIODBStoreProfileTotalTime = @"totalTime";
+NSString *const kKIODBStoreProfileHistogram = @"histogram";
+
+// Upper bounds of the profile histogram buckets, in seconds. Anything slower lands in one last bucket.
+static const NSTimeInterval kKIOProfileHistogramBounds[] = {0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1};
+static const NSUInteger kKIOProfileBucketCount =
+    sizeof(kKIOProfileHistogramBounds) / sizeof(kKIOProfileHistogramBounds[0]) + 1;
+
+// Options for sharedInstance, set with setSharedInstanceOptions:.
+static NSDictionary *s_sharedInstanceOptions;
+
 @interface KIODBStore ()
 
 - (void)closeDB;
@@ -20,45 +263,282 @@
 // A dispatch queue used for sqlite.
 @property (nonatomic) dispatch_queue_t dbQueue;
 
+// A dispatch queue for the read-only connection, which lives as long as the store does.
+@property (nonatomic) dispatch_queue_t readQueue;
+
+@property (readwrite) NSUInteger maintenanceRunCount;
+@property (readwrite) NSUInteger maintenancePagesReclaimed;
+@property (readwrite) NSTimeInterval maintenanceTimeSpent;
+@property (readwrite) NSTimeInterval timeToFirstEvent;
+
+@end
+
+// An event waiting to be written by group commit.
+@interface KIOQueuedEvent : NSObject
+
+@property (nonatomic) NSData *eventData;
+@property (nonatomic) NSString *collection;
+@property (nonatomic) NSString *projectID;
+@property (nonatomic) KIODBStoreCompression codec;
+
+// Called on completionQueue once the event has been written or dropped, for addEvent:...completionHandler:.
+@property (nonatomic, copy) void (^completionHandler)(BOOL stored);
+@property (nonatomic) dispatch_queue_t completionQueue;
+
++ (instancetype)eventWithData:(NSData *)eventData
+                   collection:(NSString *)collection
+                    projectID:(NSString *)projectID
+                        codec:(KIODBStoreCompression)codec;
+
+- (void)reportStored:(BOOL)stored;
+
+@end
+
+// How many times something ran and how long it took, for profiling.
+@interface KIOProfileTimings : NSObject
+
+- (void)addDuration:(NSTimeInterval)duration;
+
+// The timings as kKIODBStoreProfileCount, kKIODBStoreProfileTotalTime and kKIODBStoreProfileHistogram.
+- (NSDictionary<NSString *, id> *)snapshot;
+
+@end
+
+@implementation KIOProfileTimings {
+    unsigned long long count;
+    NSTimeInterval totalTime;
+    unsigned long long histogram[kKIOProfileBucketCount];
+}
+
+- (void)addDuration:(NSTimeInterval)duration {
+    NSUInteger bucket = 0;
+    while (bucket < kKIOProfileBucketCount - 1 && duration > kKIOProfileHistogramBounds[bucket]) {
+        bucket++;
+    }
+    histogram[bucket]++;
+    count++;
+    totalTime += duration;
+}
+
+- (NSDictionary<NSString *, id> *)snapshot {
+    NSMutableArray *buckets = [NSMutableArray arrayWithCapacity:kKIOProfileBucketCount];
+    for (NSUInteger bucket = 0; bucket < kKIOProfileBucketCount; bucket++) {
+        [buckets addObject:[NSNumber numberWithUnsignedLongLong:histogram[bucket]]];
+    }
+    return @{
+        kKIODBStoreProfileCount: [NSNumber numberWithUnsignedLongLong:count],
+        kKIODBStoreProfileTotalTime: [NSNumber numberWithDouble:totalTime],
+        kKIODBStoreProfileHistogram: buckets
+    };
+}
+
+@end
+
+@implementation KIOQueuedEvent
+
++ (instancetype)eventWithData:(NSData *)eventData
+                   collection:(NSString *)collection
+                    projectID:(NSString *)projectID
+                        codec:(KIODBStoreCompression)codec {
+    // Copy everything since the caller is free to change it once addEvent returns.
+    KIOQueuedEvent *queuedEvent = [self new];
+    queuedEvent.eventData = [eventData copy];
+    queuedEvent.collection = [collection copy];
+    queuedEvent.projectID = [projectID copy];
+    queuedEvent.codec = codec;
+    return queuedEvent;
+}
+
+- (void)reportStored:(BOOL)stored {
+    void (^completionHandler)(BOOL) = self.completionHandler;
+    if (completionHandler) {
+        dispatch_async(self.completionQueue ?: dispatch_get_main_queue(), ^{
+            completionHandler(stored);
+        });
+    }
+}
+
 @end
 
 @implementation KIODBStore {
     keen_io_sqlite3 *keen_dbname;
     BOOL dbIsOpen;
-    NSLock *openLock;
-
-    // Keen Event SQL Statements
-    keen_io_sqlite3_stmt *insert_event_stmt;
-    keen_io_sqlite3_stmt *find_event_stmt;
-    keen_io_sqlite3_stmt *count_all_events_stmt;
-    keen_io_sqlite3_stmt *count_pending_events_stmt;
-    keen_io_sqlite3_stmt *make_pending_event_stmt;
-    keen_io_sqlite3_stmt *reset_pending_events_stmt;
-    keen_io_sqlite3_stmt *purge_events_stmt;
-    keen_io_sqlite3_stmt *delete_event_stmt;
-    keen_io_sqlite3_stmt *delete_all_events_stmt;
-    keen_io_sqlite3_stmt *increment_event_attempts_statement;
-    keen_io_sqlite3_stmt *delete_too_many_attempts_events_statement;
-    keen_io_sqlite3_stmt *age_out_events_stmt;
-
-    // Keen Query SQL Statements
-    keen_io_sqlite3_stmt *insert_query_stmt;
-    keen_io_sqlite3_stmt *count_all_queries_stmt;
-    keen_io_sqlite3_stmt *get_query_stmt;
-    keen_io_sqlite3_stmt *get_query_with_attempts_stmt;
-    keen_io_sqlite3_stmt *increment_query_attempts_statement;
-    keen_io_sqlite3_stmt *delete_all_queries_stmt;
-    keen_io_sqlite3_stmt *age_out_queries_stmt;
+    // Recursive so a background warm-up can keep holding it while it hands off buffered events.
+    NSRecursiveLock *openLock;
+
+    // Whether to open the database in the background, from kKIODBStoreOptionAsyncWarmUp.
+    BOOL asyncWarmUp;
+    // Events added before the store is ready, and blocks waiting for it to be. Only touched
+    // while holding warmUpLock, and nil once the store is ready.
+    NSMutableArray *warmUpEvents;
+    NSMutableArray *readyBlocks;
+    BOOL isReady;
+    NSLock *warmUpLock;
+
+    // When expired queries were last swept. Only touched while holding querySweepLock.
+    CFAbsoluteTime lastQuerySweepTime;
+    NSLock *querySweepLock;
+
+    // Per-project event counts keyed by projectID, seeded from the database the first time
+    // a project's count is needed and kept up to date from then on. Only changed on the dbQueue,
+    // and only touched while holding countsLock.
+    NSMutableDictionary *totalEventCounts;
+    NSMutableDictionary *pendingEventCounts;
+    NSLock *countsLock;
+
+    // Events across every project, kept the same way, with a nil eventCountAcrossProjects until it's seeded.
+    NSNumber *eventCountAcrossProjects;
+
+    // Per-collection event counts, keyed by projectID and then collection, for the collections
+    // that are capped. Kept the same way as the counts above.
+    NSMutableDictionary *collectionEventCounts;
+
+    // Caps set with setMaxEvents:forCollection:, keyed by collection. Only touched while holding countsLock.
+    NSMutableDictionary *collectionCaps;
+
+    // Caps and eviction batches set with setMaxEventsPerCollection:eventsToEvict:forProjectID:, keyed by
+    // projectID. Only touched while holding countsLock.
+    NSMutableDictionary *projectCollectionCaps;
+    NSMutableDictionary *projectEvictionBatches;
+
+    // Bytes of stored event data keyed by projectID, and across every project. Kept the same
+    // way as the counts above, with a nil totalBytesUsed until it's seeded.
+    NSMutableDictionary *projectBytesUsed;
+    NSNumber *totalBytesUsed;
+
+    // Writes the caller has handed off that the dbQueue hasn't finished yet: async blocks
+    // plus events waiting on group commit. Reads only skip the dbQueue while this is 0, so
+    // they still see everything added before them. Only touched while holding countsLock.
+    NSUInteger unfinishedWriteCount;
+
+    // The read-only connection used for concurrent reads. Only touched on the readQueue.
+    keen_io_sqlite3 *keen_readdb;
+
+    // Events added in group commit mode that haven't been written yet. Only touched on the dbQueue.
+    NSMutableArray *queuedEvents;
+    BOOL isQueuedEventsWriteScheduled;
+
+    // The most recently handed out lease id. Only touched on the dbQueue.
+    long long lastLeaseID;
+
+    // When the store was last used, and whether a maintenance run is waiting for it to go idle.
+    // Only touched on the dbQueue.
+    CFAbsoluteTime lastActivityTime;
+    BOOL isMaintenanceScheduled;
+
+    // Statements prepared on first use, keyed by their SQL. Only touched on the dbQueue.
+    NSMutableDictionary<NSString *, NSValue *> *statementCache;
+
+    // Keys of the rows in the projects and collections tables, by name, as they're looked up.
+    // Only touched on the dbQueue.
+    NSMutableDictionary<NSString *, NSNumber *> *projectKeys;
+    NSMutableDictionary<NSString *, NSNumber *> *collectionKeys;
+
+    // When init started opening the database, and when the first event was written. Used for the
+    // startup metrics.
+    CFAbsoluteTime initTime;
+    BOOL hasWrittenEvent;
+
+    // Timings kept while profilingEnabled is set, by statement SQL, and for blocks on the dbQueue.
+    // Only touched while holding profileLock.
+    NSMutableDictionary<NSString *, KIOProfileTimings *> *statementTimings;
+    KIOProfileTimings *queueWaitTimings;
+    KIOProfileTimings *queueRunTimings;
+    NSLock *profileLock;
+
+    // Every dictionary stored events may have been compressed with, keyed by the Adler-32 checksum
+    // zlib records in the header of each event compressed with one. Replaced rather than changed,
+    // and only touched while holding compressionLock.
+    NSDictionary<NSNumber *, NSData *> *compressionDictionaries;
+    NSLock *compressionLock;
+
+    // Read Connection SQL Statements
+    keen_io_sqlite3_stmt *read_count_all_events_stmt;
+    keen_io_sqlite3_stmt *read_count_pending_events_stmt;
+    keen_io_sqlite3_stmt *read_count_all_queries_stmt;
+    keen_io_sqlite3_stmt *read_get_query_stmt;
+}
+
++ (void)initialize {
+    if (self != [KIODBStore class]) {
+        return;
+    }
+
+    NSMutableArray *placeholders = [NSMutableArray arrayWithCapacity:kKIOBulkStatementSize];
+    for (int i = 0; i < kKIOBulkStatementSize; i++) {
+        [placeholders addObject:@"?"];
+    }
+    NSString *eventIDList = [placeholders componentsJoinedByString:@","];
+
+    // This statement counts a set of events, and their bytes, by project, pending state and collection.
+    kKIOCountEventsByIDsSQL = [NSString
+        stringWithFormat:@"SELECT projects.projectID, pending, count(*), collections.collection, "
+                         @"total(length(eventData)) FROM events LEFT JOIN projects ON projects.id=projectKey "
+                         @"LEFT JOIN collections ON collections.id=collectionKey WHERE events.id IN (%@) "
+                         @"GROUP BY projectKey, pending, collectionKey",
+                         eventIDList];
+
+    // This statement deletes a set of events.
+    kKIODeleteEventsByIDsSQL = [NSString stringWithFormat:@"DELETE FROM events WHERE id IN (%@)", eventIDList];
+
+    // This statement increments the attempts count of a set of events.
+    kKIOIncrementEventsAttemptsByIDsSQL =
+        [NSString stringWithFormat:@"UPDATE events SET attempts = attempts + 1 WHERE id IN (%@)", eventIDList];
 }
 
 - (instancetype)init {
+    return [self initWithDatabasePath:[self.class getSqliteFullFileName] options:nil];
+}
+
+- (instancetype)initInMemory {
+    return [self initWithDatabasePath:kKIOInMemoryDatabasePath options:nil];
+}
+
+- (instancetype)initWithDatabasePath:(NSString *)databasePath options:(NSDictionary<NSString *, id> *)options {
     self = [super init];
 
     if (self) {
+        _databasePath = [databasePath copy];
         keen_dbname = NULL;
         dbIsOpen = NO;
-
-        openLock = [[NSLock alloc] init];
+        _durability = KIODBStoreDurabilityBalanced;
+        totalEventCounts = [NSMutableDictionary dictionary];
+        pendingEventCounts = [NSMutableDictionary dictionary];
+        countsLock = [[NSLock alloc] init];
+        collectionEventCounts = [NSMutableDictionary dictionary];
+        collectionCaps = [NSMutableDictionary dictionary];
+        projectCollectionCaps = [NSMutableDictionary dictionary];
+        projectEvictionBatches = [NSMutableDictionary dictionary];
+        projectBytesUsed = [NSMutableDictionary dictionary];
+        _eventsToEvictPerCollection = 1;
+        _maxBytesPerProject = kKeenMaxBytesPerProject;
+        _maxTotalBytes = kKeenMaxTotalBytes;
+        _bytesToEvictOverBudget = kKeenBytesToEvictOverBudget;
+        _maintenanceEnabled = YES;
+        _maintenanceIdleInterval = 30;
+        _maintenancePagesPerRun = 256;
+        keen_readdb = NULL;
+        self.readQueue = dispatch_queue_create("io.keen.sqlite.read", DISPATCH_QUEUE_SERIAL);
+        queuedEvents = [NSMutableArray array];
+        _groupCommitBatchSize = 64;
+        _groupCommitInterval = 0.05;
+        _compression = KIODBStoreCompressionNone;
+        compressionDictionaries = [NSDictionary dictionary];
+        compressionLock = [[NSLock alloc] init];
+        statementCache = [NSMutableDictionary dictionary];
+        projectKeys = [NSMutableDictionary dictionary];
+        collectionKeys = [NSMutableDictionary dictionary];
+        warmUpEvents = [NSMutableArray array];
+        readyBlocks = [NSMutableArray array];
+        warmUpLock = [[NSLock alloc] init];
+        querySweepLock = [[NSLock alloc] init];
+        _querySweepInterval = 60;
+        profileLock = [[NSLock alloc] init];
+        statementTimings = [NSMutableDictionary dictionary];
+        queueWaitTimings = [KIOProfileTimings new];
+        queueRunTimings = [KIOProfileTimings new];
+
+        openLock = [[NSRecursiveLock alloc] init];
         if (nil == openLock) {
             // Failed to create the lock, so let's fail init
             // Otherwise attempting to acquire the lock will silently do nothing
@@ -66,12 +546,153 @@
         }
 
         if (nil != self) {
-            [self openAndInitDB];
+            [self applyOptions:options];
+            [self createDatabaseDirectory];
+            initTime = CFAbsoluteTimeGetCurrent();
+            if (asyncWarmUp) {
+                dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                    [self warmUp];
+                });
+            } else {
+                [self warmUp];
+            }
+            _initDuration = CFAbsoluteTimeGetCurrent() - initTime;
         }
     }
     return self;
 }
 
+// Called before the database is opened, so options that take effect on open don't have to be
+// applied a second time.
+- (void)applyOptions:(NSDictionary<NSString *, id> *)options {
+    for (NSString *option in options) {
+        id value = options[option];
+        if (![value isKindOfClass:[NSNumber class]]) {
+            KCLogWarn(@"Ignoring KIODBStore option %@ with a value that isn't a number", option);
+        } else if ([option isEqualToString:kKIODBStoreOptionDurability]) {
+            _durability = [value integerValue];
+        } else if ([option isEqualToString:kKIODBStoreOptionConcurrentReads]) {
+            _concurrentReadsEnabled = [value boolValue];
+        } else if ([option isEqualToString:kKIODBStoreOptionGroupCommit]) {
+            _groupCommitEnabled = [value boolValue];
+        } else if ([option isEqualToString:kKIODBStoreOptionCompression]) {
+            _compression = [value integerValue];
+        } else if ([option isEqualToString:kKIODBStoreOptionAsyncWarmUp]) {
+            asyncWarmUp = [value boolValue];
+        } else if ([option isEqualToString:kKIODBStoreOptionMmapSize]) {
+            _mmapSize = [value unsignedLongLongValue];
+        } else if ([option isEqualToString:kKIODBStoreOptionPageSize]) {
+            _pageSize = [value unsignedIntegerValue];
+        } else if ([option isEqualToString:kKIODBStoreOptionProfiling]) {
+            _profilingEnabled = [value boolValue];
+        } else {
+            KCLogWarn(@"Ignoring unknown KIODBStore option %@", option);
+        }
+    }
+}
+
+#pragma mark Warm-Up Methods
+
+// Opens the database, then makes the store ready. Runs on the thread calling init, or in the
+// background with kKIODBStoreOptionAsyncWarmUp.
+- (void)warmUp {
+    // Hold the open lock until buffered events are on their way to the dbQueue, so anything
+    // waiting on the open to use the database is queued after them and sees them.
+    [openLock lock];
+    @try {
+        BOOL opened = [self openAndInitDB];
+        _openDuration = CFAbsoluteTimeGetCurrent() - initTime;
+        [self becomeReady:opened];
+    } @finally {
+        [openLock unlock];
+    }
+}
+
+- (void)becomeReady:(BOOL)opened {
+    [warmUpLock lock];
+    NSArray *eventsToWrite = warmUpEvents;
+    NSArray *blocksToCall = readyBlocks;
+    warmUpEvents = nil;
+    readyBlocks = nil;
+    isReady = YES;
+
+    if (eventsToWrite.count > 0) {
+        if (opened) {
+            // Queued while still holding warmUpLock, so they're written ahead of any event added from now on.
+            dispatch_async(self.dbQueue, [self profiledBlock:^{
+                [queuedEvents addObjectsFromArray:eventsToWrite];
+                [self writeQueuedEvents];
+            }]);
+        } else {
+            KCLogError(@"Failed to open the database, dropping %lu events added while warming up.",
+                       (unsigned long)eventsToWrite.count);
+            [self finishUnfinishedWrites:eventsToWrite.count];
+            for (KIOQueuedEvent *queuedEvent in eventsToWrite) {
+                [queuedEvent reportStored:NO];
+            }
+        }
+    }
+    [warmUpLock unlock];
+
+    for (void (^readyBlock)(BOOL) in blocksToCall) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            readyBlock(opened);
+        });
+    }
+}
+
+// Holds on to an event until the store is ready. Returns NO if it already is, in which case
+// the event should be added as usual.
+- (BOOL)bufferEventUntilReady:(KIOQueuedEvent *)queuedEvent {
+    [warmUpLock lock];
+    BOOL wasBuffered = !isReady;
+    if (wasBuffered) {
+        [warmUpEvents addObject:queuedEvent];
+        // Unfinished until writeQueuedEvents writes it.
+        [self beginUnfinishedWrites:1];
+    }
+    [warmUpLock unlock];
+    return wasBuffered;
+}
+
+- (BOOL)isReady {
+    [warmUpLock lock];
+    BOOL ready = isReady;
+    [warmUpLock unlock];
+    return ready;
+}
+
+- (void)whenReady:(void (^)(BOOL opened))readyBlock {
+    [warmUpLock lock];
+    BOOL ready = isReady;
+    if (!ready) {
+        [readyBlocks addObject:[readyBlock copy]];
+    }
+    [warmUpLock unlock];
+
+    if (ready) {
+        BOOL opened = dbIsOpen;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            readyBlock(opened);
+        });
+    }
+}
+
+- (void)createDatabaseDirectory {
+    if (self.inMemory) {
+        return;
+    }
+
+    NSError *error;
+    NSString *directory = [self.databasePath stringByDeletingLastPathComponent];
+    if (directory.length > 0 && ![[NSFileManager defaultManager] createDirectoryAtPath:directory
+                                                           withIntermediateDirectories:YES
+                                                                            attributes:nil
+                                                                                 error:&error]) {
+        KCLogError(@"Failed to create database directory %@: %@", directory, [error localizedDescription]);
+    }
+}
+
 + (KIODBStore *)sharedInstance {
     static KIODBStore *s_sharedDBStore;
 
@@ -84,26 +705,85 @@
     // for the block to complete.
     static dispatch_once_t predicate = {0};
     dispatch_once(&predicate, ^{
-        s_sharedDBStore = [KIODBStore new];
+        s_sharedDBStore =
+            [[KIODBStore alloc] initWithDatabasePath:[self getSqliteFullFileName] options:s_sharedInstanceOptions];
     });
 
     return s_sharedDBStore;
 }
 
++ (void)setSharedInstanceOptions:(NSDictionary<NSString *, id> *)options {
+    s_sharedInstanceOptions = [options copy];
+}
+
 #pragma mark - Handle Database -
 
 #pragma mark Database Methods
 
+- (BOOL)inMemory {
+    return [self.databasePath isEqualToString:kKIOInMemoryDatabasePath];
+}
+
 + (NSString *)getSqliteFullFileName {
     NSString *libraryPath =
         [NSSearchPathForDirectoriesInDomains(NSLibraryDirectory, NSUserDomainMask, YES) objectAtIndex:0];
     return [libraryPath stringByAppendingPathComponent:@"keenEvents.sqlite"];
 }
 
+// SQLite can only be configured before it's initialized, and every connection in the process
+// shares the configuration, so it's done once before the first connection is opened. Returns NO
+// if SQLite couldn't be initialized.
++ (BOOL)configureSQLite {
+    static dispatch_once_t predicate = {0};
+    dispatch_once(&predicate, ^{
+        // Some other code in the process may have already initialized SQLite.
+        keen_io_sqlite3_shutdown();
+
+        // SQLite keeps its defaults for anything it doesn't take, which still works.
+        int result = keen_io_sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
+        if (SQLITE_OK != result) {
+            KCLogWarn(@"Failed to configure SQLite multithread: %d", result);
+        }
+
+        // Keeping memory statistics takes a global mutex on every allocation.
+        result = keen_io_sqlite3_config(SQLITE_CONFIG_MEMSTATUS, 0);
+        if (SQLITE_OK != result) {
+            KCLogWarn(@"Failed to configure SQLite memstatus: %d", result);
+        }
+
+        // Never freed once SQLite takes it, since it's shared by every connection for the life of the process.
+        void *pageCache = malloc(kKIOPageCacheSlotSize * kKIOPageCacheSlotCount);
+        if (NULL != pageCache) {
+            result = keen_io_sqlite3_config(
+                SQLITE_CONFIG_PAGECACHE, pageCache, kKIOPageCacheSlotSize, kKIOPageCacheSlotCount);
+            if (SQLITE_OK != result) {
+                KCLogWarn(@"Failed to configure SQLite pagecache: %d", result);
+                free(pageCache);
+            }
+        } else {
+            KCLogWarn(@"Failed to allocate the SQLite page cache");
+        }
+
+        // The lookaside buffer is left at SQLite's default size, which its allocations are tuned for.
+    });
+
+    // A no-op once SQLite is initialized, so if it fails the next open tries again.
+    int result = keen_io_sqlite3_initialize();
+    if (SQLITE_OK != result) {
+        KCLogError(@"Failed to initialize SQLite: %d", result);
+        return NO;
+    }
+    return YES;
+}
+
 - (BOOL)openDB {
     __block BOOL wasOpened = NO;
 
-    NSString *dbFile = [self.class getSqliteFullFileName];
+    if (![self.class configureSQLite]) {
+        return wasOpened;
+    }
+
+    NSString *dbFile = self.databasePath;
     KCLogInfo(@"%@", dbFile);
 
     // we're going to use a queue for all database operations, so let's create it
@@ -111,12 +791,7 @@
 
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
-        // initialize sqlite ourselves so we can config
-        keen_io_sqlite3_shutdown();
-        keen_io_sqlite3_config(SQLITE_CONFIG_MULTITHREAD);
-        keen_io_sqlite3_initialize();
-
+    [self dbSync:^{
         int openDBResult = keen_io_sqlite3_open([dbFile UTF8String], &keen_dbname);
         if (openDBResult != SQLITE_OK) {
             if (openDBResult == SQLITE_CORRUPT) {
@@ -128,7 +803,12 @@
             wasOpened = YES;
         }
         dbIsOpen = wasOpened;
-    });
+        // Any run scheduled against a previous connection went away with it.
+        isMaintenanceScheduled = NO;
+        if (wasOpened) {
+            [self applyProfilingToConnection];
+        }
+    }];
 
     return wasOpened;
 }
@@ -141,11 +821,10 @@
         keen_dbname = NULL;
     }
 
-    NSString *dbFile = [self.class getSqliteFullFileName];
-    KCLogError(@"Deleting corrupt db: %@", dbFile);
-    [[NSFileManager defaultManager] removeItemAtPath:dbFile error:nil];
+    [self deleteDatabaseFiles];
 
     // create new database file
+    NSString *dbFile = self.databasePath;
     int secondOpenResult = keen_io_sqlite3_open([dbFile UTF8String], &keen_dbname);
     if (secondOpenResult != SQLITE_OK) {
         // Failed a second time
@@ -156,6 +835,23 @@
     return wasOpened;
 }
 
+- (void)deleteDatabaseFiles {
+    // An in-memory database has no files to delete
+    if (self.inMemory) {
+        return;
+    }
+
+    NSString *dbFile = self.databasePath;
+    KCLogError(@"Deleting corrupt db: %@", dbFile);
+
+    // Remove the journal files along with the database, otherwise a new database
+    // created at the same path could pick up a stale write-ahead log.
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    for (NSString *suffix in @[ @"", @"-wal", @"-shm", @"-journal" ]) {
+        [fileManager removeItemAtPath:[dbFile stringByAppendingString:suffix] error:nil];
+    }
+}
+
 - (BOOL)openAndInitDB {
     // The database can be opened from the thread calling into the SDK,
     // or by the database queue thread if it has been closed, so open
@@ -172,15 +868,18 @@
                     return false;
                 }
 
+                [self applyDurabilityProfile];
+                [self dbSync:^{
+                    [self applyMmapSizeToConnection:keen_dbname];
+                }];
+
                 if (![self migrateTable]) {
                     KCLogError(@"Failed to migrate SQLite table!");
                     [self closeDB];
                     return false;
                 }
 
-                if (![self prepareAllSQLiteStatements]) {
-                    return false;
-                }
+                [self openReadConnection];
             }
         }
     } @finally {
@@ -191,45 +890,62 @@
 }
 
 - (void)closeDB {
-    // Free all the prepared statements. This is safe on null pointers.
     if (dbIsOpen) {
         self.dbQueue = nil;
 
-        keen_io_sqlite3_finalize(insert_event_stmt);
-        keen_io_sqlite3_finalize(find_event_stmt);
-        keen_io_sqlite3_finalize(count_all_events_stmt);
-        keen_io_sqlite3_finalize(count_pending_events_stmt);
-        keen_io_sqlite3_finalize(make_pending_event_stmt);
-        keen_io_sqlite3_finalize(reset_pending_events_stmt);
-        keen_io_sqlite3_finalize(purge_events_stmt);
-        keen_io_sqlite3_finalize(delete_event_stmt);
-        keen_io_sqlite3_finalize(delete_all_events_stmt);
-        keen_io_sqlite3_finalize(increment_event_attempts_statement);
-        keen_io_sqlite3_finalize(delete_too_many_attempts_events_statement);
-        keen_io_sqlite3_finalize(age_out_events_stmt);
-
-        keen_io_sqlite3_finalize(insert_query_stmt);
-        keen_io_sqlite3_finalize(count_all_queries_stmt);
-        keen_io_sqlite3_finalize(get_query_stmt);
-        keen_io_sqlite3_finalize(increment_query_attempts_statement);
-        keen_io_sqlite3_finalize(delete_all_queries_stmt);
-        keen_io_sqlite3_finalize(get_query_with_attempts_stmt);
-        keen_io_sqlite3_finalize(age_out_queries_stmt);
+        [self closeReadConnection];
+
+        // Free all the prepared statements. They're prepared again on first use after reopening.
+        for (NSValue *statement in statementCache.allValues) {
+            keen_io_sqlite3_finalize(statement.pointerValue);
+        }
+        [statementCache removeAllObjects];
+        [self forgetLookupKeys];
 
         // Free our DB. This is safe on null pointers.
         keen_io_sqlite3_close(keen_dbname);
         keen_dbname = NULL;
         // Reset state in case it matters.
         dbIsOpen = NO;
+
+        // The database may change underneath us before it's reopened, so reseed the counts then.
+        [self forgetEventCounts];
+    }
+}
+
+// Must be called on the dbQueue. Returns NULL if the statement couldn't be prepared, which sqlite
+// treats as misuse, so the caller's usual error handling still applies.
+- (keen_io_sqlite3_stmt *)statementForSQL:(NSString *)sql {
+    keen_io_sqlite3_stmt *statement = [statementCache[sql] pointerValue];
+    if (NULL == statement) {
+        if (keen_io_sqlite3_prepare_v2(keen_dbname, [sql UTF8String], -1, &statement, NULL) != SQLITE_OK) {
+            [self handleSQLiteFailure:[NSString stringWithFormat:@"prepare statement: %@", sql]];
+            return NULL;
+        }
+        statementCache[sql] = [NSValue valueWithPointer:statement];
+    }
+    return statement;
+}
+
+- (NSUInteger)preparedStatementCount {
+    __block NSUInteger count = 0;
+    dispatch_queue_t queue = self.dbQueue;
+    if (queue) {
+        dispatch_sync(queue, ^{
+            count = self->statementCache.count;
+        });
     }
+    return count;
 }
 
 - (void)drainQueue {
     if (dbIsOpen) {
         dispatch_group_t group = dispatch_group_create();
 
-        // Add a task to be run after all other tasks
+        // Add a task to be run after all other tasks, writing
+        // out anything group commit is still holding on to.
         dispatch_group_async(group, self.dbQueue, ^{
+            [self writeQueuedEvents];
             KCLogVerbose(@"Queue complete");
         });
 
@@ -240,81 +956,539 @@
     }
 }
 
-- (BOOL)createTables {
-    __block BOOL wasCreated = NO;
+#pragma mark Read Connection Methods
+
+- (void)setConcurrentReadsEnabled:(BOOL)concurrentReadsEnabled {
+    _concurrentReadsEnabled = concurrentReadsEnabled;
 
     if (!dbIsOpen) {
-        KCLogError(@"DB is closed, skipping createTable");
-        return wasCreated;
+        // Opened along with the database.
+        return;
+    }
+    if (concurrentReadsEnabled) {
+        [self openReadConnection];
+    } else {
+        [self closeReadConnection];
     }
+}
 
-    // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
-    // queue
-    dispatch_sync(self.dbQueue, ^{
-        // create events table
-        char *eventsError;
-        NSString *createEventsTableSQL =
-            [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS 'events' (ID INTEGER PRIMARY KEY AUTOINCREMENT, "
-                                       @"collection TEXT, projectID TEXT, eventData BLOB, pending INTEGER, "
-                                       @"dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"];
-        int result = SQLITE_FAIL;
-        for (int i = 0; i < 2; ++i) {
-            // The database is loaded on demand and this is the first time we use it, so here
-            // is where we're likely to actually notice corruption. Handle it by deleting the
-            // corrupt db and creating a new one.
-            result = keen_io_sqlite3_exec(keen_dbname, [createEventsTableSQL UTF8String], NULL, NULL, &eventsError);
-            if (result == SQLITE_CORRUPT) {
-                if (![self deleteAndRecreateCorruptDB]) {
-                    KCLogError(@"Failed to replace corrupt db while creating events table: %@",
-                               [NSString stringWithCString:eventsError encoding:NSUTF8StringEncoding]);
-                    keen_io_sqlite3_free(eventsError); // Free that error message
-                    [self closeDB];
-                    break;
-                }
-                // If deleting and recreating the db was successful, continue the loop to create the events table
-            } else if (result != SQLITE_OK) {
-                KCLogError(@"Failed to create events table: %@",
-                           [NSString stringWithCString:eventsError encoding:NSUTF8StringEncoding]);
-                keen_io_sqlite3_free(eventsError); // Free that error message
-                [self closeDB];
-            }
+- (void)openReadConnection {
+    // A reader only runs alongside the writer in WAL mode. With a rollback journal
+    // it would just wait on the writer's locks instead of the dbQueue.
+    // A second connection to an in-memory database would open a different, empty one.
+    if (!self.concurrentReadsEnabled || KIODBStoreDurabilityStrict == self.durability || self.inMemory) {
+        return;
+    }
+
+    NSString *dbFile = self.databasePath;
+    dispatch_sync(self.readQueue, ^{
+        if (NULL != keen_readdb) {
+            return;
         }
 
-        if (SQLITE_OK == result) {
-            // create queries table
-            char *queriesError;
-            NSString *createQueriesTableSQL = [NSString
-                stringWithFormat:@"CREATE TABLE IF NOT EXISTS 'queries' (ID INTEGER PRIMARY KEY AUTOINCREMENT, "
-                                 @"collection TEXT, projectID TEXT, queryData BLOB, queryType TEXT, attempts INTEGER "
-                                 @"DEFAULT 0, dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"];
-            if (keen_io_sqlite3_exec(keen_dbname, [createQueriesTableSQL UTF8String], NULL, NULL, &queriesError) !=
-                SQLITE_OK) {
-                KCLogError(@"Failed to create queries table: %@",
-                           [NSString stringWithCString:queriesError encoding:NSUTF8StringEncoding]);
-                keen_io_sqlite3_free(queriesError); // Free that error message
-                [self closeDB];
-            } else {
-                wasCreated = YES;
-            }
+        if (keen_io_sqlite3_open_v2([dbFile UTF8String], &keen_readdb, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+            [self handleReadFailure:@"open read connection"];
+            return;
+        }
+        [self applyMmapSizeToConnection:keen_readdb];
+
+        // The read statements are prepared up front, since the connection only exists to serve them.
+        if (keen_io_sqlite3_prepare_v2(keen_readdb,
+                                       [kKIOReadCountAllEventsSQL UTF8String],
+                                       -1,
+                                       &read_count_all_events_stmt,
+                                       NULL) != SQLITE_OK) {
+            [self handleReadFailure:@"prepare read count all events statement"];
+            return;
+        }
+
+        if (keen_io_sqlite3_prepare_v2(keen_readdb,
+                                       [kKIOReadCountPendingEventsSQL UTF8String],
+                                       -1,
+                                       &read_count_pending_events_stmt,
+                                       NULL) != SQLITE_OK) {
+            [self handleReadFailure:@"prepare read count pending events statement"];
+            return;
+        }
+
+        if (keen_io_sqlite3_prepare_v2(keen_readdb,
+                                       [kKIOCountAllQueriesSQL UTF8String],
+                                       -1,
+                                       &read_count_all_queries_stmt,
+                                       NULL) != SQLITE_OK) {
+            [self handleReadFailure:@"prepare read count all queries statement"];
+            return;
+        }
+
+        if (keen_io_sqlite3_prepare_v2(keen_readdb,
+                                       [kKIOGetQuerySQL UTF8String],
+                                       -1,
+                                       &read_get_query_stmt,
+                                       NULL) != SQLITE_OK) {
+            [self handleReadFailure:@"prepare read get query statement"];
+            return;
         }
     });
+}
 
-    return wasCreated;
+- (void)closeReadConnection {
+    dispatch_sync(self.readQueue, ^{
+        [self closeReadConnectionOnReadQueue];
+    });
 }
 
-- (int)queryUserVersion {
-    int databaseVersion = 0;
+- (void)closeReadConnectionOnReadQueue {
+    // Free the statements and the connection. This is safe on null pointers.
+    keen_io_sqlite3_finalize(read_count_all_events_stmt);
+    keen_io_sqlite3_finalize(read_count_pending_events_stmt);
+    keen_io_sqlite3_finalize(read_count_all_queries_stmt);
+    keen_io_sqlite3_finalize(read_get_query_stmt);
+    read_count_all_events_stmt = NULL;
+    read_count_pending_events_stmt = NULL;
+    read_count_all_queries_stmt = NULL;
+    read_get_query_stmt = NULL;
+
+    keen_io_sqlite3_close(keen_readdb);
+    keen_readdb = NULL;
+}
 
-    // get current database version of schema
-    static keen_io_sqlite3_stmt *stmt_version;
+- (void)handleReadFailure:(NSString *)msg {
+    // The writer connection is still fine, so just stop reading on the side. Reads go
+    // back through the dbQueue until the database is reopened.
+    KCLogWarn(@"Failed to %@, reading through the write connection: %@",
+              msg,
+              [NSString stringWithCString:keen_io_sqlite3_errmsg(keen_readdb) encoding:NSUTF8StringEncoding]);
+    [self closeReadConnectionOnReadQueue];
+}
 
-    if (keen_io_sqlite3_prepare_v2(keen_dbname, "PRAGMA user_version;", -1, &stmt_version, NULL) != SQLITE_OK) {
-        return -1;
+// Runs block on the readQueue if reads can skip the dbQueue right now, returning NO if they can't.
+// A failure in the block closes the read connection, so the caller falls back then too.
+- (BOOL)readConcurrently:(dispatch_block_t)block {
+    if (!self.concurrentReadsEnabled || ![self hasFinishedAllWrites]) {
+        return NO;
     }
 
-    while (keen_io_sqlite3_step(stmt_version) == SQLITE_ROW) {
-        databaseVersion = keen_io_sqlite3_column_int(stmt_version, 0);
-    }
+    __block BOOL wasRead = NO;
+    dispatch_sync(self.readQueue, ^{
+        if (NULL != keen_readdb) {
+            block();
+            wasRead = (NULL != keen_readdb);
+        }
+    });
+    return wasRead;
+}
+
+// Hands a write to the dbQueue without waiting for it, keeping track of it until it's done.
+- (void)dbAsync:(dispatch_block_t)block {
+    [self beginUnfinishedWrites:1];
+    dispatch_async(self.dbQueue, [self profiledBlock:^{
+        [self noteActivity];
+        block();
+        [self finishUnfinishedWrites:1];
+    }]);
+}
+
+// Runs a block on the dbQueue and waits for it.
+- (void)dbSync:(dispatch_block_t)block {
+    dispatch_sync(self.dbQueue, [self profiledBlock:block]);
+}
+
+// Returns a block for the dbQueue that times how long it waited and ran while profiling,
+// or the block itself otherwise.
+- (dispatch_block_t)profiledBlock:(dispatch_block_t)block {
+    if (!self.profilingEnabled) {
+        return block;
+    }
+
+    CFAbsoluteTime queuedTime = CFAbsoluteTimeGetCurrent();
+    return ^{
+        CFAbsoluteTime startTime = CFAbsoluteTimeGetCurrent();
+        block();
+        CFAbsoluteTime endTime = CFAbsoluteTimeGetCurrent();
+
+        [self->profileLock lock];
+        [self->queueWaitTimings addDuration:startTime - queuedTime];
+        [self->queueRunTimings addDuration:endTime - startTime];
+        [self->profileLock unlock];
+    };
+}
+
+- (void)beginUnfinishedWrites:(NSUInteger)count {
+    [countsLock lock];
+    unfinishedWriteCount += count;
+    [countsLock unlock];
+}
+
+- (void)finishUnfinishedWrites:(NSUInteger)count {
+    [countsLock lock];
+    unfinishedWriteCount -= MIN(count, unfinishedWriteCount);
+    [countsLock unlock];
+}
+
+- (BOOL)hasFinishedAllWrites {
+    [countsLock lock];
+    BOOL hasFinished = (0 == unfinishedWriteCount);
+    [countsLock unlock];
+    return hasFinished;
+}
+
+#pragma mark Profiling Methods
+
+// Called on the dbQueue.
+- (void)addStatementTiming:(const char *)sql duration:(NSTimeInterval)duration {
+    NSString *statement = [NSString stringWithUTF8String:sql];
+    if (nil == statement) {
+        return;
+    }
+
+    [profileLock lock];
+    KIOProfileTimings *timings = statementTimings[statement];
+    if (nil == timings) {
+        timings = [KIOProfileTimings new];
+        statementTimings[statement] = timings;
+    }
+    [timings addDuration:duration];
+    [profileLock unlock];
+}
+
+// Called by SQLite on the dbQueue as each statement on the write connection finishes.
+static void KIOProfileStatement(void *store, const char *sql, keen_io_sqlite3_uint64 nanoseconds) {
+    [(__bridge KIODBStore *)store addStatementTiming:sql duration:nanoseconds / 1e9];
+}
+
+- (void)setProfilingEnabled:(BOOL)profilingEnabled {
+    _profilingEnabled = profilingEnabled;
+
+    // Otherwise it's applied the next time the database is opened.
+    if (dbIsOpen) {
+        [self dbSync:^{
+            [self applyProfilingToConnection];
+        }];
+    }
+}
+
+// Called on the dbQueue. SQLite only calls back from statements run on the dbQueue, by blocks
+// that hold on to the store, so the store is never gone by the time it does.
+- (void)applyProfilingToConnection {
+    if (self.profilingEnabled) {
+        keen_io_sqlite3_profile(keen_dbname, KIOProfileStatement, (__bridge void *)self);
+    } else {
+        keen_io_sqlite3_profile(keen_dbname, NULL, NULL);
+    }
+}
+
++ (NSArray<NSNumber *> *)profileHistogramBounds {
+    NSMutableArray *bounds = [NSMutableArray arrayWithCapacity:kKIOProfileBucketCount - 1];
+    for (NSUInteger bucket = 0; bucket < kKIOProfileBucketCount - 1; bucket++) {
+        [bounds addObject:[NSNumber numberWithDouble:kKIOProfileHistogramBounds[bucket]]];
+    }
+    return bounds;
+}
+
+- (NSDictionary<NSString *, id> *)profileSnapshot {
+    [profileLock lock];
+    NSMutableDictionary *statements = [NSMutableDictionary dictionaryWithCapacity:statementTimings.count];
+    for (NSString *statement in statementTimings) {
+        statements[statement] = [statementTimings[statement] snapshot];
+    }
+    NSDictionary *snapshot = @{
+        kKIODBStoreProfileStatements: statements,
+        kKIODBStoreProfileQueueWait: [queueWaitTimings snapshot],
+        kKIODBStoreProfileQueueRun: [queueRunTimings snapshot]
+    };
+    [profileLock unlock];
+
+    return snapshot;
+}
+
+- (void)resetProfile {
+    [profileLock lock];
+    [statementTimings removeAllObjects];
+    queueWaitTimings = [KIOProfileTimings new];
+    queueRunTimings = [KIOProfileTimings new];
+    [profileLock unlock];
+}
+
+#pragma mark Maintenance Methods
+
+- (void)performMaintenance {
+    if (![self checkOpenDB:@"DB is closed, skipping performMaintenance"]) {
+        return;
+    }
+
+    [self dbSync:^{
+        [self runMaintenanceAllowingRebuild:YES];
+    }];
+}
+
+// Called on the dbQueue whenever the store is used. Makes sure a maintenance run follows
+// once it has been idle for a while.
+- (void)noteActivity {
+    lastActivityTime = CFAbsoluteTimeGetCurrent();
+    if (self.maintenanceEnabled && !isMaintenanceScheduled) {
+        isMaintenanceScheduled = YES;
+        [self scheduleMaintenanceAfter:self.maintenanceIdleInterval];
+    }
+}
+
+- (void)scheduleMaintenanceAfter:(NSTimeInterval)delay {
+    // Weak, so a scheduled run doesn't keep a store alive, and doesn't reopen one that's been closed.
+    __weak KIODBStore *weakSelf = self;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0),
+                   ^{
+                       [weakSelf runMaintenanceIfIdle];
+                   });
+}
+
+- (void)runMaintenanceIfIdle {
+    [openLock lock];
+    dispatch_queue_t queue = dbIsOpen ? self.dbQueue : nil;
+    [openLock unlock];
+    if (nil == queue) {
+        return;
+    }
+
+    dispatch_async(queue, ^{
+        if (NULL == keen_dbname) {
+            isMaintenanceScheduled = NO;
+            return;
+        }
+
+        // Wait for a full idle interval without any writes pending.
+        NSTimeInterval idleTime = CFAbsoluteTimeGetCurrent() - lastActivityTime;
+        if (idleTime < self.maintenanceIdleInterval || queuedEvents.count > 0 || ![self hasFinishedAllWrites]) {
+            [self scheduleMaintenanceAfter:MAX(self.maintenanceIdleInterval - idleTime, 0.1)];
+            return;
+        }
+
+        isMaintenanceScheduled = NO;
+        if (self.maintenanceEnabled) {
+            [self runMaintenanceAllowingRebuild:NO];
+        }
+    });
+}
+
+// Called on the dbQueue. Gives free pages back to the file system a bounded number at a time, and
+// checkpoints the WAL so it doesn't keep growing. A database created before auto_vacuum was turned
+// on is only rebuilt if allowRebuild is set, since that rewrites the whole file.
+- (void)runMaintenanceAllowingRebuild:(BOOL)allowRebuild {
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    long long pagesReclaimed = 0;
+
+    long long autoVacuum = [self queryPragma:"PRAGMA auto_vacuum;"];
+    long long freePages = [self queryPragma:"PRAGMA freelist_count;"];
+    if (freePages > 0 && 0 == autoVacuum && allowRebuild) {
+        // It can only be switched over by rebuilding it, which reclaims every free page in one go.
+        // This only ever happens once.
+        long long pageCount = [self queryPragma:"PRAGMA page_count;"];
+        if (keen_io_sqlite3_exec(keen_dbname, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", NULL, NULL, NULL) ==
+            SQLITE_OK) {
+            pagesReclaimed = pageCount - [self queryPragma:"PRAGMA page_count;"];
+        } else {
+            KCLogWarn(@"Failed to switch database to incremental vacuum: %@",
+                      [NSString stringWithCString:keen_io_sqlite3_errmsg(keen_dbname) encoding:NSUTF8StringEncoding]);
+        }
+    } else if (freePages > 0 && 0 != autoVacuum) {
+        // incremental_vacuum(0) would reclaim every free page, so a run always has a bound.
+        NSString *vacuum = [NSString stringWithFormat:@"PRAGMA incremental_vacuum(%lu);",
+                                                      (unsigned long)MAX(self.maintenancePagesPerRun, 1)];
+        if (keen_io_sqlite3_exec(keen_dbname, [vacuum UTF8String], NULL, NULL, NULL) == SQLITE_OK) {
+            pagesReclaimed = freePages - [self queryPragma:"PRAGMA freelist_count;"];
+        } else {
+            KCLogWarn(@"Failed to run incremental vacuum: %@",
+                      [NSString stringWithCString:keen_io_sqlite3_errmsg(keen_dbname) encoding:NSUTF8StringEncoding]);
+        }
+    }
+
+    // Copy what it can of the WAL back into the database without waiting on readers. Outside of
+    // WAL mode this does nothing.
+    if (KIODBStoreDurabilityStrict != self.durability) {
+        keen_io_sqlite3_wal_checkpoint_v2(keen_dbname, NULL, SQLITE_CHECKPOINT_PASSIVE, NULL, NULL);
+    }
+
+    NSTimeInterval timeSpent = CFAbsoluteTimeGetCurrent() - start;
+    self.maintenanceRunCount += 1;
+    self.maintenancePagesReclaimed += (NSUInteger)MAX(pagesReclaimed, 0);
+    self.maintenanceTimeSpent += timeSpent;
+    KCLogVerbose(@"Maintenance reclaimed %lld pages in %.3fs", pagesReclaimed, timeSpent);
+}
+
+// Called on the dbQueue. Returns the value of a pragma that returns a single integer, or 0 if it fails.
+- (long long)queryPragma:(const char *)pragma {
+    long long value = 0;
+    keen_io_sqlite3_stmt *statement = NULL;
+    if (keen_io_sqlite3_prepare_v2(keen_dbname, pragma, -1, &statement, NULL) == SQLITE_OK &&
+        keen_io_sqlite3_step(statement) == SQLITE_ROW) {
+        value = keen_io_sqlite3_column_int64(statement, 0);
+    }
+    keen_io_sqlite3_finalize(statement);
+    return value;
+}
+
+#pragma mark Durability Methods
+
++ (NSArray *)pragmasForDurability:(KIODBStoreDurability)durability {
+    switch (durability) {
+        case KIODBStoreDurabilityStrict:
+            return @[
+                @"PRAGMA journal_mode = DELETE;",
+                @"PRAGMA synchronous = FULL;",
+                @"PRAGMA wal_autocheckpoint = 1000;",
+                @"PRAGMA cache_size = -2000;",
+                @"PRAGMA temp_store = FILE;"
+            ];
+        case KIODBStoreDurabilityBalanced:
+            return @[
+                @"PRAGMA journal_mode = WAL;",
+                @"PRAGMA synchronous = NORMAL;",
+                @"PRAGMA wal_autocheckpoint = 1000;",
+                @"PRAGMA cache_size = -2000;",
+                @"PRAGMA temp_store = MEMORY;"
+            ];
+        case KIODBStoreDurabilityRelaxed:
+            return @[
+                @"PRAGMA journal_mode = WAL;",
+                @"PRAGMA synchronous = OFF;",
+                @"PRAGMA wal_autocheckpoint = 4000;",
+                @"PRAGMA cache_size = -4000;",
+                @"PRAGMA temp_store = MEMORY;"
+            ];
+    }
+    return @[];
+}
+
+- (void)setDurability:(KIODBStoreDurability)durability {
+    _durability = durability;
+
+    // If the database is already open, switch it over now. Otherwise the profile
+    // is applied the next time the database is opened.
+    if (dbIsOpen) {
+        // A reader left open would keep the journal mode from changing.
+        [self closeReadConnection];
+        [self applyDurabilityProfile];
+        [self openReadConnection];
+    }
+}
+
+- (void)applyDurabilityProfile {
+    NSArray *pragmas = [self.class pragmasForDurability:self.durability];
+
+    // we need to wait for the queue so the profile is in place before any other statement runs
+    [self dbSync:^{
+        for (NSString *pragma in pragmas) {
+            char *err;
+            if (keen_io_sqlite3_exec(keen_dbname, [pragma UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+                // A profile that can't be applied leaves the previous setting in place,
+                // which is still a working database, so just log it.
+                KCLogWarn(@"Failed to apply %@: %@",
+                          pragma,
+                          [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+                keen_io_sqlite3_free(err); // Free that error message
+            }
+        }
+    }];
+}
+
+// Called on the queue of the connection. mmap_size is per connection, and 0 leaves SQLite's default.
+- (void)applyMmapSizeToConnection:(keen_io_sqlite3 *)connection {
+    if (0 == self.mmapSize || self.inMemory) {
+        return;
+    }
+
+    NSString *pragma = [NSString stringWithFormat:@"PRAGMA mmap_size = %llu;", self.mmapSize];
+    char *err;
+    if (keen_io_sqlite3_exec(connection, [pragma UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+        // Reads just go through the page cache instead.
+        KCLogWarn(@"Failed to apply %@: %@", pragma, [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+        keen_io_sqlite3_free(err); // Free that error message
+    }
+}
+
+- (BOOL)createTables {
+    __block BOOL wasCreated = NO;
+
+    if (!dbIsOpen) {
+        KCLogError(@"DB is closed, skipping createTable");
+        return wasCreated;
+    }
+
+    // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
+    // queue
+    [self dbSync:^{
+        // create events table
+        char *eventsError;
+        NSString *createEventsTableSQL =
+            [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS 'events' (ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                       @"collection TEXT, projectID TEXT, eventData BLOB, pending INTEGER, "
+                                       @"dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"];
+        int result = SQLITE_FAIL;
+        for (int i = 0; i < 2; ++i) {
+            // The database is loaded on demand and this is the first time we use it, so here
+            // is where we're likely to actually notice corruption. Handle it by deleting the
+            // corrupt db and creating a new one.
+            // auto_vacuum can only be chosen before the first table is created, so this only
+            // affects new databases. Existing ones are converted by the maintenance task.
+            keen_io_sqlite3_exec(keen_dbname, "PRAGMA auto_vacuum = INCREMENTAL;", NULL, NULL, NULL);
+            // Same for page_size, which a WAL database can't change afterwards.
+            if (self.pageSize > 0) {
+                NSString *pageSizeSQL =
+                    [NSString stringWithFormat:@"PRAGMA page_size = %lu;", (unsigned long)self.pageSize];
+                keen_io_sqlite3_exec(keen_dbname, [pageSizeSQL UTF8String], NULL, NULL, NULL);
+            }
+            result = keen_io_sqlite3_exec(keen_dbname, [createEventsTableSQL UTF8String], NULL, NULL, &eventsError);
+            if (result == SQLITE_CORRUPT) {
+                if (![self deleteAndRecreateCorruptDB]) {
+                    KCLogError(@"Failed to replace corrupt db while creating events table: %@",
+                               [NSString stringWithCString:eventsError encoding:NSUTF8StringEncoding]);
+                    keen_io_sqlite3_free(eventsError); // Free that error message
+                    [self closeDB];
+                    break;
+                }
+                // If deleting and recreating the db was successful, continue the loop to create the events table
+            } else if (result != SQLITE_OK) {
+                KCLogError(@"Failed to create events table: %@",
+                           [NSString stringWithCString:eventsError encoding:NSUTF8StringEncoding]);
+                keen_io_sqlite3_free(eventsError); // Free that error message
+                [self closeDB];
+            }
+        }
+
+        if (SQLITE_OK == result) {
+            // create queries table
+            char *queriesError;
+            NSString *createQueriesTableSQL = [NSString
+                stringWithFormat:@"CREATE TABLE IF NOT EXISTS 'queries' (ID INTEGER PRIMARY KEY AUTOINCREMENT, "
+                                 @"collection TEXT, projectID TEXT, queryData BLOB, queryType TEXT, attempts INTEGER "
+                                 @"DEFAULT 0, dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"];
+            if (keen_io_sqlite3_exec(keen_dbname, [createQueriesTableSQL UTF8String], NULL, NULL, &queriesError) !=
+                SQLITE_OK) {
+                KCLogError(@"Failed to create queries table: %@",
+                           [NSString stringWithCString:queriesError encoding:NSUTF8StringEncoding]);
+                keen_io_sqlite3_free(queriesError); // Free that error message
+                [self closeDB];
+            } else {
+                wasCreated = YES;
+            }
+        }
+    }];
+
+    return wasCreated;
+}
+
+- (int)queryUserVersion {
+    int databaseVersion = 0;
+
+    // get current database version of schema. Local, since stores at other paths can be migrating at the same time.
+    keen_io_sqlite3_stmt *stmt_version = NULL;
+
+    if (keen_io_sqlite3_prepare_v2(keen_dbname, "PRAGMA user_version;", -1, &stmt_version, NULL) != SQLITE_OK) {
+        return -1;
+    }
+
+    while (keen_io_sqlite3_step(stmt_version) == SQLITE_ROW) {
+        databaseVersion = keen_io_sqlite3_column_int(stmt_version, 0);
+    }
     keen_io_sqlite3_finalize(stmt_version);
 
     // -1 means error, >= 1 is a real version number, otherwise it's unversioned
@@ -347,11 +1521,11 @@
 
     // we need to wait for the queue to finish because this method has a return value
     // that we're manipulating in the queue
-    dispatch_sync(self.dbQueue, ^{
+    [self dbSync:^{
         int userVersion = [self queryUserVersion];
         KCLogInfo(@"Preparing to migrate DB, current version: %d", userVersion);
         wasMigrated = [self migrateFromVersion:userVersion];
-    });
+    }];
 
     return wasMigrated;
 }
@@ -433,12 +1607,131 @@
         }
         return YES;
     } else if (forVersion == 2) {
+        // Index the lookups made by the prepared statements so they stop scanning the
+        // whole table. Every index implicitly ends with the rowid, so the events for a
+        // given projectID and pending state also come back in id order.
+        NSString *sql = @"CREATE INDEX IF NOT EXISTS events_projectID_pending ON events (projectID, pending);"
+                        @"CREATE INDEX IF NOT EXISTS queries_projectID_collection_queryType ON queries "
+                        @"(projectID, collection, queryType);";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to create indexes: %@", [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 3) {
+        // Events are claimed for upload under a lease. Rows that aren't leased have a
+        // leaseExpiry of 0, so anything claimable is a range scan of the index below,
+        // and rows left pending by older versions are claimable straight away.
+        NSString *sql = @"ALTER TABLE events ADD COLUMN leaseID INTEGER;"
+                        @"ALTER TABLE events ADD COLUMN leaseExpiry REAL DEFAULT 0;"
+                        @"CREATE INDEX IF NOT EXISTS events_projectID_leaseExpiry ON events (projectID, leaseExpiry);"
+                        @"CREATE INDEX IF NOT EXISTS events_leaseID ON events (leaseID);";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to add lease columns: %@",
+                       [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 4) {
+        // Record how each event's data is encoded. Existing rows are stored as is.
+        NSString *sql = @"ALTER TABLE events ADD COLUMN codec INTEGER DEFAULT 0;";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to add codec column: %@",
+                       [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 5) {
+        // Index events by collection for the per-collection caps. Within a collection
+        // the index is in id order, so finding the oldest events doesn't need a sort.
+        NSString *sql = @"CREATE INDEX IF NOT EXISTS events_projectID_collection ON events (projectID, collection);";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to create collection index: %@",
+                       [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 6) {
+        // Look queries up by a hash of their type, collection and canonical JSON instead of
+        // comparing every stored query's data.
+        NSString *sql = @"ALTER TABLE queries ADD COLUMN queryHash INTEGER;"
+                        @"CREATE INDEX IF NOT EXISTS queries_queryHash ON queries (queryHash);";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to add query hash column: %@",
+                       [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        if (![self backfillQueryHashes]) {
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 7) {
+        // Index queries by age, so sweeping expired ones is a range scan.
+        NSString *sql = @"CREATE INDEX IF NOT EXISTS queries_dateCreated ON queries (dateCreated);";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to create query age index: %@",
+                       [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 8) {
+        // Move each event's project and collection into lookup tables, so events refer to them by
+        // integer key. SQLite can't change a column's type, so events is rebuilt with the same ids,
+        // carrying over its autoincrement sequence so ids of deleted events aren't handed out again.
+        NSString *sql =
+            @"CREATE TABLE IF NOT EXISTS projects (id INTEGER PRIMARY KEY, projectID TEXT NOT NULL UNIQUE);"
+            @"CREATE TABLE IF NOT EXISTS collections (id INTEGER PRIMARY KEY, collection TEXT NOT NULL UNIQUE);"
+            @"INSERT OR IGNORE INTO projects (projectID) "
+            @"SELECT DISTINCT projectID FROM events WHERE projectID IS NOT NULL;"
+            @"INSERT OR IGNORE INTO collections (collection) "
+            @"SELECT DISTINCT collection FROM events WHERE collection IS NOT NULL;"
+            @"CREATE TABLE events_keyed (ID INTEGER PRIMARY KEY AUTOINCREMENT, collectionKey INTEGER, "
+            @"projectKey INTEGER, eventData BLOB, pending INTEGER, dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP, "
+            @"attempts INTEGER DEFAULT 0, leaseID INTEGER, leaseExpiry REAL DEFAULT 0, codec INTEGER DEFAULT 0);"
+            @"INSERT INTO events_keyed (ID, collectionKey, projectKey, eventData, pending, dateCreated, attempts, "
+            @"leaseID, leaseExpiry, codec) SELECT events.ID, collections.id, projects.id, eventData, pending, "
+            @"dateCreated, attempts, leaseID, leaseExpiry, codec FROM events "
+            @"LEFT JOIN projects ON projects.projectID=events.projectID "
+            @"LEFT JOIN collections ON collections.collection=events.collection;"
+            @"DELETE FROM sqlite_sequence WHERE name='events_keyed';"
+            @"INSERT INTO sqlite_sequence (name, seq) SELECT 'events_keyed', seq FROM sqlite_sequence "
+            @"WHERE name='events';"
+            @"DROP TABLE events;"
+            @"ALTER TABLE events_keyed RENAME TO events;"
+            @"CREATE INDEX events_projectKey_pending ON events (projectKey, pending);"
+            @"CREATE INDEX events_projectKey_leaseExpiry ON events (projectKey, leaseExpiry);"
+            @"CREATE INDEX events_leaseID ON events (leaseID);"
+            @"CREATE INDEX events_projectKey_collectionKey ON events (projectKey, collectionKey);";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to move projects and collections into lookup tables: %@",
+                       [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 9) {
+        // Index a project's events in id order, so byte budgets evict its oldest without a sort.
+        NSString *sql = @"CREATE INDEX IF NOT EXISTS events_projectKey_id ON events (projectKey, id);";
+        if (keen_io_sqlite3_exec(keen_dbname, [sql UTF8String], NULL, NULL, &err) != SQLITE_OK) {
+            KCLogError(@"Failed to create project event order index: %@",
+                       [NSString stringWithCString:err encoding:NSUTF8StringEncoding]);
+            keen_io_sqlite3_free(err); // Free that error message
+            return -1;
+        }
+        return YES;
+    } else if (forVersion == 10) {
         // This is the current version. To add a migration, increment the value of the
         // RHS of the above if statement and add another else if statement in between
         // to handle the new version number.
-        // e.g. change `forVersion == 2` to `forVersion == 3`, and then add an
-        // explicit block for handling the forVersion == 2 migration that looks like
-        // the forVersion == 1 block above.
+        // e.g. change `forVersion == 10` to `forVersion == 11`, and then add an
+        // explicit block for handling the forVersion == 10 migration that looks like
+        // the forVersion == 9 block above.
 
         // IMPORTANT: never remove any existing migration blocks!
 
@@ -450,6 +1743,59 @@
     return -1;
 }
 
+// Called by the queryHash migration. The hash is computed in Objective-C, so the stored queries
+// are read out first and then updated one at a time.
+- (BOOL)backfillQueryHashes {
+    keen_io_sqlite3_stmt *selectStatement = NULL;
+    keen_io_sqlite3_stmt *updateStatement = NULL;
+    BOOL wasBackfilled = NO;
+
+    if (keen_io_sqlite3_prepare_v2(
+            keen_dbname, "SELECT id, queryType, collection, queryData FROM queries", -1, &selectStatement, NULL) ==
+            SQLITE_OK &&
+        keen_io_sqlite3_prepare_v2(
+            keen_dbname, "UPDATE queries SET queryHash=? WHERE id=?", -1, &updateStatement, NULL) == SQLITE_OK) {
+        wasBackfilled = [self backfillQueryHashesWithSelectStatement:selectStatement updateStatement:updateStatement];
+    }
+    if (!wasBackfilled) {
+        KCLogError(@"Failed to backfill query hashes: %@",
+                   [NSString stringWithCString:keen_io_sqlite3_errmsg(keen_dbname) encoding:NSUTF8StringEncoding]);
+    }
+
+    // This is safe on null pointers.
+    keen_io_sqlite3_finalize(selectStatement);
+    keen_io_sqlite3_finalize(updateStatement);
+    return wasBackfilled;
+}
+
+- (BOOL)backfillQueryHashesWithSelectStatement:(keen_io_sqlite3_stmt *)selectStatement
+                               updateStatement:(keen_io_sqlite3_stmt *)updateStatement {
+    NSMutableArray *queryIDs = [NSMutableArray array];
+    NSMutableArray *queryHashes = [NSMutableArray array];
+    while (keen_io_sqlite3_step(selectStatement) == SQLITE_ROW) {
+        const char *queryTypeUTF8 = (const char *)keen_io_sqlite3_column_text(selectStatement, 1);
+        const char *collectionUTF8 = (const char *)keen_io_sqlite3_column_text(selectStatement, 2);
+        NSData *queryData = [NSData dataWithBytes:keen_io_sqlite3_column_blob(selectStatement, 3)
+                                           length:keen_io_sqlite3_column_bytes(selectStatement, 3)];
+        int64_t queryHash =
+            [self.class hashForQuery:queryData
+                           queryType:queryTypeUTF8 ? [NSString stringWithUTF8String:queryTypeUTF8] : nil
+                          collection:collectionUTF8 ? [NSString stringWithUTF8String:collectionUTF8] : nil];
+        [queryIDs addObject:@(keen_io_sqlite3_column_int64(selectStatement, 0))];
+        [queryHashes addObject:@(queryHash)];
+    }
+
+    for (NSUInteger i = 0; i < queryIDs.count; i++) {
+        if (keen_io_sqlite3_bind_int64(updateStatement, 1, [queryHashes[i] longLongValue]) != SQLITE_OK ||
+            keen_io_sqlite3_bind_int64(updateStatement, 2, [queryIDs[i] longLongValue]) != SQLITE_OK ||
+            keen_io_sqlite3_step(updateStatement) != SQLITE_DONE) {
+            return NO;
+        }
+        keen_io_sqlite3_reset(updateStatement);
+    }
+    return YES;
+}
+
 #pragma mark Transaction Methods
 
 - (BOOL)doTransaction:(NSString *)sqlTransaction {
@@ -474,6 +1820,8 @@
 }
 
 - (BOOL)rollbackTransaction {
+    // Rows added to the lookup tables during the transaction go with it.
+    [self forgetLookupKeys];
     return [self doTransaction:@"ROLLBACK TRANSACTION;"];
 }
 
@@ -486,68 +1834,489 @@
 - (BOOL)addEvent:(NSData *)eventData collection:(NSString *)eventCollection projectID:(NSString *)projectID {
     __block BOOL wasAdded = NO;
 
+    KIOQueuedEvent *queuedEvent = [self encodeEvent:eventData collection:eventCollection projectID:projectID];
+    if (nil == queuedEvent) {
+        return NO;
+    }
+
+    // Hold on to the event while the store warms up, rather than waiting for the open.
+    if (![self isReady] && [self bufferEventUntilReady:queuedEvent]) {
+        return YES;
+    }
+
     if (![self checkOpenDB:@"DB is closed, skipping addEvent"]) {
         return wasAdded;
     }
 
-    const char *projectIDUTF8 = projectID.UTF8String;
-    const char *eventCollectionUTF8 = eventCollection.UTF8String;
+    if (self.groupCommitEnabled) {
+        // Queue the event and return without waiting for it to be written.
+        [self queueEventForGroupCommit:queuedEvent];
+        return YES;
+    }
+
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(insert_event_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind pid to add event statement"];
-            return;
-        }
-
-        if (keen_io_sqlite3_bind_text(insert_event_stmt, 2, eventCollectionUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind coll to add event statement"];
-            return;
-        }
+    [self dbSync:^{
+        wasAdded = [self writeEvents:@[ queuedEvent ]];
+    }];
 
-        if (keen_io_sqlite3_bind_blob(
-                insert_event_stmt, 3, [eventData bytes], (int)[eventData length], SQLITE_TRANSIENT) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind insert statement"];
-            return;
+    return wasAdded;
+}
+
+- (void)addEvent:(NSData *)eventData
+           collection:(NSString *)eventCollection
+            projectID:(NSString *)projectID
+      completionQueue:(dispatch_queue_t)completionQueue
+    completionHandler:(void (^)(BOOL stored))completionHandler {
+    KIOQueuedEvent *queuedEvent = [self encodeEvent:eventData collection:eventCollection projectID:projectID];
+    if (nil == queuedEvent) {
+        if (completionHandler) {
+            dispatch_async(completionQueue ?: dispatch_get_main_queue(), ^{
+                completionHandler(NO);
+            });
         }
+        return;
+    }
+    queuedEvent.completionHandler = completionHandler;
+    queuedEvent.completionQueue = completionQueue;
 
-        if (keen_io_sqlite3_step(insert_event_stmt) != SQLITE_DONE) {
-            [self handleSQLiteFailure:@"insert event"];
-            return;
+    // Written once the store is ready, or by group commit, and reported then.
+    if (![self isReady] && [self bufferEventUntilReady:queuedEvent]) {
+        return;
+    }
+
+    if (![self checkOpenDB:@"DB is closed, skipping addEvent"]) {
+        [queuedEvent reportStored:NO];
+        return;
+    }
+
+    if (self.groupCommitEnabled) {
+        [self queueEventForGroupCommit:queuedEvent];
+        return;
+    }
+
+    [self dbAsync:^{
+        [queuedEvent reportStored:[self writeEvents:@[ queuedEvent ]]];
+    }];
+}
+
+// Compresses an event on the calling thread, to keep the work off the database queue. Returns nil
+// if it's too big to ever fit the storage budgets.
+- (KIOQueuedEvent *)encodeEvent:(NSData *)eventData
+                     collection:(NSString *)eventCollection
+                      projectID:(NSString *)projectID {
+    KIODBStoreCompression codec = self.compression;
+    NSData *encodedData = [self encodeEventData:eventData codec:&codec];
+
+    // Evicting every other event wouldn't make room for one that's bigger than a budget on its own.
+    NSUInteger maxBytes = MIN(self.maxBytesPerProject ?: NSUIntegerMax, self.maxTotalBytes ?: NSUIntegerMax);
+    if (encodedData.length > maxBytes) {
+        KCLogError(@"Event of %lu bytes is larger than the storage budget of %lu bytes, dropping it.",
+                   (unsigned long)encodedData.length,
+                   (unsigned long)maxBytes);
+        return nil;
+    }
+
+    return [KIOQueuedEvent eventWithData:encodedData collection:eventCollection projectID:projectID codec:codec];
+}
+
+- (void)queueEventForGroupCommit:(KIOQueuedEvent *)queuedEvent {
+    // Unfinished until writeQueuedEvents writes it.
+    [self beginUnfinishedWrites:1];
+    dispatch_async(self.dbQueue, [self profiledBlock:^{
+        [self queueEvent:queuedEvent];
+    }]);
+}
+
+- (BOOL)insertEvent:(NSData *)eventData
+         collection:(NSString *)eventCollection
+          projectID:(NSString *)projectID
+              codec:(KIODBStoreCompression)codec {
+    [self noteActivity];
+
+    if (![self makeRoomInCollection:eventCollection projectID:projectID]) {
+        return NO;
+    }
+    if (![self makeRoomForBytes:eventData.length projectID:projectID]) {
+        return NO;
+    }
+
+    keen_io_sqlite3_stmt *insert_event_stmt = [self statementForSQL:kKIOInsertEventSQL];
+    if (![self bindKeyForProjectID:projectID create:YES toStatement:insert_event_stmt parameter:1]) {
+        [self handleSQLiteFailure:@"bind pid to add event statement"];
+        return NO;
+    }
+
+    if (![self bindKeyForCollection:eventCollection create:YES toStatement:insert_event_stmt parameter:2]) {
+        [self handleSQLiteFailure:@"bind coll to add event statement"];
+        return NO;
+    }
+
+    if (keen_io_sqlite3_bind_blob(
+            insert_event_stmt, 3, [eventData bytes], (int)[eventData length], SQLITE_TRANSIENT) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind insert statement"];
+        return NO;
+    }
+
+    if (keen_io_sqlite3_bind_int(insert_event_stmt, 4, (int)codec) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind codec to add event statement"];
+        return NO;
+    }
+
+    if (keen_io_sqlite3_step(insert_event_stmt) != SQLITE_DONE) {
+        [self handleSQLiteFailure:@"insert event"];
+        return NO;
+    }
+
+    [self adjustEventCountForProjectID:projectID pending:NO by:1];
+    [self adjustEventCountForProjectID:projectID collection:eventCollection by:1];
+    [self adjustBytesUsedForProjectID:projectID by:eventData.length];
+
+    [self resetSQLiteStatement:insert_event_stmt];
+
+    if (!hasWrittenEvent) {
+        hasWrittenEvent = YES;
+        self.timeToFirstEvent = CFAbsoluteTimeGetCurrent() - initTime;
+        KCLogInfo(@"First event written %.1f ms after the store was created, opening took %.1f ms",
+                  self.timeToFirstEvent * 1000,
+                  self.openDuration * 1000);
+    }
+
+    return YES;
+}
+
+#pragma mark Lookup Methods
+
+// Called on the dbQueue. Binds the key of a project to a statement parameter, adding the project to
+// the projects table if create is set. Returns NO if SQLite failed.
+- (BOOL)bindKeyForProjectID:(NSString *)projectID
+                     create:(BOOL)create
+                toStatement:(keen_io_sqlite3_stmt *)statement
+                  parameter:(int)parameter {
+    long long key = [self keyForName:projectID
+                               cache:projectKeys
+                             findSQL:kKIOFindProjectKeySQL
+                           insertSQL:kKIOInsertProjectSQL
+                              create:create];
+    return [self bindKey:key toStatement:statement parameter:parameter];
+}
+
+// Called on the dbQueue. The same for a collection and the collections table.
+- (BOOL)bindKeyForCollection:(NSString *)collection
+                      create:(BOOL)create
+                 toStatement:(keen_io_sqlite3_stmt *)statement
+                   parameter:(int)parameter {
+    long long key = [self keyForName:collection
+                               cache:collectionKeys
+                             findSQL:kKIOFindCollectionKeySQL
+                           insertSQL:kKIOInsertCollectionSQL
+                              create:create];
+    return [self bindKey:key toStatement:statement parameter:parameter];
+}
+
+- (BOOL)bindKey:(long long)key toStatement:(keen_io_sqlite3_stmt *)statement parameter:(int)parameter {
+    if (key < 0) {
+        return NO;
+    }
+    // NULL never matches `projectKey=?` or `collectionKey=?`, so a name without a key finds no events.
+    if (0 == key) {
+        return keen_io_sqlite3_bind_null(statement, parameter) == SQLITE_OK;
+    }
+    return keen_io_sqlite3_bind_int64(statement, parameter, key) == SQLITE_OK;
+}
+
+// Called on the dbQueue. Looks up the key of a name in a lookup table, adding a row for it if create is
+// set, and caches it. Returns 0 for a nil name or one that isn't in the table, and -1 if SQLite failed.
+- (long long)keyForName:(NSString *)name
+                  cache:(NSMutableDictionary<NSString *, NSNumber *> *)cache
+                findSQL:(NSString *)findSQL
+              insertSQL:(NSString *)insertSQL
+                 create:(BOOL)create {
+    if (nil == name) {
+        return 0;
+    }
+    NSNumber *cachedKey = cache[name];
+    if (nil != cachedKey) {
+        return [cachedKey longLongValue];
+    }
+
+    keen_io_sqlite3_stmt *find_key_stmt = [self statementForSQL:findSQL];
+    if (keen_io_sqlite3_bind_text(find_key_stmt, 1, name.UTF8String, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+        return -1;
+    }
+    long long key = 0;
+    int result = keen_io_sqlite3_step(find_key_stmt);
+    if (SQLITE_ROW == result) {
+        key = keen_io_sqlite3_column_int64(find_key_stmt, 0);
+    }
+    [self resetSQLiteStatement:find_key_stmt];
+    if (SQLITE_ROW != result && SQLITE_DONE != result) {
+        return -1;
+    }
+
+    if (0 == key && create) {
+        keen_io_sqlite3_stmt *insert_key_stmt = [self statementForSQL:insertSQL];
+        if (keen_io_sqlite3_bind_text(insert_key_stmt, 1, name.UTF8String, -1, SQLITE_TRANSIENT) != SQLITE_OK ||
+            keen_io_sqlite3_step(insert_key_stmt) != SQLITE_DONE) {
+            [self resetSQLiteStatement:insert_key_stmt];
+            return -1;
         }
+        key = keen_io_sqlite3_last_insert_rowid(keen_dbname);
+        [self resetSQLiteStatement:insert_key_stmt];
+    }
 
-        wasAdded = YES;
+    // Names without a key aren't cached, so they're looked up again once they have one.
+    if (0 != key) {
+        cache[name] = [NSNumber numberWithLongLong:key];
+    }
+    return key;
+}
 
-        [self resetSQLiteStatement:insert_event_stmt];
-    });
+// Called on the dbQueue whenever the lookup tables may have lost rows the cache still has, after a
+// rollback or when the database is closed.
+- (void)forgetLookupKeys {
+    [projectKeys removeAllObjects];
+    [collectionKeys removeAllObjects];
+}
 
-    return wasAdded;
+#pragma mark Group Commit Methods
+
+- (void)flush {
+    if (![self checkOpenDB:@"DB is closed, skipping flush"]) {
+        return;
+    }
+
+    [self dbSync:^{
+        [self writeQueuedEvents];
+    }];
+}
+
+// Called on the dbQueue.
+- (void)queueEvent:(KIOQueuedEvent *)queuedEvent {
+    [queuedEvents addObject:queuedEvent];
+
+    if (queuedEvents.count >= MAX(self.groupCommitBatchSize, 1)) {
+        [self writeQueuedEvents];
+    } else if (!isQueuedEventsWriteScheduled) {
+        isQueuedEventsWriteScheduled = YES;
+        // Go through flush rather than straight to the dbQueue, since the
+        // database may have been closed and reopened on a new queue by then.
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(self.groupCommitInterval * NSEC_PER_SEC)),
+                       dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                       ^{
+                           [self flush];
+                       });
+    }
+}
+
+// Called on the dbQueue, before anything that needs to see events that were added.
+- (void)writeQueuedEvents {
+    isQueuedEventsWriteScheduled = NO;
+    if (queuedEvents.count == 0) {
+        return;
+    }
+
+    NSArray *eventsToWrite = [queuedEvents copy];
+    [queuedEvents removeAllObjects];
+
+    BOOL wasWritten = [self writeEvents:eventsToWrite];
+
+    // Written or dropped, they're no longer waiting.
+    [self finishUnfinishedWrites:eventsToWrite.count];
+    for (KIOQueuedEvent *queuedEvent in eventsToWrite) {
+        [queuedEvent reportStored:wasWritten];
+    }
+}
+
+// Called on the dbQueue. Writes events in one transaction, along with any evictions that make room
+// for them, so either all of it happens or none of it does.
+- (BOOL)writeEvents:(NSArray *)eventsToWrite {
+    if (![self beginTransaction]) {
+        KCLogError(@"Failed to begin a transaction, dropping %lu events.", (unsigned long)eventsToWrite.count);
+        return NO;
+    }
+
+    for (KIOQueuedEvent *queuedEvent in eventsToWrite) {
+        if (![self insertEvent:queuedEvent.eventData
+                    collection:queuedEvent.collection
+                     projectID:queuedEvent.projectID
+                         codec:queuedEvent.codec]) {
+            KCLogError(@"Failed to write events, dropping %lu events.", (unsigned long)eventsToWrite.count);
+            // Most failures close the database, which rolls back the transaction. Otherwise roll it back here.
+            if (NULL != keen_dbname) {
+                [self rollbackTransaction];
+                [self forgetEventCounts];
+            }
+            return NO;
+        }
+    }
+
+    if (![self commitTransaction]) {
+        KCLogError(@"Failed to commit events, dropping %lu events.", (unsigned long)eventsToWrite.count);
+        [self rollbackTransaction];
+        // The counts were bumped for rows that never made it, so reseed them.
+        [self forgetEventCounts];
+        return NO;
+    }
+
+    return YES;
 }
 
 - (NSMutableDictionary *)getEventsWithMaxAttempts:(int)maxAttempts andProjectID:(NSString *)projectID {
+    // A zero length lease has already expired by the next call, which picks the
+    // same events up again just like the old reset of pending events did.
+    return [self claimEventsWithMaxAttempts:maxAttempts projectID:projectID limit:0 leaseDuration:0 leaseID:NULL];
+}
+
+- (NSMutableDictionary *)claimEventsWithMaxAttempts:(int)maxAttempts
+                                          projectID:(NSString *)projectID
+                                              limit:(NSUInteger)limit
+                                      leaseDuration:(NSTimeInterval)leaseDuration
+                                            leaseID:(NSNumber **)leaseID {
+    return [self claimEventsWithMaxAttempts:maxAttempts
+                                  projectID:projectID
+                               afterEventID:nil
+                                  maxEvents:limit
+                                   maxBytes:0
+                              leaseDuration:leaseDuration
+                                    leaseID:leaseID
+                                lastEventID:NULL];
+}
+
+- (NSMutableDictionary *)claimEventsWithMaxAttempts:(int)maxAttempts
+                                          projectID:(NSString *)projectID
+                                       afterEventID:(NSNumber *)afterEventID
+                                          maxEvents:(NSUInteger)maxEvents
+                                           maxBytes:(NSUInteger)maxBytes
+                                      leaseDuration:(NSTimeInterval)leaseDuration
+                                            leaseID:(NSNumber **)leaseID
+                                        lastEventID:(NSNumber **)lastEventID {
     // Create a dictionary to hold the contents of our select.
-    __block NSMutableDictionary *events = [NSMutableDictionary dictionary];
+    NSMutableDictionary *events = [NSMutableDictionary dictionary];
+
+    [self claimEventRowsWithMaxAttempts:maxAttempts
+                              projectID:projectID
+                           afterEventID:afterEventID
+                              maxEvents:maxEvents
+                               maxBytes:maxBytes
+                          leaseDuration:leaseDuration
+                                leaseID:leaseID
+                            lastEventID:lastEventID
+                           eventHandler:^(long long eventId, const char *collection, const void *bytes,
+                                          NSUInteger length) {
+                               NSString *coll = [NSString stringWithUTF8String:collection];
+
+                               if ([events objectForKey:coll] == nil) {
+                                   // We don't have an entry in the dictionary yet for this collection
+                                   // so create one.
+                                   [events setObject:[NSMutableDictionary dictionary] forKey:coll];
+                               }
+
+                               [[events objectForKey:coll] setObject:[NSData dataWithBytes:bytes length:length]
+                                                              forKey:[NSNumber numberWithUnsignedLongLong:eventId]];
+                           }
+                         failureHandler:^{
+                             [events removeAllObjects];
+                         }];
 
-    if (![self checkOpenDB:@"DB is closed, skipping getEvents"]) {
-        return events;
-    }
+    return events;
+}
+
+- (KIOEventBatch *)claimEventBatchWithMaxAttempts:(int)maxAttempts
+                                        projectID:(NSString *)projectID
+                                     afterEventID:(NSNumber *)afterEventID
+                                        maxEvents:(NSUInteger)maxEvents
+                                         maxBytes:(NSUInteger)maxBytes
+                                    leaseDuration:(NSTimeInterval)leaseDuration
+                                          leaseID:(NSNumber **)leaseID
+                                      lastEventID:(NSNumber **)lastEventID {
+    __block KIOEventBatch *batch = [[KIOEventBatch alloc] initWithEventCapacity:MIN(maxEvents, 1024)
+                                                                   byteCapacity:MIN(maxBytes, 1024 * 1024)];
+
+    [self claimEventRowsWithMaxAttempts:maxAttempts
+                              projectID:projectID
+                           afterEventID:afterEventID
+                              maxEvents:maxEvents
+                               maxBytes:maxBytes
+                          leaseDuration:leaseDuration
+                                leaseID:leaseID
+                            lastEventID:lastEventID
+                           eventHandler:^(long long eventId, const char *collection, const void *bytes,
+                                          NSUInteger length) {
+                               // Copied straight out of SQLite's buffer into the batch.
+                               [batch appendEventID:eventId collection:collection bytes:bytes length:length];
+                           }
+                         failureHandler:^{
+                             batch = [[KIOEventBatch alloc] init];
+                         }];
+
+    return batch;
+}
 
-    // reset pending events, if necessary
-    if ([self hasPendingEventsWithProjectID:projectID]) {
-        [self resetPendingEventsWithProjectID:projectID];
+// Claims events as claimEvents describes, handing each claimed event to eventHandler on the
+// database queue. The bytes passed to eventHandler are only valid for the duration of the call.
+// If the claim fails after events have been handed over, failureHandler is called so they can
+// be thrown away.
+- (void)claimEventRowsWithMaxAttempts:(int)maxAttempts
+                            projectID:(NSString *)projectID
+                         afterEventID:(NSNumber *)afterEventID
+                            maxEvents:(NSUInteger)maxEvents
+                             maxBytes:(NSUInteger)maxBytes
+                        leaseDuration:(NSTimeInterval)leaseDuration
+                              leaseID:(NSNumber **)leaseID
+                          lastEventID:(NSNumber **)lastEventID
+                         eventHandler:(void (^)(long long eventId,
+                                                const char *collection,
+                                                const void *bytes,
+                                                NSUInteger length))eventHandler
+                       failureHandler:(void (^)(void))failureHandler {
+    __block long long claimedLeaseID = 0;
+    __block long long claimedLastEventID = 0;
+
+    if (![self checkOpenDB:@"DB is closed, skipping claimEvents"]) {
+        return;
     }
 
-    const char *projectIDUTF8 = projectID.UTF8String;
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(find_event_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind pid to find statement"];
+    [self dbSync:^{
+        [self writeQueuedEvents];
+        [self noteActivity];
+
+        NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+        // Lease ids are timestamps so they stay unique across launches, where rows
+        // can still carry the id of an expired lease.
+        long long newLeaseID = MAX(lastLeaseID + 1, (long long)(now * USEC_PER_SEC));
+        long long firstEventID = [afterEventID longLongValue];
+        long long lastClaimedEventID = 0;
+        long long newlyPendingCount = 0;
+        NSUInteger claimedBytes = 0;
+
+        if (![self beginTransaction]) {
             return;
         }
 
-        if (keen_io_sqlite3_bind_int64(find_event_stmt, 2, maxAttempts) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind coll to add event statement"];
+        // Select the batch: unleased or expired events past the cursor, oldest first.
+        keen_io_sqlite3_stmt *find_event_stmt = [self statementForSQL:kKIOFindEventSQL];
+        if (![self bindKeyForProjectID:projectID create:NO toStatement:find_event_stmt parameter:1]) {
+            [self handleSQLiteFailure:@"bind pid to find statement"];
+            return;
+        }
+        if (keen_io_sqlite3_bind_double(find_event_stmt, 2, now) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind now to find statement"];
+            return;
+        }
+        if (keen_io_sqlite3_bind_int64(find_event_stmt, 3, maxAttempts) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind attempts to find statement"];
+            return;
+        }
+        if (keen_io_sqlite3_bind_int64(find_event_stmt, 4, firstEventID) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind cursor to find statement"];
+            return;
+        }
+        // A negative LIMIT means no limit.
+        if (keen_io_sqlite3_bind_int64(find_event_stmt, 5, maxEvents > 0 ? (long long)maxEvents : -1) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind limit to find statement"];
             return;
         }
 
@@ -555,39 +2324,121 @@
             // Fetch data out the statement
             long long eventId = keen_io_sqlite3_column_int64(find_event_stmt, 0);
 
-            NSString *coll = [NSString stringWithUTF8String:(char *)keen_io_sqlite3_column_text(find_event_stmt, 1)];
-
             const void *dataPtr = keen_io_sqlite3_column_blob(find_event_stmt, 2);
             int dataSize = keen_io_sqlite3_column_bytes(find_event_stmt, 2);
+            KIODBStoreCompression codec = (KIODBStoreCompression)keen_io_sqlite3_column_int(find_event_stmt, 4);
+
+            // Uncompressed data is handed over straight from SQLite's buffer, without a copy.
+            NSData *decodedData = nil;
+            if (KIODBStoreCompressionNone != codec) {
+                decodedData = [self decodeEventBytes:dataPtr length:dataSize codec:codec];
+                dataPtr = decodedData.bytes;
+                dataSize = (int)decodedData.length;
+            }
 
-            NSData *data = [[NSData alloc] initWithBytes:dataPtr length:dataSize];
+            // Stop at the byte budget, but always take the first event so an oversized one can't stall paging.
+            if (maxBytes > 0 && lastClaimedEventID != 0 && claimedBytes + dataSize > maxBytes) {
+                break;
+            }
+            claimedBytes += dataSize;
 
-            // Bind and mark the event pending.
-            if (keen_io_sqlite3_bind_int64(make_pending_event_stmt, 1, eventId) != SQLITE_OK) {
-                [self handleSQLiteFailure:@"bind int for make pending"];
-                return;
+            if (keen_io_sqlite3_column_int(find_event_stmt, 3) == 0) {
+                newlyPendingCount++;
             }
-            if (keen_io_sqlite3_step(make_pending_event_stmt) != SQLITE_DONE) {
-                [self handleSQLiteFailure:@"mark event pending"];
-                return;
+            lastClaimedEventID = eventId;
+
+            if (KIODBStoreCompressionNone != codec && nil == decodedData) {
+                // Most likely compressed with a dictionary that isn't registered. It's leased with the
+                // rest of the batch but left in the store, so it can be read once the dictionary is.
+                KCLogError(@"Failed to decode event %lld, skipping it. Was its compression dictionary "
+                           @"registered with addDecompressionDictionary:?",
+                           eventId);
+                continue;
             }
 
-            // Reset the pendifier
-            [self resetSQLiteStatement:make_pending_event_stmt];
-
-            if ([events objectForKey:coll] == nil) {
-                // We don't have an entry in the dictionary yet for this collection
-                // so create one.
-                [events setObject:[NSMutableDictionary dictionary] forKey:coll];
+            // The collection comes from a LEFT JOIN, so it's NULL if the row's collection is missing.
+            const char *collection = (const char *)keen_io_sqlite3_column_text(find_event_stmt, 1);
+            if (NULL == collection) {
+                KCLogError(@"Event %lld has no collection, skipping it.", eventId);
+                continue;
             }
-
-            [[events objectForKey:coll] setObject:data forKey:[NSNumber numberWithUnsignedLongLong:eventId]];
+            eventHandler(eventId, collection, dataPtr, dataSize);
         }
 
         [self resetSQLiteStatement:find_event_stmt];
-    });
 
-    return events;
+        if (0 == lastClaimedEventID) {
+            // Nothing to claim.
+            [self endTransaction];
+            return;
+        }
+
+        // Lease the whole batch in one statement. The batch is exactly the claimable
+        // rows between the cursor and the last id selected, since it was selected in id order.
+        keen_io_sqlite3_stmt *claim_events_stmt = [self statementForSQL:kKIOClaimEventsSQL];
+        if (keen_io_sqlite3_bind_int64(claim_events_stmt, 1, newLeaseID) != SQLITE_OK ||
+            keen_io_sqlite3_bind_double(claim_events_stmt, 2, now + MAX(leaseDuration, 0)) != SQLITE_OK ||
+            ![self bindKeyForProjectID:projectID create:NO toStatement:claim_events_stmt parameter:3] ||
+            keen_io_sqlite3_bind_double(claim_events_stmt, 4, now) != SQLITE_OK ||
+            keen_io_sqlite3_bind_int64(claim_events_stmt, 5, maxAttempts) != SQLITE_OK ||
+            keen_io_sqlite3_bind_int64(claim_events_stmt, 6, firstEventID) != SQLITE_OK ||
+            keen_io_sqlite3_bind_int64(claim_events_stmt, 7, lastClaimedEventID) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind claim events statement"];
+            failureHandler();
+            return;
+        }
+        if (keen_io_sqlite3_step(claim_events_stmt) != SQLITE_DONE) {
+            [self handleSQLiteFailure:@"claim events"];
+            failureHandler();
+            return;
+        }
+
+        [self resetSQLiteStatement:claim_events_stmt];
+
+        if (![self commitTransaction]) {
+            KCLogError(@"Failed to commit claim of events.");
+            [self rollbackTransaction];
+            failureHandler();
+            return;
+        }
+
+        lastLeaseID = newLeaseID;
+        claimedLeaseID = newLeaseID;
+        claimedLastEventID = lastClaimedEventID;
+        [self adjustEventCountForProjectID:projectID pending:YES by:newlyPendingCount];
+    }];
+
+    if (NULL != leaseID) {
+        *leaseID = claimedLeaseID ? [NSNumber numberWithLongLong:claimedLeaseID] : nil;
+    }
+    if (NULL != lastEventID) {
+        *lastEventID = claimedLastEventID ? [NSNumber numberWithLongLong:claimedLastEventID] : nil;
+    }
+}
+
+- (void)releaseLease:(NSNumber *)leaseID {
+    if (nil == leaseID) {
+        return;
+    }
+
+    if (![self checkOpenDB:@"DB is closed, skipping releaseLease"]) {
+        return;
+    }
+
+    [self dbAsync:^{
+        keen_io_sqlite3_stmt *release_lease_stmt = [self statementForSQL:kKIOReleaseLeaseSQL];
+        if (keen_io_sqlite3_bind_int64(release_lease_stmt, 1, [leaseID longLongValue]) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind lease id to release lease statement"];
+            return;
+        }
+        if (keen_io_sqlite3_step(release_lease_stmt) != SQLITE_DONE) {
+            [self handleSQLiteFailure:@"release lease"];
+            return;
+        }
+
+        // The events stay pending until they're claimed again.
+        [self resetSQLiteStatement:release_lease_stmt];
+    }];
 }
 
 - (void)resetPendingEventsWithProjectID:(NSString *)projectID {
@@ -595,9 +2446,9 @@
         return;
     }
 
-    const char *projectIDUTF8 = projectID.UTF8String;
-    dispatch_async(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(reset_pending_events_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
+    [self dbAsync:^{
+        keen_io_sqlite3_stmt *reset_pending_events_stmt = [self statementForSQL:kKIOResetPendingEventsSQL];
+        if (![self bindKeyForProjectID:projectID create:NO toStatement:reset_pending_events_stmt parameter:1]) {
             [self handleSQLiteFailure:@"bind pid to reset pending statement"];
             return;
         }
@@ -607,7 +2458,8 @@
         }
 
         [self resetSQLiteStatement:reset_pending_events_stmt];
-    });
+        [self setEventCount:0 forProjectID:projectID pending:YES];
+    }];
 }
 
 - (BOOL)hasPendingEventsWithProjectID:(NSString *)projectID {
@@ -624,156 +2476,1081 @@
 }
 
 - (NSUInteger)getPendingEventCountWithProjectID:(NSString *)projectID {
+    if (![self checkOpenDB:@"DB is closed, skipping getPendingEventcount"]) {
+        return 0;
+    }
+
+    return [self getEventCountWithProjectID:projectID pending:YES];
+}
+
+- (NSUInteger)getTotalEventCountWithProjectID:(NSString *)projectID {
+    if (![self checkOpenDB:@"DB is closed, skipping getTotalEventCount"]) {
+        return 0;
+    }
+
+    return [self getEventCountWithProjectID:projectID pending:NO];
+}
+
+// Returns the count from memory or the read connection when concurrent reads are enabled, and
+// only waits on the dbQueue when neither can answer.
+- (NSUInteger)getEventCountWithProjectID:(NSString *)projectID pending:(BOOL)pending {
     __block NSUInteger eventCount = 0;
 
-    if (![self checkOpenDB:@"DB is closed, skipping getPendingEventcount"]) {
-        return eventCount;
+    if (self.concurrentReadsEnabled) {
+        // Once a count is known it's kept up to date in memory, so there's no need to wait on the dbQueue.
+        NSNumber *cachedCount = [self cachedEventCountForProjectID:projectID pending:pending];
+        if (nil != cachedCount) {
+            return [cachedCount unsignedIntegerValue];
+        }
     }
 
     const char *projectIDUTF8 = projectID.UTF8String;
+    BOOL wasRead = [self readConcurrently:^{
+        eventCount = [self countEventsWithProjectID:projectIDUTF8
+                                          statement:pending ? read_count_pending_events_stmt
+                                                            : read_count_all_events_stmt];
+    }];
+    if (wasRead) {
+        return eventCount;
+    }
+
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(count_pending_events_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind pid to count pending statement"];
+    [self dbSync:^{
+        [self writeQueuedEvents];
+        eventCount = [self eventCountForProjectID:projectID pending:pending];
+    }];
+
+    return eventCount;
+}
+
+// Called on the readQueue. The count isn't cached, since the cached counts only change on the dbQueue.
+- (NSUInteger)countEventsWithProjectID:(const char *)projectIDUTF8 statement:(keen_io_sqlite3_stmt *)statement {
+    NSUInteger eventCount = 0;
+
+    if (keen_io_sqlite3_bind_text(statement, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind pid to read count events statement" onReadConnection:YES];
+        return eventCount;
+    }
+    if (keen_io_sqlite3_step(statement) == SQLITE_ROW) {
+        eventCount = (NSUInteger)keen_io_sqlite3_column_int64(statement, 0);
+    } else {
+        [self handleSQLiteFailure:@"read count of rows" onReadConnection:YES];
+        return eventCount;
+    }
+
+    [self resetSQLiteStatement:statement];
+    return eventCount;
+}
+
+- (void)deleteEvent:(NSNumber *)eventId {
+    if (![self checkOpenDB:@"DB is closed, skipping deleteEvent"]) {
+        return;
+    }
+
+    [self dbAsync:^{
+        // Look up which counts the event belongs to before it's gone
+        keen_io_sqlite3_stmt *find_event_by_id_stmt = [self statementForSQL:kKIOFindEventByIDSQL];
+        if (keen_io_sqlite3_bind_int64(find_event_by_id_stmt, 1, [eventId unsignedLongLongValue]) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind eventid to find by id statement"];
             return;
         }
-        if (keen_io_sqlite3_step(count_pending_events_stmt) == SQLITE_ROW) {
-            eventCount = (NSInteger)keen_io_sqlite3_column_int(count_pending_events_stmt, 0);
-        } else {
-            [self handleSQLiteFailure:@"get count of pending rows"];
+        int result = keen_io_sqlite3_step(find_event_by_id_stmt);
+        if (SQLITE_DONE == result) {
+            // Already deleted, nothing to do.
+            [self resetSQLiteStatement:find_event_by_id_stmt];
+            return;
+        } else if (SQLITE_ROW != result) {
+            [self handleSQLiteFailure:@"find event by id"];
+            return;
+        }
+        const char *projectIDUTF8 = (const char *)keen_io_sqlite3_column_text(find_event_by_id_stmt, 0);
+        NSString *projectID = projectIDUTF8 ? [NSString stringWithUTF8String:projectIDUTF8] : nil;
+        BOOL isPending = keen_io_sqlite3_column_int(find_event_by_id_stmt, 1) != 0;
+        const char *collectionUTF8 = (const char *)keen_io_sqlite3_column_text(find_event_by_id_stmt, 2);
+        NSString *collection = collectionUTF8 ? [NSString stringWithUTF8String:collectionUTF8] : nil;
+        long long eventBytes = keen_io_sqlite3_column_int64(find_event_by_id_stmt, 3);
+        [self resetSQLiteStatement:find_event_by_id_stmt];
+
+        keen_io_sqlite3_stmt *delete_event_stmt = [self statementForSQL:kKIODeleteEventSQL];
+        if (keen_io_sqlite3_bind_int64(delete_event_stmt, 1, [eventId unsignedLongLongValue]) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind eventid to delete statement"];
+            return;
+        }
+        if (keen_io_sqlite3_step(delete_event_stmt) != SQLITE_DONE) {
+            [self handleSQLiteFailure:@"delete event"];
             return;
+        };
+
+        [self resetSQLiteStatement:delete_event_stmt];
+        [self adjustEventCountForProjectID:projectID pending:NO by:-1];
+        [self adjustEventCountForProjectID:projectID collection:collection by:-1];
+        [self adjustBytesUsedForProjectID:projectID by:-eventBytes];
+        if (isPending) {
+            [self adjustEventCountForProjectID:projectID pending:YES by:-1];
         }
+    }];
+}
 
-        [self resetSQLiteStatement:count_pending_events_stmt];
-    });
+- (void)deleteAllEvents {
+    if (![self checkOpenDB:@"DB is closed, skipping deleteEvent"]) {
+        return;
+    }
 
-    return eventCount;
+    [self dbAsync:^{
+        // Events that haven't been written yet go too.
+        [self finishUnfinishedWrites:queuedEvents.count];
+        for (KIOQueuedEvent *queuedEvent in queuedEvents) {
+            [queuedEvent reportStored:NO];
+        }
+        [queuedEvents removeAllObjects];
+
+        keen_io_sqlite3_stmt *delete_all_events_stmt = [self statementForSQL:kKIODeleteAllEventsSQL];
+        if (keen_io_sqlite3_step(delete_all_events_stmt) != SQLITE_DONE) {
+            [self handleSQLiteFailure:@"delete all events"];
+            return;
+        };
+
+        [self resetSQLiteStatement:delete_all_events_stmt];
+
+        // Every project is empty now, reseeding is a cheap count of an empty table.
+        [self forgetEventCounts];
+    }];
 }
 
-- (NSUInteger)getTotalEventCountWithProjectID:(NSString *)projectID {
-    __block NSUInteger eventCount = 0;
+- (void)deleteEventsFromOffset:(NSNumber *)offset {
+    if (![self checkOpenDB:@"DB is closed, skipping deleteEventsFromOffset"]) {
+        return;
+    }
+
+    [self dbAsync:^{
+        [self writeQueuedEvents];
+
+        // Only the newest offset events are kept.
+        long long eventsToAgeOut = [self eventCountAcrossProjects] - [offset longLongValue];
+        if (eventsToAgeOut <= 0) {
+            return;
+        }
+
+        keen_io_sqlite3_stmt *find_age_out_watermark_stmt = [self statementForSQL:kKIOFindAgeOutWatermarkSQL];
+        if (keen_io_sqlite3_bind_int64(find_age_out_watermark_stmt, 1, eventsToAgeOut - 1) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind offset to age out watermark statement"];
+            return;
+        }
+        int result = keen_io_sqlite3_step(find_age_out_watermark_stmt);
+        if (SQLITE_ROW != result) {
+            if (SQLITE_DONE == result) {
+                // The count was off, so there's nothing to age out after all.
+                [self resetSQLiteStatement:find_age_out_watermark_stmt];
+                [self forgetEventCounts];
+            } else {
+                [self handleSQLiteFailure:@"find age out watermark"];
+            }
+            return;
+        }
+        long long watermark = keen_io_sqlite3_column_int64(find_age_out_watermark_stmt, 0);
+        [self resetSQLiteStatement:find_age_out_watermark_stmt];
+
+        // Count what's being aged out per project, collection and pending state before it's gone
+        keen_io_sqlite3_stmt *count_events_through_id_stmt = [self statementForSQL:kKIOCountEventsThroughIDSQL];
+        if (keen_io_sqlite3_bind_int64(count_events_through_id_stmt, 1, watermark) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind watermark to count events statement"];
+            return;
+        }
+        [self adjustCountsForEventsCountedBy:count_events_through_id_stmt];
+
+        keen_io_sqlite3_stmt *age_out_events_stmt = [self statementForSQL:kKIOAgeOutEventsSQL];
+        if (keen_io_sqlite3_bind_int64(age_out_events_stmt, 1, watermark) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind watermark to ageOut statement"];
+            return;
+        }
+        if (keen_io_sqlite3_step(age_out_events_stmt) != SQLITE_DONE) {
+            [self handleSQLiteFailure:@"delete all events"];
+            return;
+        };
+
+        [self resetSQLiteStatement:age_out_events_stmt];
+    }];
+}
+
+- (void)incrementEventUploadAttempts:(NSNumber *)eventId {
+    if (![self checkOpenDB:@"DB is closed, skipping incrementAttempts"]) {
+        return;
+    }
+
+    [self dbAsync:^{
+        keen_io_sqlite3_stmt *increment_event_attempts_statement =
+            [self statementForSQL:kKIOIncrementEventAttemptsSQL];
+        if (keen_io_sqlite3_bind_int64(increment_event_attempts_statement, 1, [eventId unsignedLongLongValue]) !=
+            SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind eventid to increment attempts statement"];
+            return;
+        }
+        if (keen_io_sqlite3_step(increment_event_attempts_statement) != SQLITE_DONE) {
+            [self handleSQLiteFailure:@"increment attempts"];
+            return;
+        };
+
+        [self resetSQLiteStatement:increment_event_attempts_statement];
+    }];
+}
+
+- (void)deleteEvents:(NSArray<NSNumber *> *)eventIds {
+    if (eventIds.count == 0) {
+        return;
+    }
+
+    if (![self checkOpenDB:@"DB is closed, skipping deleteEvents"]) {
+        return;
+    }
+
+    NSArray *eventIdsToDelete = [eventIds copy];
+    [self dbAsync:^{
+        if (![self beginTransaction]) {
+            return;
+        }
+
+        for (NSUInteger index = 0; index < eventIdsToDelete.count; index += kKIOBulkStatementSize) {
+            // Count what's being deleted per project, collection and pending state before it's gone
+            keen_io_sqlite3_stmt *count_events_by_ids_stmt = [self statementForSQL:kKIOCountEventsByIDsSQL];
+            if (![self bindEventIDs:eventIdsToDelete fromIndex:index toStatement:count_events_by_ids_stmt]) {
+                return;
+            }
+            [self adjustCountsForEventsCountedBy:count_events_by_ids_stmt];
+
+            keen_io_sqlite3_stmt *delete_events_by_ids_stmt = [self statementForSQL:kKIODeleteEventsByIDsSQL];
+            if (![self bindEventIDs:eventIdsToDelete fromIndex:index toStatement:delete_events_by_ids_stmt]) {
+                return;
+            }
+            if (keen_io_sqlite3_step(delete_events_by_ids_stmt) != SQLITE_DONE) {
+                [self handleSQLiteFailure:@"delete events"];
+                return;
+            }
+            [self resetSQLiteStatement:delete_events_by_ids_stmt];
+        }
+
+        if (![self commitTransaction]) {
+            KCLogError(@"Failed to commit deleting %lu events.", (unsigned long)eventIdsToDelete.count);
+            [self rollbackTransaction];
+            // The counts were adjusted for rows that are still there, so reseed them.
+            [self forgetEventCounts];
+        }
+    }];
+}
+
+// Called on the dbQueue with a bound statement that groups the events about to be deleted by
+// project, pending state and collection. Takes them off the counts and resets the statement.
+- (void)adjustCountsForEventsCountedBy:(keen_io_sqlite3_stmt *)statement {
+    while (keen_io_sqlite3_step(statement) == SQLITE_ROW) {
+        const char *projectIDUTF8 = (const char *)keen_io_sqlite3_column_text(statement, 0);
+        NSString *projectID = projectIDUTF8 ? [NSString stringWithUTF8String:projectIDUTF8] : nil;
+        BOOL isPending = keen_io_sqlite3_column_int(statement, 1) != 0;
+        long long count = keen_io_sqlite3_column_int64(statement, 2);
+        const char *collectionUTF8 = (const char *)keen_io_sqlite3_column_text(statement, 3);
+        NSString *collection = collectionUTF8 ? [NSString stringWithUTF8String:collectionUTF8] : nil;
+        long long eventBytes = keen_io_sqlite3_column_int64(statement, 4);
+
+        [self adjustEventCountForProjectID:projectID pending:NO by:-count];
+        [self adjustEventCountForProjectID:projectID collection:collection by:-count];
+        [self adjustBytesUsedForProjectID:projectID by:-eventBytes];
+        if (isPending) {
+            [self adjustEventCountForProjectID:projectID pending:YES by:-count];
+        }
+    }
+    [self resetSQLiteStatement:statement];
+}
+
+- (void)incrementUploadAttemptsForEvents:(NSArray<NSNumber *> *)eventIds {
+    if (eventIds.count == 0) {
+        return;
+    }
+
+    if (![self checkOpenDB:@"DB is closed, skipping incrementUploadAttempts"]) {
+        return;
+    }
+
+    NSArray *eventIdsToIncrement = [eventIds copy];
+    [self dbAsync:^{
+        if (![self beginTransaction]) {
+            return;
+        }
+
+        for (NSUInteger index = 0; index < eventIdsToIncrement.count; index += kKIOBulkStatementSize) {
+            keen_io_sqlite3_stmt *increment_events_attempts_by_ids_statement =
+                [self statementForSQL:kKIOIncrementEventsAttemptsByIDsSQL];
+            if (![self bindEventIDs:eventIdsToIncrement
+                          fromIndex:index
+                        toStatement:increment_events_attempts_by_ids_statement]) {
+                return;
+            }
+            if (keen_io_sqlite3_step(increment_events_attempts_by_ids_statement) != SQLITE_DONE) {
+                [self handleSQLiteFailure:@"increment attempts"];
+                return;
+            }
+            [self resetSQLiteStatement:increment_events_attempts_by_ids_statement];
+        }
+
+        if (![self commitTransaction]) {
+            KCLogError(@"Failed to commit incrementing attempts of %lu events.",
+                       (unsigned long)eventIdsToIncrement.count);
+            [self rollbackTransaction];
+        }
+    }];
+}
+
+// Called on the dbQueue. Binds the next kKIOBulkStatementSize ids starting at index to a bulk
+// statement, binding NULL to any parameters left over since NULL never matches an id.
+- (BOOL)bindEventIDs:(NSArray *)eventIds fromIndex:(NSUInteger)index toStatement:(keen_io_sqlite3_stmt *)statement {
+    for (int parameter = 1; parameter <= kKIOBulkStatementSize; parameter++) {
+        NSUInteger eventIndex = index + parameter - 1;
+        int result = eventIndex < eventIds.count
+                         ? keen_io_sqlite3_bind_int64(statement, parameter, [eventIds[eventIndex] longLongValue])
+                         : keen_io_sqlite3_bind_null(statement, parameter);
+        if (result != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind event ids to bulk statement"];
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)purgePendingEventsWithProjectID:(NSString *)projectID {
+    if (![self checkOpenDB:@"DB is closed, skipping purgePendingEvents"]) {
+        return;
+    }
+
+    [self dbAsync:^{
+        keen_io_sqlite3_stmt *purge_events_stmt = [self statementForSQL:kKIOPurgeEventsSQL];
+        if (![self bindKeyForProjectID:projectID create:NO toStatement:purge_events_stmt parameter:1]) {
+            [self handleSQLiteFailure:@"bind pid to purge statement"];
+            return;
+        }
+        if (keen_io_sqlite3_step(purge_events_stmt) != SQLITE_DONE) {
+            [self handleSQLiteFailure:@"purge pending events"];
+            return;
+        };
+
+        [self resetSQLiteStatement:purge_events_stmt];
+        [self adjustEventCountForProjectID:projectID pending:NO by:-keen_io_sqlite3_changes(keen_dbname)];
+        [self setEventCount:0 forProjectID:projectID pending:YES];
+        // Pending events could be in any collection and of any size, so reseed the project's
+        // collection counts and bytes.
+        [self forgetCollectionEventCountsForProjectID:projectID];
+        [self forgetBytesUsedForProjectID:projectID];
+    }];
+}
+
+#pragma mark Compression Methods
+
+@synthesize compressionDictionary = _compressionDictionary;
+
+- (NSData *)compressionDictionary {
+    [compressionLock lock];
+    NSData *compressionDictionary = _compressionDictionary;
+    [compressionLock unlock];
+    return compressionDictionary;
+}
+
+- (void)setCompressionDictionary:(NSData *)compressionDictionary {
+    NSData *dictionary = [compressionDictionary copy];
+    // Events already compressed with the previous dictionary keep it registered.
+    [self addDecompressionDictionary:dictionary];
+
+    [compressionLock lock];
+    _compressionDictionary = dictionary;
+    [compressionLock unlock];
+}
+
+- (void)addDecompressionDictionary:(NSData *)dictionary {
+    if (0 == dictionary.length) {
+        return;
+    }
+
+    // The same checksum deflateSetDictionary writes into the zlib header.
+    uLong dictionaryID = adler32(adler32(0L, Z_NULL, 0), (const Bytef *)dictionary.bytes, (uInt)dictionary.length);
+    NSData *dictionaryCopy = [dictionary copy];
+
+    [compressionLock lock];
+    NSMutableDictionary *dictionaries = [compressionDictionaries mutableCopy];
+    dictionaries[[NSNumber numberWithUnsignedLong:dictionaryID]] = dictionaryCopy;
+    compressionDictionaries = dictionaries;
+    [compressionLock unlock];
+}
+
+// Returns the data to store for an event, setting codec to how it was encoded. Data that
+// doesn't get any smaller is stored as is.
+- (NSData *)encodeEventData:(NSData *)eventData codec:(KIODBStoreCompression *)codec {
+    if (KIODBStoreCompressionDeflate == *codec) {
+        NSData *compressedData = [self.class deflateData:eventData dictionary:self.compressionDictionary];
+        if (nil != compressedData && compressedData.length < eventData.length) {
+            return compressedData;
+        }
+    }
+
+    *codec = KIODBStoreCompressionNone;
+    return eventData;
+}
+
+// Returns the original event data, or nil if it couldn't be decoded.
+- (NSData *)decodeEventBytes:(const void *)bytes length:(int)length codec:(KIODBStoreCompression)codec {
+    switch (codec) {
+        case KIODBStoreCompressionNone:
+            return [[NSData alloc] initWithBytes:bytes length:length];
+        case KIODBStoreCompressionDeflate: {
+            [compressionLock lock];
+            NSDictionary *dictionaries = compressionDictionaries;
+            [compressionLock unlock];
+            return [self.class inflateBytes:bytes length:length dictionaries:dictionaries];
+        }
+    }
+    return nil;
+}
+
++ (NSData *)deflateData:(NSData *)data dictionary:(NSData *)dictionary {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        return nil;
+    }
+
+    // The zlib header records the dictionary's checksum, so inflate can tell if it needs one.
+    if (dictionary.length > 0 &&
+        deflateSetDictionary(&stream, (const Bytef *)dictionary.bytes, (uInt)dictionary.length) != Z_OK) {
+        deflateEnd(&stream);
+        return nil;
+    }
+
+    NSMutableData *compressedData = [NSMutableData dataWithLength:deflateBound(&stream, data.length)];
+    stream.next_in = (Bytef *)data.bytes;
+    stream.avail_in = (uInt)data.length;
+    stream.next_out = (Bytef *)compressedData.mutableBytes;
+    stream.avail_out = (uInt)compressedData.length;
+    int result = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        return nil;
+    }
+
+    compressedData.length = stream.total_out;
+    return compressedData;
+}
+
+// Dictionaries are looked up by the checksum in the zlib header, so each event finds the one it was
+// compressed with.
++ (NSData *)inflateBytes:(const void *)bytes
+                  length:(NSUInteger)length
+            dictionaries:(NSDictionary<NSNumber *, NSData *> *)dictionaries {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    stream.next_in = (Bytef *)bytes;
+    stream.avail_in = (uInt)length;
+    if (inflateInit(&stream) != Z_OK) {
+        return nil;
+    }
+
+    // JSON usually compresses to well under a quarter, so start there and grow as needed.
+    NSMutableData *data = [NSMutableData dataWithLength:MAX(length * 4, 256)];
+    int result;
+    do {
+        if (stream.total_out >= data.length) {
+            data.length *= 2;
+        }
+        stream.next_out = (Bytef *)data.mutableBytes + stream.total_out;
+        stream.avail_out = (uInt)(data.length - stream.total_out);
+        result = inflate(&stream, Z_NO_FLUSH);
+        if (Z_NEED_DICT == result) {
+            // zlib leaves the id of the dictionary it needs in adler.
+            NSData *dictionary = dictionaries[[NSNumber numberWithUnsignedLong:stream.adler]];
+            if (dictionary.length == 0 ||
+                inflateSetDictionary(&stream, (const Bytef *)dictionary.bytes, (uInt)dictionary.length) != Z_OK) {
+                // Written with a dictionary we don't have.
+                break;
+            }
+            result = Z_OK;
+        }
+    } while (Z_OK == result);
+    inflateEnd(&stream);
+    if (result != Z_STREAM_END) {
+        return nil;
+    }
+
+    data.length = stream.total_out;
+    return data;
+}
+
+#pragma mark Event Count Methods
+
+// The counts only change on the dbQueue, which is what keeps them consistent with the table.
+// They're read under countsLock so cachedEventCountForProjectID can be called from any thread.
+
+- (NSMutableDictionary *)eventCountsForPending:(BOOL)pending {
+    return pending ? pendingEventCounts : totalEventCounts;
+}
+
+// Called on the dbQueue.
+- (NSUInteger)eventCountForProjectID:(NSString *)projectID pending:(BOOL)pending {
+    // A NULL projectID never matches `projectKey=?`, so there's nothing to count.
+    if (nil == projectID) {
+        return 0;
+    }
+
+    [countsLock lock];
+    NSNumber *count = [[self eventCountsForPending:pending] objectForKey:projectID];
+    [countsLock unlock];
+
+    if (nil == count) {
+        // First time this project's count has been asked for, so seed it from the table.
+        keen_io_sqlite3_stmt *countStatement =
+            [self statementForSQL:pending ? kKIOCountPendingEventsSQL : kKIOCountAllEventsSQL];
+        if (![self bindKeyForProjectID:projectID create:NO toStatement:countStatement parameter:1]) {
+            [self handleSQLiteFailure:@"bind pid to count events statement"];
+            return 0;
+        }
+        if (keen_io_sqlite3_step(countStatement) == SQLITE_ROW) {
+            count = [NSNumber numberWithLongLong:keen_io_sqlite3_column_int64(countStatement, 0)];
+        } else {
+            [self handleSQLiteFailure:@"get count of rows"];
+            return 0;
+        }
+
+        [self resetSQLiteStatement:countStatement];
+        [self setEventCount:[count longLongValue] forProjectID:projectID pending:pending];
+    }
+
+    return [count unsignedIntegerValue];
+}
+
+// Returns the count without going through the dbQueue, or nil if it isn't known yet or
+// there are writes the dbQueue hasn't finished that could still change it.
+- (NSNumber *)cachedEventCountForProjectID:(NSString *)projectID pending:(BOOL)pending {
+    if (nil == projectID) {
+        return nil;
+    }
+
+    [countsLock lock];
+    NSNumber *count = 0 == unfinishedWriteCount ? [[self eventCountsForPending:pending] objectForKey:projectID] : nil;
+    [countsLock unlock];
+    return count;
+}
+
+// Called on the dbQueue.
+- (void)adjustEventCountForProjectID:(NSString *)projectID pending:(BOOL)pending by:(long long)delta {
+    [countsLock lock];
+    // Counts that haven't been seeded yet will include this change when they are.
+    if (!pending && nil != eventCountAcrossProjects) {
+        long long countAcrossProjects = [eventCountAcrossProjects longLongValue] + delta;
+        eventCountAcrossProjects = [NSNumber numberWithLongLong:MAX(0, countAcrossProjects)];
+    }
+    NSMutableDictionary *counts = [self eventCountsForPending:pending];
+    NSNumber *count = projectID ? [counts objectForKey:projectID] : nil;
+    if (nil != count) {
+        [counts setObject:[NSNumber numberWithLongLong:MAX(0, [count longLongValue] + delta)] forKey:projectID];
+    }
+    [countsLock unlock];
+}
+
+// Called on the dbQueue.
+- (long long)eventCountAcrossProjects {
+    [countsLock lock];
+    NSNumber *count = eventCountAcrossProjects;
+    [countsLock unlock];
+
+    if (nil == count) {
+        // First time the count has been asked for, so seed it from the table.
+        keen_io_sqlite3_stmt *count_every_event_stmt = [self statementForSQL:kKIOCountEveryEventSQL];
+        if (keen_io_sqlite3_step(count_every_event_stmt) == SQLITE_ROW) {
+            count = [NSNumber numberWithLongLong:keen_io_sqlite3_column_int64(count_every_event_stmt, 0)];
+        } else {
+            [self handleSQLiteFailure:@"count every event"];
+            return 0;
+        }
+        [self resetSQLiteStatement:count_every_event_stmt];
+
+        [countsLock lock];
+        eventCountAcrossProjects = count;
+        [countsLock unlock];
+    }
+
+    return [count longLongValue];
+}
+
+// Called on the dbQueue.
+- (void)setEventCount:(long long)count forProjectID:(NSString *)projectID pending:(BOOL)pending {
+    if (nil != projectID) {
+        [countsLock lock];
+        [[self eventCountsForPending:pending] setObject:[NSNumber numberWithLongLong:count] forKey:projectID];
+        [countsLock unlock];
+    }
+}
+
+// Called on the dbQueue. Every count is seeded from the table again the next time it's needed.
+- (void)forgetEventCounts {
+    [countsLock lock];
+    [totalEventCounts removeAllObjects];
+    [pendingEventCounts removeAllObjects];
+    eventCountAcrossProjects = nil;
+    [collectionEventCounts removeAllObjects];
+    [projectBytesUsed removeAllObjects];
+    totalBytesUsed = nil;
+    [countsLock unlock];
+}
+
+#pragma mark Collection Cap Methods
+
+- (void)setMaxEvents:(NSUInteger)maxEvents forCollection:(NSString *)collection {
+    if (nil == collection) {
+        return;
+    }
+
+    [countsLock lock];
+    [collectionCaps setObject:[NSNumber numberWithUnsignedInteger:maxEvents] forKey:collection];
+    [countsLock unlock];
+}
+
+- (NSUInteger)maxEventsForCollection:(NSString *)collection {
+    return [self maxEventsForCollection:collection projectID:nil];
+}
+
+- (void)setMaxEventsPerCollection:(NSUInteger)maxEvents
+                    eventsToEvict:(NSUInteger)eventsToEvict
+                     forProjectID:(NSString *)projectID {
+    if (nil == projectID) {
+        return;
+    }
+
+    [countsLock lock];
+    [projectCollectionCaps setObject:[NSNumber numberWithUnsignedInteger:maxEvents] forKey:projectID];
+    [projectEvictionBatches setObject:[NSNumber numberWithUnsignedInteger:eventsToEvict] forKey:projectID];
+    [countsLock unlock];
+}
+
+// The cap for a collection of a project: the collection's own, then the project's, then maxEventsPerCollection.
+- (NSUInteger)maxEventsForCollection:(NSString *)collection projectID:(NSString *)projectID {
+    [countsLock lock];
+    NSNumber *cap = collection ? [collectionCaps objectForKey:collection] : nil;
+    if (nil == cap && nil != projectID) {
+        cap = [projectCollectionCaps objectForKey:projectID];
+    }
+    [countsLock unlock];
+    return cap ? [cap unsignedIntegerValue] : self.maxEventsPerCollection;
+}
+
+- (NSUInteger)eventsToEvictForProjectID:(NSString *)projectID {
+    [countsLock lock];
+    NSNumber *batch = projectID ? [projectEvictionBatches objectForKey:projectID] : nil;
+    [countsLock unlock];
+    return batch ? [batch unsignedIntegerValue] : self.eventsToEvictPerCollection;
+}
+
+- (NSUInteger)getEventCountWithProjectID:(NSString *)projectID collection:(NSString *)collection {
+    __block NSUInteger eventCount = 0;
+
+    if (![self checkOpenDB:@"DB is closed, skipping getEventCount"]) {
+        return eventCount;
+    }
+
+    // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
+    // queue
+    [self dbSync:^{
+        [self writeQueuedEvents];
+        eventCount = [self eventCountForProjectID:projectID collection:collection];
+    }];
+
+    return eventCount;
+}
+
+// Called on the dbQueue before an event is inserted. If its collection is full, evicts the collection's
+// oldest events. Walks the collection index from its start, so the cost doesn't grow with the table.
+- (BOOL)makeRoomInCollection:(NSString *)collection projectID:(NSString *)projectID {
+    NSUInteger maxEvents = [self maxEventsForCollection:collection projectID:projectID];
+    if (0 == maxEvents || nil == collection || nil == projectID) {
+        return YES;
+    }
+
+    NSUInteger eventCount = [self eventCountForProjectID:projectID collection:collection];
+    // We add 1 because we want to know if this will push us over the limit
+    if (eventCount + 1 <= maxEvents) {
+        return YES;
+    }
+
+    // Evict a batch at a time so a full collection doesn't evict on every add.
+    NSUInteger eventsToEvict =
+        MAX(eventCount + 1 - maxEvents, MIN([self eventsToEvictForProjectID:projectID], eventCount));
+    KCLogWarn(@"Too many events in cache for %@, aging out %lu old events.", collection, (unsigned long)eventsToEvict);
+
+    keen_io_sqlite3_stmt *find_oldest_collection_events_stmt =
+        [self statementForSQL:kKIOFindOldestCollectionEventsSQL];
+    if (![self bindKeyForProjectID:projectID create:NO toStatement:find_oldest_collection_events_stmt parameter:1] ||
+        ![self bindKeyForCollection:collection create:NO toStatement:find_oldest_collection_events_stmt parameter:2] ||
+        keen_io_sqlite3_bind_int64(find_oldest_collection_events_stmt, 3, eventsToEvict) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind find oldest collection events statement"];
+        return NO;
+    }
+
+    long long lastEvictedEventID = 0;
+    long long evictedCount = 0;
+    long long evictedPendingCount = 0;
+    long long evictedBytes = 0;
+    while (keen_io_sqlite3_step(find_oldest_collection_events_stmt) == SQLITE_ROW) {
+        lastEvictedEventID = keen_io_sqlite3_column_int64(find_oldest_collection_events_stmt, 0);
+        evictedCount++;
+        if (keen_io_sqlite3_column_int(find_oldest_collection_events_stmt, 1) != 0) {
+            evictedPendingCount++;
+        }
+        evictedBytes += keen_io_sqlite3_column_int64(find_oldest_collection_events_stmt, 2);
+    }
+    [self resetSQLiteStatement:find_oldest_collection_events_stmt];
+
+    if (0 == evictedCount) {
+        // The count was off, the collection is actually empty.
+        [self setEventCount:0 forProjectID:projectID collection:collection];
+        return YES;
+    }
+
+    keen_io_sqlite3_stmt *evict_collection_events_stmt = [self statementForSQL:kKIOEvictCollectionEventsSQL];
+    if (![self bindKeyForProjectID:projectID create:NO toStatement:evict_collection_events_stmt parameter:1] ||
+        ![self bindKeyForCollection:collection create:NO toStatement:evict_collection_events_stmt parameter:2] ||
+        keen_io_sqlite3_bind_int64(evict_collection_events_stmt, 3, lastEvictedEventID) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind evict collection events statement"];
+        return NO;
+    }
+    if (keen_io_sqlite3_step(evict_collection_events_stmt) != SQLITE_DONE) {
+        [self handleSQLiteFailure:@"evict collection events"];
+        return NO;
+    }
+    [self resetSQLiteStatement:evict_collection_events_stmt];
+
+    [self adjustEventCountForProjectID:projectID pending:NO by:-evictedCount];
+    [self adjustEventCountForProjectID:projectID pending:YES by:-evictedPendingCount];
+    [self adjustEventCountForProjectID:projectID collection:collection by:-evictedCount];
+    [self adjustBytesUsedForProjectID:projectID by:-evictedBytes];
+
+    return YES;
+}
+
+// Called on the dbQueue.
+- (NSUInteger)eventCountForProjectID:(NSString *)projectID collection:(NSString *)collection {
+    // NULLs never match `projectKey=?` or `collectionKey=?`, so there's nothing to count.
+    if (nil == projectID || nil == collection) {
+        return 0;
+    }
+
+    [countsLock lock];
+    NSNumber *count = [[collectionEventCounts objectForKey:projectID] objectForKey:collection];
+    [countsLock unlock];
+
+    if (nil == count) {
+        // First time this collection's count has been asked for, so seed it from the collection index.
+        keen_io_sqlite3_stmt *count_collection_events_stmt = [self statementForSQL:kKIOCountCollectionEventsSQL];
+        if (![self bindKeyForProjectID:projectID create:NO toStatement:count_collection_events_stmt parameter:1] ||
+            ![self bindKeyForCollection:collection create:NO toStatement:count_collection_events_stmt parameter:2]) {
+            [self handleSQLiteFailure:@"bind count collection events statement"];
+            return 0;
+        }
+        if (keen_io_sqlite3_step(count_collection_events_stmt) == SQLITE_ROW) {
+            count = [NSNumber numberWithLongLong:keen_io_sqlite3_column_int64(count_collection_events_stmt, 0)];
+        } else {
+            [self handleSQLiteFailure:@"get count of collection rows"];
+            return 0;
+        }
+
+        [self resetSQLiteStatement:count_collection_events_stmt];
+        [self setEventCount:[count longLongValue] forProjectID:projectID collection:collection];
+    }
+
+    return [count unsignedIntegerValue];
+}
+
+// Called on the dbQueue.
+- (void)adjustEventCountForProjectID:(NSString *)projectID collection:(NSString *)collection by:(long long)delta {
+    if (nil == projectID || nil == collection) {
+        return;
+    }
+
+    [countsLock lock];
+    NSMutableDictionary *counts = [collectionEventCounts objectForKey:projectID];
+    NSNumber *count = [counts objectForKey:collection];
+    // Counts that haven't been seeded yet will include this change when they are.
+    if (nil != count) {
+        [counts setObject:[NSNumber numberWithLongLong:MAX(0, [count longLongValue] + delta)] forKey:collection];
+    }
+    [countsLock unlock];
+}
+
+// Called on the dbQueue.
+- (void)setEventCount:(long long)count forProjectID:(NSString *)projectID collection:(NSString *)collection {
+    if (nil == projectID || nil == collection) {
+        return;
+    }
+
+    [countsLock lock];
+    NSMutableDictionary *counts = [collectionEventCounts objectForKey:projectID];
+    if (nil == counts) {
+        counts = [NSMutableDictionary dictionary];
+        [collectionEventCounts setObject:counts forKey:projectID];
+    }
+    [counts setObject:[NSNumber numberWithLongLong:count] forKey:collection];
+    [countsLock unlock];
+}
+
+// Called on the dbQueue.
+- (void)forgetCollectionEventCountsForProjectID:(NSString *)projectID {
+    if (nil == projectID) {
+        return;
+    }
+
+    [countsLock lock];
+    [collectionEventCounts removeObjectForKey:projectID];
+    [countsLock unlock];
+}
+
+#pragma mark Byte Budget Methods
+
+- (unsigned long long)getBytesUsedWithProjectID:(NSString *)projectID {
+    __block unsigned long long bytesUsed = 0;
+
+    if (![self checkOpenDB:@"DB is closed, skipping getBytesUsed"]) {
+        return bytesUsed;
+    }
+
+    // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
+    // queue
+    [self dbSync:^{
+        [self writeQueuedEvents];
+        bytesUsed = [self bytesUsedForProjectID:projectID];
+    }];
+
+    return bytesUsed;
+}
+
+- (unsigned long long)getTotalBytesUsed {
+    __block unsigned long long bytesUsed = 0;
 
-    if (![self checkOpenDB:@"DB is closed, skipping getTotalEventCount"]) {
-        return eventCount;
+    if (![self checkOpenDB:@"DB is closed, skipping getTotalBytesUsed"]) {
+        return bytesUsed;
     }
 
-    const char *projectIDUTF8 = projectID.UTF8String;
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(count_all_events_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind pid to total event statement"];
-            return;
-        }
-        if (keen_io_sqlite3_step(count_all_events_stmt) == SQLITE_ROW) {
-            eventCount = (NSInteger)keen_io_sqlite3_column_int(count_all_events_stmt, 0);
-        } else {
-            [self handleSQLiteFailure:@"get count of total rows"];
-            return;
-        }
+    [self dbSync:^{
+        [self writeQueuedEvents];
+        bytesUsed = [self bytesUsedForProjectID:nil];
+    }];
 
-        [self resetSQLiteStatement:count_all_events_stmt];
-    });
-
-    return eventCount;
+    return bytesUsed;
 }
 
-- (void)deleteEvent:(NSNumber *)eventId {
-    if (![self checkOpenDB:@"DB is closed, skipping deleteEvent"]) {
-        return;
+// Called on the dbQueue before an event is inserted. Evicts the oldest events that aren't leased in the
+// project, and then across every project, until the new event fits both budgets with bytesToEvictOverBudget
+// to spare.
+- (BOOL)makeRoomForBytes:(NSUInteger)eventBytes projectID:(NSString *)projectID {
+    // Leased events are on their way to the server, and are deleted once they're there.
+    NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+    // Evict down to a low-water mark so a budget that stays full doesn't evict on every add.
+    long long bytesToEvictOverBudget = self.bytesToEvictOverBudget;
+
+    NSUInteger maxBytesPerProject = self.maxBytesPerProject;
+    if (maxBytesPerProject > 0 && nil != projectID) {
+        long long bytesToFree = [self bytesUsedForProjectID:projectID] + eventBytes - maxBytesPerProject;
+        if (bytesToFree > 0) {
+            bytesToFree += bytesToEvictOverBudget;
+            KCLogWarn(@"Storage budget for project %@ exceeded, aging out old events.", projectID);
+            keen_io_sqlite3_stmt *find_oldest_project_events_stmt =
+                [self statementForSQL:kKIOFindOldestProjectEventsSQL];
+            if (NULL == find_oldest_project_events_stmt) {
+                return NO;
+            }
+            keen_io_sqlite3_stmt *evict_project_events_stmt = [self statementForSQL:kKIOEvictProjectEventsSQL];
+            if (NULL == evict_project_events_stmt) {
+                return NO;
+            }
+            if (![self bindKeyForProjectID:projectID
+                                    create:NO
+                               toStatement:find_oldest_project_events_stmt
+                                 parameter:1] ||
+                ![self bindKeyForProjectID:projectID create:NO toStatement:evict_project_events_stmt parameter:1] ||
+                keen_io_sqlite3_bind_double(find_oldest_project_events_stmt, 2, now) != SQLITE_OK ||
+                keen_io_sqlite3_bind_double(evict_project_events_stmt, 2, now) != SQLITE_OK) {
+                [self handleSQLiteFailure:@"bind evict project events statements"];
+                return NO;
+            }
+            if (![self evictBytes:bytesToFree
+                    findStatement:find_oldest_project_events_stmt
+                  deleteStatement:evict_project_events_stmt
+                  lastIDParameter:3]) {
+                return NO;
+            }
+        }
     }
 
-    dispatch_async(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_int64(delete_event_stmt, 1, [eventId unsignedLongLongValue]) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind eventid to delete statement"];
-            return;
+    NSUInteger maxTotalBytes = self.maxTotalBytes;
+    if (maxTotalBytes > 0) {
+        long long bytesToFree = [self bytesUsedForProjectID:nil] + eventBytes - maxTotalBytes;
+        if (bytesToFree > 0) {
+            bytesToFree += bytesToEvictOverBudget;
+            KCLogWarn(@"Storage budget exceeded, aging out old events.");
+            keen_io_sqlite3_stmt *find_oldest_events_stmt = [self statementForSQL:kKIOFindOldestEventsSQL];
+            if (NULL == find_oldest_events_stmt) {
+                return NO;
+            }
+            keen_io_sqlite3_stmt *evict_events_stmt = [self statementForSQL:kKIOEvictEventsSQL];
+            if (NULL == evict_events_stmt) {
+                return NO;
+            }
+            if (keen_io_sqlite3_bind_double(find_oldest_events_stmt, 1, now) != SQLITE_OK ||
+                keen_io_sqlite3_bind_double(evict_events_stmt, 1, now) != SQLITE_OK) {
+                [self handleSQLiteFailure:@"bind evict events statements"];
+                return NO;
+            }
+            if (![self evictBytes:bytesToFree
+                    findStatement:find_oldest_events_stmt
+                  deleteStatement:evict_events_stmt
+                  lastIDParameter:2]) {
+                return NO;
+            }
         }
-        if (keen_io_sqlite3_step(delete_event_stmt) != SQLITE_DONE) {
-            [self handleSQLiteFailure:@"delete event"];
-            return;
-        };
+    }
 
-        [self resetSQLiteStatement:delete_event_stmt];
-    });
+    return YES;
 }
 
-- (void)deleteAllEvents {
-    if (![self checkOpenDB:@"DB is closed, skipping deleteEvent"]) {
-        return;
+// Called on the dbQueue. Steps findStatement, oldest first, until the events seen add up to bytesToFree,
+// then runs deleteStatement with the last of their ids bound to parameter lastIDParameter. Any other
+// parameters of both statements have been bound already.
+- (BOOL)evictBytes:(long long)bytesToFree
+     findStatement:(keen_io_sqlite3_stmt *)findStatement
+   deleteStatement:(keen_io_sqlite3_stmt *)deleteStatement
+   lastIDParameter:(int)lastIDParameter {
+    long long lastEvictedEventID = 0;
+    long long freedBytes = 0;
+    // Adjustments to the counts, gathered until the delete succeeds.
+    NSMutableArray *evictedEvents = [NSMutableArray array];
+
+    while (freedBytes < bytesToFree && keen_io_sqlite3_step(findStatement) == SQLITE_ROW) {
+        lastEvictedEventID = keen_io_sqlite3_column_int64(findStatement, 0);
+        const char *projectIDUTF8 = (const char *)keen_io_sqlite3_column_text(findStatement, 1);
+        const char *collectionUTF8 = (const char *)keen_io_sqlite3_column_text(findStatement, 4);
+        long long eventBytes = keen_io_sqlite3_column_int64(findStatement, 3);
+        freedBytes += eventBytes;
+
+        [evictedEvents addObject:@[
+            projectIDUTF8 ? [NSString stringWithUTF8String:projectIDUTF8] : [NSNull null],
+            collectionUTF8 ? [NSString stringWithUTF8String:collectionUTF8] : [NSNull null],
+            [NSNumber numberWithBool:keen_io_sqlite3_column_int(findStatement, 2) != 0],
+            [NSNumber numberWithLongLong:eventBytes]
+        ]];
     }
+    [self resetSQLiteStatement:findStatement];
 
-    dispatch_async(self.dbQueue, ^{
-        if (keen_io_sqlite3_step(delete_all_events_stmt) != SQLITE_DONE) {
-            [self handleSQLiteFailure:@"delete all events"];
-            return;
-        };
-
-        [self resetSQLiteStatement:delete_all_events_stmt];
-    });
-}
-
-- (void)deleteEventsFromOffset:(NSNumber *)offset {
-    if (![self checkOpenDB:@"DB is closed, skipping deleteEvent"]) {
-        return;
+    if (0 == lastEvictedEventID) {
+        // Nothing left to evict.
+        [self resetSQLiteStatement:deleteStatement];
+        return YES;
     }
 
-    dispatch_async(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_int64(age_out_events_stmt, 1, [offset unsignedLongLongValue]) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind offset to ageOut statement"];
-            return;
+    if (keen_io_sqlite3_bind_int64(deleteStatement, lastIDParameter, lastEvictedEventID) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind id to evict events statement"];
+        return NO;
+    }
+    if (keen_io_sqlite3_step(deleteStatement) != SQLITE_DONE) {
+        [self handleSQLiteFailure:@"evict events"];
+        return NO;
+    }
+    [self resetSQLiteStatement:deleteStatement];
+
+    for (NSArray *evictedEvent in evictedEvents) {
+        NSString *projectID = evictedEvent[0] == [NSNull null] ? nil : evictedEvent[0];
+        NSString *collection = evictedEvent[1] == [NSNull null] ? nil : evictedEvent[1];
+        [self adjustEventCountForProjectID:projectID pending:NO by:-1];
+        if ([evictedEvent[2] boolValue]) {
+            [self adjustEventCountForProjectID:projectID pending:YES by:-1];
         }
-        if (keen_io_sqlite3_step(age_out_events_stmt) != SQLITE_DONE) {
-            [self handleSQLiteFailure:@"delete all events"];
-            return;
-        };
+        [self adjustEventCountForProjectID:projectID collection:collection by:-1];
+        [self adjustBytesUsedForProjectID:projectID by:-[evictedEvent[3] longLongValue]];
+    }
 
-        [self resetSQLiteStatement:age_out_events_stmt];
-    });
+    return YES;
 }
 
-- (void)incrementEventUploadAttempts:(NSNumber *)eventId {
-    if (![self checkOpenDB:@"DB is closed, skipping incrementAttempts"]) {
-        return;
-    }
+// Called on the dbQueue. A nil projectID gets the bytes used across every project.
+- (unsigned long long)bytesUsedForProjectID:(NSString *)projectID {
+    [countsLock lock];
+    NSNumber *bytesUsed = projectID ? [projectBytesUsed objectForKey:projectID] : totalBytesUsed;
+    [countsLock unlock];
+
+    if (nil == bytesUsed) {
+        // First time these bytes have been asked for, so seed them from the table.
+        keen_io_sqlite3_stmt *sumStatement =
+            [self statementForSQL:projectID ? kKIOSumProjectBytesSQL : kKIOSumAllBytesSQL];
+        if (nil != projectID && ![self bindKeyForProjectID:projectID create:NO toStatement:sumStatement parameter:1]) {
+            [self handleSQLiteFailure:@"bind pid to sum bytes statement"];
+            return 0;
+        }
+        if (keen_io_sqlite3_step(sumStatement) == SQLITE_ROW) {
+            // total() returns a float, so an empty table is 0.0 rather than NULL.
+            bytesUsed = [NSNumber numberWithLongLong:(long long)keen_io_sqlite3_column_double(sumStatement, 0)];
+        } else {
+            [self handleSQLiteFailure:@"sum bytes of rows"];
+            return 0;
+        }
+        [self resetSQLiteStatement:sumStatement];
 
-    dispatch_async(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_int64(increment_event_attempts_statement, 1, [eventId unsignedLongLongValue]) !=
-            SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind eventid to increment attempts statement"];
-            return;
+        [countsLock lock];
+        if (projectID) {
+            [projectBytesUsed setObject:bytesUsed forKey:projectID];
+        } else {
+            totalBytesUsed = bytesUsed;
         }
-        if (keen_io_sqlite3_step(increment_event_attempts_statement) != SQLITE_DONE) {
-            [self handleSQLiteFailure:@"increment attempts"];
-            return;
-        };
+        [countsLock unlock];
+    }
 
-        [self resetSQLiteStatement:increment_event_attempts_statement];
-    });
+    return [bytesUsed unsignedLongLongValue];
 }
 
-- (void)purgePendingEventsWithProjectID:(NSString *)projectID {
-    if (![self checkOpenDB:@"DB is closed, skipping purgePendingEvents"]) {
-        return;
+// Called on the dbQueue. Adjusts both the project's bytes and the bytes across every project.
+- (void)adjustBytesUsedForProjectID:(NSString *)projectID by:(long long)delta {
+    [countsLock lock];
+    NSNumber *bytesUsed = projectID ? [projectBytesUsed objectForKey:projectID] : nil;
+    // Bytes that haven't been seeded yet will include this change when they are.
+    if (nil != bytesUsed) {
+        [projectBytesUsed setObject:[NSNumber numberWithLongLong:MAX(0, [bytesUsed longLongValue] + delta)]
+                             forKey:projectID];
     }
+    if (nil != totalBytesUsed) {
+        totalBytesUsed = [NSNumber numberWithLongLong:MAX(0, [totalBytesUsed longLongValue] + delta)];
+    }
+    [countsLock unlock];
+}
 
-    const char *projectIDUTF8 = [projectID UTF8String];
-    dispatch_async(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(purge_events_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind pid to purge statement"];
-            return;
-        }
-        if (keen_io_sqlite3_step(purge_events_stmt) != SQLITE_DONE) {
-            [self handleSQLiteFailure:@"purge pending events"];
-            return;
-        };
-
-        [self resetSQLiteStatement:purge_events_stmt];
-    });
+// Called on the dbQueue. The project's bytes, and so the bytes across every project, are seeded again
+// the next time they're needed.
+- (void)forgetBytesUsedForProjectID:(NSString *)projectID {
+    [countsLock lock];
+    if (nil != projectID) {
+        [projectBytesUsed removeObjectForKey:projectID];
+    }
+    totalBytesUsed = nil;
+    [countsLock unlock];
 }
 
 #pragma mark - Handle Queries
 
++ (int64_t)hashForQuery:(NSData *)queryData queryType:(NSString *)queryType collection:(NSString *)collection {
+    uint64_t hash = KIOHashString(kKIOFNVOffsetBasis, queryType);
+    hash = KIOHashString(hash, collection);
+
+    id query = queryData.length > 0 ? [NSJSONSerialization JSONObjectWithData:queryData options:0 error:nil] : nil;
+    if (nil != query) {
+        hash = KIOHashJSONObject(hash, query);
+    } else {
+        // Not JSON, so there's nothing to canonicalize.
+        hash = KIOHashBytes(hash, queryData.bytes, queryData.length);
+    }
+
+    // SQLite integers are signed.
+    return (int64_t)hash;
+}
+
 - (BOOL)addQuery:(NSData *)queryData
        queryType:(NSString *)queryType
       collection:(NSString *)eventCollection
@@ -787,9 +3564,11 @@
     const char *projectIDUTF8 = projectID.UTF8String;
     const char *eventCollectionUTF8 = eventCollection.UTF8String;
     const char *queryTypeUTF8 = queryType.UTF8String;
+    int64_t queryHash = [self.class hashForQuery:queryData queryType:queryType collection:eventCollection];
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
+    [self dbSync:^{
+        keen_io_sqlite3_stmt *insert_query_stmt = [self statementForSQL:kKIOInsertQuerySQL];
         if (keen_io_sqlite3_bind_text(insert_query_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
             [self handleSQLiteFailure:@"bind pid to add event statement"];
             return;
@@ -811,6 +3590,11 @@
             return;
         }
 
+        if (keen_io_sqlite3_bind_int64(insert_query_stmt, 5, queryHash) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind query hash to add event statement"];
+            return;
+        }
+
         if (keen_io_sqlite3_step(insert_query_stmt) != SQLITE_DONE) {
             [self handleSQLiteFailure:@"insert query"];
             return;
@@ -819,7 +3603,7 @@
         wasAdded = YES;
 
         [self resetSQLiteStatement:insert_query_stmt];
-    });
+    }];
 
     return wasAdded;
 }
@@ -828,6 +3612,15 @@
                         queryType:(NSString *)queryType
                        collection:(NSString *)eventCollection
                         projectID:(NSString *)projectID {
+    return [self getQuery:queryData queryType:queryType collection:eventCollection projectID:projectID ttlSQL:nil];
+}
+
+// Looks a query up, skipping it if it was created more than ttlSQL ago. A nil ttlSQL matches any age.
+- (NSMutableDictionary *)getQuery:(NSData *)queryData
+                        queryType:(NSString *)queryType
+                       collection:(NSString *)eventCollection
+                        projectID:(NSString *)projectID
+                           ttlSQL:(NSString *)ttlSQL {
     // Create a dictionary to hold the contents of our select.
     __block NSMutableDictionary *query = nil;
 
@@ -838,65 +3631,113 @@
     const char *projectIDUTF8 = projectID.UTF8String;
     const char *eventCollectionUTF8 = eventCollection.UTF8String;
     const char *queryTypeUTF8 = queryType.UTF8String;
+    const char *ttlUTF8 = ttlSQL.UTF8String;
+    int64_t queryHash = [self.class hashForQuery:queryData queryType:queryType collection:eventCollection];
+    BOOL wasRead = [self readConcurrently:^{
+        query = [self findQuery:queryData
+                       queryHash:queryHash
+                       queryType:queryTypeUTF8
+                      collection:eventCollectionUTF8
+                       projectID:projectIDUTF8
+                             ttl:ttlUTF8
+                       statement:read_get_query_stmt
+                onReadConnection:YES];
+    }];
+    if (wasRead) {
+        return query;
+    }
+
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(get_query_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind pid to get query statement"];
-            return;
-        }
+    [self dbSync:^{
+        query = [self findQuery:queryData
+                       queryHash:queryHash
+                       queryType:queryTypeUTF8
+                      collection:eventCollectionUTF8
+                       projectID:projectIDUTF8
+                             ttl:ttlUTF8
+                       statement:[self statementForSQL:kKIOGetQuerySQL]
+                onReadConnection:NO];
+    }];
 
-        if (keen_io_sqlite3_bind_text(get_query_stmt, 2, eventCollectionUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind collection to get query statement"];
-            return;
-        }
+    return query;
+}
 
-        if (keen_io_sqlite3_bind_blob(
-                get_query_stmt, 3, [queryData bytes], (int)[queryData length], SQLITE_TRANSIENT) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind query data to get query statement"];
-            return;
-        }
+// Returns the query's row as a dictionary, or nil if it isn't stored or the lookup failed.
+- (NSMutableDictionary *)findQuery:(NSData *)queryData
+                         queryHash:(int64_t)queryHash
+                         queryType:(const char *)queryTypeUTF8
+                        collection:(const char *)eventCollectionUTF8
+                         projectID:(const char *)projectIDUTF8
+                               ttl:(const char *)ttlUTF8
+                         statement:(keen_io_sqlite3_stmt *)statement
+                  onReadConnection:(BOOL)onReadConnection {
+    NSMutableDictionary *query = nil;
+
+    if (keen_io_sqlite3_bind_text(statement, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind pid to get query statement" onReadConnection:onReadConnection];
+        return nil;
+    }
 
-        if (keen_io_sqlite3_bind_text(get_query_stmt, 4, queryTypeUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind query type to get query statement"];
-            return;
-        }
+    if (keen_io_sqlite3_bind_text(statement, 2, eventCollectionUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind collection to get query statement" onReadConnection:onReadConnection];
+        return nil;
+    }
 
-        int result = keen_io_sqlite3_step(get_query_stmt);
-        if (SQLITE_ROW == result) {
-            // Fetch data out the statement
-            query = [NSMutableDictionary dictionary];
+    if (keen_io_sqlite3_bind_blob(
+            statement, 3, [queryData bytes], (int)[queryData length], SQLITE_TRANSIENT) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind query data to get query statement" onReadConnection:onReadConnection];
+        return nil;
+    }
 
-            NSNumber *queryID = [NSNumber numberWithUnsignedLongLong:keen_io_sqlite3_column_int64(get_query_stmt, 0)];
+    if (keen_io_sqlite3_bind_text(statement, 4, queryTypeUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind query type to get query statement" onReadConnection:onReadConnection];
+        return nil;
+    }
 
-            NSString *eventCollection =
-                [NSString stringWithUTF8String:(char *)keen_io_sqlite3_column_text(get_query_stmt, 1)];
+    if (keen_io_sqlite3_bind_int64(statement, 5, queryHash) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind query hash to get query statement" onReadConnection:onReadConnection];
+        return nil;
+    }
 
-            const void *dataPtr = keen_io_sqlite3_column_blob(get_query_stmt, 2);
-            int dataSize = keen_io_sqlite3_column_bytes(get_query_stmt, 2);
+    int ttlResult = NULL != ttlUTF8 ? keen_io_sqlite3_bind_text(statement, 6, ttlUTF8, -1, SQLITE_TRANSIENT)
+                                    : keen_io_sqlite3_bind_null(statement, 6);
+    if (ttlResult != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind ttl to get query statement" onReadConnection:onReadConnection];
+        return nil;
+    }
 
-            NSData *data = [[NSData alloc] initWithBytes:dataPtr length:dataSize];
+    int result = keen_io_sqlite3_step(statement);
+    if (SQLITE_ROW == result) {
+        // Fetch data out the statement
+        query = [NSMutableDictionary dictionary];
 
-            NSString *queryType =
-                [NSString stringWithUTF8String:(char *)keen_io_sqlite3_column_text(get_query_stmt, 3)];
+        NSNumber *queryID = [NSNumber numberWithUnsignedLongLong:keen_io_sqlite3_column_int64(statement, 0)];
 
-            NSNumber *attempts = [NSNumber numberWithUnsignedLong:keen_io_sqlite3_column_int(get_query_stmt, 4)];
+        NSString *eventCollection = [NSString stringWithUTF8String:(char *)keen_io_sqlite3_column_text(statement, 1)];
 
-            [query setObject:queryID forKey:@"queryID"];
-            [query setObject:eventCollection forKey:@"event_collection"];
-            [query setObject:data forKey:@"queryData"];
-            [query setObject:queryType forKey:@"queryType"];
-            [query setObject:attempts forKey:@"attempts"];
-        } else if (SQLITE_DONE != result) {
-            // SQLITE_DONE just means there weren't any results, which isn't a db error.
-            // If we got anything else, we treat it as an error here.
-            [self handleSQLiteFailure:@"find query"];
-            return;
-        }
+        const void *dataPtr = keen_io_sqlite3_column_blob(statement, 2);
+        int dataSize = keen_io_sqlite3_column_bytes(statement, 2);
 
-        [self resetSQLiteStatement:get_query_stmt];
-    });
+        NSData *data = [[NSData alloc] initWithBytes:dataPtr length:dataSize];
+
+        NSString *queryType = [NSString stringWithUTF8String:(char *)keen_io_sqlite3_column_text(statement, 3)];
+
+        NSNumber *attempts = [NSNumber numberWithUnsignedLong:keen_io_sqlite3_column_int(statement, 4)];
+
+        [query setObject:queryID forKey:@"queryID"];
+        [query setObject:eventCollection forKey:@"event_collection"];
+        [query setObject:data forKey:@"queryData"];
+        [query setObject:queryType forKey:@"queryType"];
+        [query setObject:attempts forKey:@"attempts"];
+    } else if (SQLITE_DONE != result) {
+        // SQLITE_DONE just means there weren't any results, which isn't a db error.
+        // If we got anything else, we treat it as an error here.
+        [self handleSQLiteFailure:@"find query" onReadConnection:onReadConnection];
+        return nil;
+    }
 
+    [self resetSQLiteStatement:statement];
     return query;
 }
 
@@ -907,7 +3748,9 @@
         return wasUpdated;
     }
 
-    dispatch_sync(self.dbQueue, ^{
+    [self dbSync:^{
+        keen_io_sqlite3_stmt *increment_query_attempts_statement =
+            [self statementForSQL:kKIOIncrementQueryAttemptsSQL];
         if (keen_io_sqlite3_bind_int64(increment_query_attempts_statement, 1, [queryID unsignedLongLongValue]) !=
             SQLITE_OK) {
             [self handleSQLiteFailure:@"bind eventid to increment attempts statement"];
@@ -921,7 +3764,7 @@
         wasUpdated = YES;
 
         [self resetSQLiteStatement:increment_query_attempts_statement];
-    });
+    }];
 
     return wasUpdated;
 }
@@ -930,8 +3773,31 @@
                 queryType:(NSString *)queryType
                collection:(NSString *)eventCollection
                 projectID:(NSString *)projectID {
+    [self findOrUpdateQuery:queryData queryType:queryType collection:eventCollection projectID:projectID ttlSQL:nil];
+}
+
+- (void)findOrUpdateQuery:(NSData *)queryData
+                queryType:(NSString *)queryType
+               collection:(NSString *)eventCollection
+                projectID:(NSString *)projectID
+                 queryTTL:(int)queryTTL {
+    NSString *ttlSQL = [NSString stringWithFormat:@"-%d seconds", queryTTL];
+    [self findOrUpdateQuery:queryData
+                  queryType:queryType
+                 collection:eventCollection
+                  projectID:projectID
+                     ttlSQL:ttlSQL];
+}
+
+// An expired query that hasn't been swept yet isn't found, so a fresh row is added rather than
+// carrying its old attempts forward.
+- (void)findOrUpdateQuery:(NSData *)queryData
+                queryType:(NSString *)queryType
+               collection:(NSString *)eventCollection
+                projectID:(NSString *)projectID
+                   ttlSQL:(NSString *)ttlSQL {
     NSMutableDictionary *returnedQuery =
-        [self getQuery:queryData queryType:queryType collection:eventCollection projectID:projectID];
+        [self getQuery:queryData queryType:queryType collection:eventCollection projectID:projectID ttlSQL:ttlSQL];
     if (returnedQuery != nil) {
         // if query is found, update query attempts
         [self incrementQueryAttempts:[returnedQuery objectForKey:@"queryID"]];
@@ -949,23 +3815,43 @@
     }
 
     const char *projectIDUTF8 = projectID.UTF8String;
+    BOOL wasRead = [self readConcurrently:^{
+        queryCount = [self countQueriesWithProjectID:projectIDUTF8
+                                           statement:read_count_all_queries_stmt
+                                    onReadConnection:YES];
+    }];
+    if (wasRead) {
+        return queryCount;
+    }
+
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(count_all_queries_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind pid to total query statement"];
-            return;
-        }
-        if (keen_io_sqlite3_step(count_all_queries_stmt) == SQLITE_ROW) {
-            queryCount = (NSInteger)keen_io_sqlite3_column_int(count_all_queries_stmt, 0);
-        } else {
-            [self handleSQLiteFailure:@"get count of total query rows"];
-            return;
-        }
+    [self dbSync:^{
+        queryCount = [self countQueriesWithProjectID:projectIDUTF8
+                                           statement:[self statementForSQL:kKIOCountAllQueriesSQL]
+                                    onReadConnection:NO];
+    }];
 
-        [self resetSQLiteStatement:count_all_queries_stmt];
-    });
+    return queryCount;
+}
+
+- (NSUInteger)countQueriesWithProjectID:(const char *)projectIDUTF8
+                              statement:(keen_io_sqlite3_stmt *)statement
+                       onReadConnection:(BOOL)onReadConnection {
+    NSUInteger queryCount = 0;
+
+    if (keen_io_sqlite3_bind_text(statement, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind pid to total query statement" onReadConnection:onReadConnection];
+        return queryCount;
+    }
+    if (keen_io_sqlite3_step(statement) == SQLITE_ROW) {
+        queryCount = (NSInteger)keen_io_sqlite3_column_int(statement, 0);
+    } else {
+        [self handleSQLiteFailure:@"get count of total query rows" onReadConnection:onReadConnection];
+        return queryCount;
+    }
 
+    [self resetSQLiteStatement:statement];
     return queryCount;
 }
 
@@ -981,15 +3867,18 @@
         return hasFoundQueryWithMaxAttempts;
     }
 
-    // clear query database based on timespan
-    [self deleteQueriesOlderThan:[NSNumber numberWithInt:queryTTL]];
+    // clear query database based on timespan, without waiting for it
+    [self scheduleQuerySweepWithTTL:queryTTL];
 
     const char *projectIDUTF8 = projectID.UTF8String;
     const char *eventCollectionUTF8 = eventCollection.UTF8String;
     const char *queryTypeUTF8 = queryType.UTF8String;
+    NSString *ttlSQL = [NSString stringWithFormat:@"-%d seconds", queryTTL];
+    int64_t queryHash = [self.class hashForQuery:queryData queryType:queryType collection:eventCollection];
     // we need to wait for the queue to finish because this method has a return value that we're manipulating in the
     // queue
-    dispatch_sync(self.dbQueue, ^{
+    [self dbSync:^{
+        keen_io_sqlite3_stmt *get_query_with_attempts_stmt = [self statementForSQL:kKIOGetQueryWithAttemptsSQL];
         if (keen_io_sqlite3_bind_text(get_query_with_attempts_stmt, 1, projectIDUTF8, -1, SQLITE_STATIC) != SQLITE_OK) {
             [self handleSQLiteFailure:@"bind pid to has query with max attempts statement"];
             return;
@@ -1017,6 +3906,17 @@
             [self handleSQLiteFailure:@"bind attempts to has query with max attempts statement"];
         }
 
+        if (keen_io_sqlite3_bind_int64(get_query_with_attempts_stmt, 6, queryHash) != SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind query hash to has query with max attempts statement"];
+            return;
+        }
+
+        if (keen_io_sqlite3_bind_text(get_query_with_attempts_stmt, 7, ttlSQL.UTF8String, -1, SQLITE_TRANSIENT) !=
+            SQLITE_OK) {
+            [self handleSQLiteFailure:@"bind ttl to has query with max attempts statement"];
+            return;
+        }
+
         int result = keen_io_sqlite3_step(get_query_with_attempts_stmt);
         if (SQLITE_ROW == result) {
             hasFoundQueryWithMaxAttempts = YES;
@@ -1028,7 +3928,7 @@
         }
 
         [self resetSQLiteStatement:get_query_with_attempts_stmt];
-    });
+    }];
 
     return hasFoundQueryWithMaxAttempts;
 }
@@ -1038,14 +3938,15 @@
         return;
     }
 
-    dispatch_async(self.dbQueue, ^{
+    [self dbAsync:^{
+        keen_io_sqlite3_stmt *delete_all_queries_stmt = [self statementForSQL:kKIODeleteAllQueriesSQL];
         if (keen_io_sqlite3_step(delete_all_queries_stmt) != SQLITE_DONE) {
             [self handleSQLiteFailure:@"delete all queries"];
             return;
         };
 
         [self resetSQLiteStatement:delete_all_queries_stmt];
-    });
+    }];
 }
 
 - (void)deleteQueriesOlderThan:(NSNumber *)seconds {
@@ -1053,20 +3954,64 @@
         return;
     }
 
-    const char *secondsSQLUTF8String = [[NSString stringWithFormat:@"-%@ seconds", seconds] UTF8String];
-    dispatch_sync(self.dbQueue, ^{
-        if (keen_io_sqlite3_bind_text(age_out_queries_stmt, 1, secondsSQLUTF8String, -1, SQLITE_STATIC) != SQLITE_OK) {
-            [self handleSQLiteFailure:@"bind seconds to delete query statement"];
+    NSString *ttlSQL = [NSString stringWithFormat:@"-%@ seconds", seconds];
+    [self dbSync:^{
+        [self ageOutQueriesWithTTL:ttlSQL];
+    }];
+}
+
+// Called on the dbQueue. Deletes the queries created longer ago than a datetime modifier such as "-60 seconds".
+- (void)ageOutQueriesWithTTL:(NSString *)ttlSQL {
+    keen_io_sqlite3_stmt *age_out_queries_stmt = [self statementForSQL:kKIOAgeOutQueriesSQL];
+    if (keen_io_sqlite3_bind_text(age_out_queries_stmt, 1, ttlSQL.UTF8String, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
+        [self handleSQLiteFailure:@"bind seconds to delete query statement"];
+        return;
+    }
+
+    if (keen_io_sqlite3_step(age_out_queries_stmt) != SQLITE_DONE) {
+        [self handleSQLiteFailure:@"delete old queries"];
+        return;
+    };
+
+    [self resetSQLiteStatement:age_out_queries_stmt];
+}
+
+// Deletes expired queries on the dbQueue without waiting for it, at most once every querySweepInterval
+// seconds. Lookups skip expired queries themselves, so nothing waits on the sweep. That's also why it
+// isn't counted as an unfinished write, which would turn off concurrent reads and cached counts
+// until it ran, and why it runs at background QoS where the OS has it.
+- (void)scheduleQuerySweepWithTTL:(int)queryTTL {
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    [querySweepLock lock];
+    BOOL isDue = 0 == lastQuerySweepTime || now - lastQuerySweepTime >= self.querySweepInterval;
+    if (isDue) {
+        lastQuerySweepTime = now;
+    }
+    [querySweepLock unlock];
+
+    if (isDue) {
+        [openLock lock];
+        dispatch_queue_t queue = dbIsOpen ? self.dbQueue : nil;
+        [openLock unlock];
+        if (nil == queue) {
             return;
         }
 
-        if (keen_io_sqlite3_step(age_out_queries_stmt) != SQLITE_DONE) {
-            [self handleSQLiteFailure:@"delete old queries"];
-            return;
+        NSString *ttlSQL = [NSString stringWithFormat:@"-%d seconds", queryTTL];
+        dispatch_block_t sweep = ^{
+            // Not worth reopening a store that was closed in the meantime.
+            if (NULL != keen_dbname) {
+                [self ageOutQueriesWithTTL:ttlSQL];
+            }
         };
-
-        [self resetSQLiteStatement:age_out_queries_stmt];
-    });
+        if (NULL != &dispatch_block_create_with_qos_class) {
+            sweep = dispatch_block_create_with_qos_class(DISPATCH_BLOCK_ENFORCE_QOS_CLASS,
+                                                         QOS_CLASS_BACKGROUND,
+                                                         0,
+                                                         sweep);
+        }
+        dispatch_async(queue, sweep);
+    }
 }
 
 #pragma mark - Helper Methods -
@@ -1080,148 +4025,17 @@
     return true;
 }
 
-- (BOOL)prepareSQLStatement:(keen_io_sqlite3_stmt **)sqlStatement
-                   sqlQuery:(char *)sqlQuery
-             failureMessage:(NSString *)failureMessage {
-    if (keen_io_sqlite3_prepare_v2(keen_dbname, sqlQuery, -1, sqlStatement, NULL) != SQLITE_OK) {
-        [self handleSQLiteFailure:failureMessage];
-        return NO;
-    }
-    return YES;
-}
-
 - (void)resetSQLiteStatement:(keen_io_sqlite3_stmt *)sqliteStatement {
     keen_io_sqlite3_reset(sqliteStatement);
     keen_io_sqlite3_clear_bindings(sqliteStatement);
 }
 
-- (BOOL)prepareAllSQLiteStatements {
-    // EVENT STATEMENTS
-
-    // This statement inserts events into the table.
-    if (![self prepareSQLStatement:&insert_event_stmt
-                          sqlQuery:"INSERT INTO events (projectID, collection, eventData, pending, attempts) VALUES "
-                                   "(?, ?, ?, 0, 0)"
-                    failureMessage:@"prepare insert event statement"])
-        return NO;
-
-    // This statement finds non-pending events in the table.
-    if (![self
-            prepareSQLStatement:&find_event_stmt
-                       sqlQuery:
-                           "SELECT id, collection, eventData FROM events WHERE pending=0 AND projectID=? AND attempts<?"
-                 failureMessage:@"prepare find non-pending events statement"])
-        return NO;
-
-    // This statement counts the total number of events (pending or not)
-    if (![self prepareSQLStatement:&count_all_events_stmt
-                          sqlQuery:"SELECT count(*) FROM events WHERE projectID=?"
-                    failureMessage:@"prepare count all events statement"])
-        return NO;
-
-    // This statement counts the number of pending events.
-    if (![self prepareSQLStatement:&count_pending_events_stmt
-                          sqlQuery:"SELECT count(*) FROM events WHERE pending=1 AND projectID=?"
-                    failureMessage:@"prepare count pending events statement"])
-        return NO;
-
-    // This statement marks an event as pending.
-    if (![self prepareSQLStatement:&make_pending_event_stmt
-                          sqlQuery:"UPDATE events SET pending=1 WHERE id=?"
-                    failureMessage:@"prepare mark event as pending statement"])
-        return NO;
-
-    // This statement resets pending events back to normal.
-    if (![self prepareSQLStatement:&reset_pending_events_stmt
-                          sqlQuery:"UPDATE events SET pending=0 WHERE projectID=?"
-                    failureMessage:@"prepare reset pending statement"])
-        return NO;
-
-    // This statement purges all pending events.
-    if (![self prepareSQLStatement:&purge_events_stmt
-                          sqlQuery:"DELETE FROM events WHERE pending=1 AND projectID=?"
-                    failureMessage:@"prepare purge pending events statement"])
-        return NO;
-
-    // This statement deletes a specific event.
-    if (![self prepareSQLStatement:&delete_event_stmt
-                          sqlQuery:"DELETE FROM events WHERE id=?"
-                    failureMessage:@"prepare delete specific event statement"])
-        return NO;
-
-    // This statement deletes all events.
-    if (![self prepareSQLStatement:&delete_all_events_stmt
-                          sqlQuery:"DELETE FROM events"
-                    failureMessage:@"prepare delete all events statement"])
-        return NO;
-
-    // This statement deletes old events at a given offset.
-    if (![self prepareSQLStatement:&age_out_events_stmt
-                          sqlQuery:
-                              "DELETE FROM events WHERE id <= (SELECT id FROM events ORDER BY id DESC LIMIT 1 OFFSET ?)"
-                    failureMessage:@"prepare delete old events at offset statement"])
-        return NO;
-
-    // This statement increments the attempts count of an event.
-    if (![self prepareSQLStatement:&increment_event_attempts_statement
-                          sqlQuery:"UPDATE events SET attempts = attempts + 1 WHERE id=?"
-                    failureMessage:@"prepare event increment attempt statement"])
-        return NO;
-
-    // This statement deletes events exceeding a max attempt limit.
-    if (![self prepareSQLStatement:&delete_too_many_attempts_events_statement
-                          sqlQuery:"DELETE FROM events WHERE attempts >= ?"
-                    failureMessage:@"prepare delete max attempts events statement"])
-        return NO;
-
-    // QUERY STATEMENTS
-
-    // This statement inserts queries into the table.
-    if (![self prepareSQLStatement:&insert_query_stmt
-                          sqlQuery:"INSERT INTO queries (projectID, collection, queryData, queryType, attempts) VALUES "
-                                   "(?, ?, ?, ?, 0)"
-                    failureMessage:@"prepare insert query statement"])
-        return NO;
-
-    // This statement counts the total number of queries
-    if (![self prepareSQLStatement:&count_all_queries_stmt
-                          sqlQuery:"SELECT count(*) FROM queries WHERE projectID=?"
-                    failureMessage:@"prepare count all queries statement"])
-        return NO;
-
-    // This statement searches for and returns a query.
-    if (![self prepareSQLStatement:&get_query_stmt
-                          sqlQuery:"SELECT id, collection, queryData, queryType, attempts FROM queries WHERE "
-                                   "projectID=? AND collection=? AND queryData=? AND queryType=?"
-                    failureMessage:@"prepare find query statement"])
-        return NO;
-
-    // This statement searches for and returns a query given an attempts value.
-    if (![self prepareSQLStatement:&get_query_with_attempts_stmt
-                          sqlQuery:"SELECT id FROM queries WHERE projectID=? AND collection=? AND queryData=? AND "
-                                   "queryType=? AND attempts >=?"
-                    failureMessage:@"prepare find query with attempts statement"])
-        return NO;
-
-    // This statement increments the attempts count of a query.
-    if (![self prepareSQLStatement:&increment_query_attempts_statement
-                          sqlQuery:"UPDATE queries SET attempts = attempts + 1 WHERE id=?"
-                    failureMessage:@"prepare query increment attempt statement"])
-        return NO;
-
-    // This statement deletes all queries.
-    if (![self prepareSQLStatement:&delete_all_queries_stmt
-                          sqlQuery:"DELETE FROM queries"
-                    failureMessage:@"prepare delete all queries statement"])
-        return NO;
-
-    // This statement deletes old queries at a given time.
-    if (![self prepareSQLStatement:&age_out_queries_stmt
-                          sqlQuery:"DELETE FROM queries WHERE dateCreated <= datetime('now', ?)"
-                    failureMessage:@"prepare delete old queries at seconds statement"])
-        return NO;
-
-    return YES;
+- (void)handleSQLiteFailure:(NSString *)msg onReadConnection:(BOOL)onReadConnection {
+    if (onReadConnection) {
+        [self handleReadFailure:msg];
+    } else {
+        [self handleSQLiteFailure:msg];
+    }
 }
 
 - (void)handleSQLiteFailure:(NSString *)msg {
@@ -1231,9 +4045,7 @@
     int result = keen_io_sqlite3_errcode(keen_dbname);
     [self closeDB];
     if (SQLITE_CORRUPT == result) {
-        NSString *dbFile = [self.class getSqliteFullFileName];
-        KCLogError(@"Deleting corrupt db: %@", dbFile);
-        [[NSFileManager defaultManager] removeItemAtPath:dbFile error:nil];
+        [self deleteDatabaseFiles];
     }
 }
 
@@ -14,4 +14,8 @@
 
 - (void)drainQueue;
 
+// The 64-bit hash queries are looked up by. Query data that's JSON is hashed in a canonical form,
+// with dictionary keys in sorted order.
++ (int64_t)hashForQuery:(NSData *)queryData queryType:(NSString *)queryType collection:(NSString *)collection;
+
 @end
@@ -0,0 +1,84 @@
+//
+//  KIOEventBatch.h
+//  KeenClient
+//
+//  Created by Keen Labs on 7/10/17.
+//  Copyright © 2017 Keen Labs. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ A batch of events claimed from an event store. Instead of an object per event, the event
+ data of the whole batch is copied into one buffer, with a parallel array of ids and
+ an offset and length for each event.
+ */
+@interface KIOEventBatch : NSObject
+
+/**
+ The number of events in the batch.
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ The ids of the events in the batch, in id order. Points at count ids, and is valid for
+ as long as the batch is.
+ */
+@property (nonatomic, readonly) const int64_t *eventIDs;
+
+/**
+ The distinct collections of the events in the batch.
+ */
+@property (nonatomic, readonly) NSArray *collections;
+
+/**
+ Create an empty batch.
+
+ @param eventCapacity The number of events to make room for up front.
+ @param byteCapacity The number of bytes of event data to make room for up front.
+ */
+- (instancetype)initWithEventCapacity:(NSUInteger)eventCapacity byteCapacity:(NSUInteger)byteCapacity;
+
+/**
+ Copy an event into the batch. Used by the event stores while the batch is filled.
+
+ @param eventID The event's id.
+ @param collection The event's collection, as a UTF-8 C string. An event with a NULL
+                   collection is left out of the batch.
+ @param bytes The event's data.
+ @param length The length of the event's data.
+ */
+- (void)appendEventID:(int64_t)eventID
+           collection:(const char *)collection
+                bytes:(const void *)bytes
+               length:(NSUInteger)length;
+
+/**
+ The id of the event at index.
+ */
+- (int64_t)eventIDAtIndex:(NSUInteger)index;
+
+/**
+ The collection of the event at index.
+ */
+- (NSString *)collectionAtIndex:(NSUInteger)index;
+
+/**
+ The data of the event at index, pointing into the batch's buffer. Valid for as long as
+ the batch is.
+
+ @param index The index of the event.
+ @param length Set to the length of the event's data.
+ */
+- (const void *)bytesAtIndex:(NSUInteger)index length:(NSUInteger *)length;
+
+/**
+ The data of the event at index, as an NSData that shares the batch's buffer rather than
+ copying it. The buffer stays alive for as long as the NSData does.
+
+ The event data isn't copied, but each call still allocates an NSData. Use
+ bytesAtIndex:length: when a pointer and a length will do.
+ */
+- (NSData *)eventDataAtIndex:(NSUInteger)index;
+
+@end
@@ -0,0 +1,128 @@
+//
+//  KIOEventBatch.m
+//  KeenClient
+//
+//  Created by Keen Labs on 7/10/17.
+//  Copyright © 2017 Keen Labs. All rights reserved.
+//
+
+#import "KIOEventBatch.h"
+
+// Where an event's data and collection live in the batch.
+typedef struct {
+    NSUInteger offset;
+    NSUInteger length;
+    NSUInteger collectionIndex;
+} KIOEventBatchSlice;
+
+@implementation KIOEventBatch {
+    NSMutableData *buffer;
+    NSMutableData *eventIDsData;
+    NSMutableData *slicesData;
+
+    // Collection names, and the same names as NUL terminated UTF-8 so rows
+    // can be matched against them without creating a string per row.
+    NSMutableArray *collectionNames;
+    NSMutableArray *collectionNamesUTF8;
+
+    // Deallocator for the views eventDataAtIndex: hands out. It holds on to the buffer
+    // until the view is gone, and is shared so each view doesn't copy a block of its own.
+    void (^bufferDeallocator)(void *, NSUInteger);
+}
+
+- (instancetype)initWithEventCapacity:(NSUInteger)eventCapacity byteCapacity:(NSUInteger)byteCapacity {
+    self = [super init];
+
+    if (self) {
+        buffer = [NSMutableData dataWithCapacity:byteCapacity];
+        eventIDsData = [NSMutableData dataWithCapacity:eventCapacity * sizeof(int64_t)];
+        slicesData = [NSMutableData dataWithCapacity:eventCapacity * sizeof(KIOEventBatchSlice)];
+        collectionNames = [NSMutableArray array];
+        collectionNamesUTF8 = [NSMutableArray array];
+
+        NSMutableData *sharedBuffer = buffer;
+        bufferDeallocator = ^(void *viewBytes, NSUInteger viewLength) {
+            [sharedBuffer length];
+        };
+    }
+    return self;
+}
+
+- (instancetype)init {
+    return [self initWithEventCapacity:0 byteCapacity:0];
+}
+
+- (void)appendEventID:(int64_t)eventID
+           collection:(const char *)collection
+                bytes:(const void *)bytes
+               length:(NSUInteger)length {
+    if (NULL == collection) {
+        // An event without a collection can't be uploaded anywhere, so it's left out.
+        return;
+    }
+
+    KIOEventBatchSlice slice;
+    slice.offset = buffer.length;
+    slice.length = length;
+    slice.collectionIndex = [self indexOfCollection:collection];
+
+    [buffer appendBytes:bytes length:length];
+    [eventIDsData appendBytes:&eventID length:sizeof(eventID)];
+    [slicesData appendBytes:&slice length:sizeof(slice)];
+}
+
+- (NSUInteger)indexOfCollection:(const char *)collection {
+    // Batches only hold a handful of collections, so a linear search is plenty.
+    NSUInteger count = collectionNamesUTF8.count;
+    for (NSUInteger i = 0; i < count; i++) {
+        if (strcmp([collectionNamesUTF8[i] bytes], collection) == 0) {
+            return i;
+        }
+    }
+
+    [collectionNames addObject:[NSString stringWithUTF8String:collection]];
+    [collectionNamesUTF8 addObject:[NSData dataWithBytes:collection length:strlen(collection) + 1]];
+    return count;
+}
+
+- (NSUInteger)count {
+    return eventIDsData.length / sizeof(int64_t);
+}
+
+- (const int64_t *)eventIDs {
+    return eventIDsData.bytes;
+}
+
+- (NSArray *)collections {
+    return [collectionNames copy];
+}
+
+- (int64_t)eventIDAtIndex:(NSUInteger)index {
+    return self.eventIDs[index];
+}
+
+- (NSString *)collectionAtIndex:(NSUInteger)index {
+    return collectionNames[[self sliceAtIndex:index].collectionIndex];
+}
+
+- (const void *)bytesAtIndex:(NSUInteger)index length:(NSUInteger *)length {
+    KIOEventBatchSlice slice = [self sliceAtIndex:index];
+    if (NULL != length) {
+        *length = slice.length;
+    }
+    return (const uint8_t *)buffer.bytes + slice.offset;
+}
+
+- (NSData *)eventDataAtIndex:(NSUInteger)index {
+    NSUInteger length;
+    const void *bytes = [self bytesAtIndex:index length:&length];
+
+    return [[NSData alloc] initWithBytesNoCopy:(void *)bytes length:length deallocator:bufferDeallocator];
+}
+
+- (KIOEventBatchSlice)sliceAtIndex:(NSUInteger)index {
+    NSAssert(index < self.count, @"Event index %lu is out of range", (unsigned long)index);
+    return ((const KIOEventBatchSlice *)slicesData.bytes)[index];
+}
+
+@end
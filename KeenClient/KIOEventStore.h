@@ -0,0 +1,154 @@
+//
+//  KIOEventStore.h
+//  KeenClient
+//
+//  Created by Keen Labs on 7/24/17.
+//  Copyright © 2017 Keen Labs. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "KIOEventBatch.h"
+
+/**
+ Storage for events waiting to be uploaded. KeenClient adds events to it and KIOUploader claims
+ them a page at a time, then acknowledges the ones the server accepted by deleting them.
+ KIODBStore keeps events in SQLite, KIOSegmentedLogStore in an append-only log.
+ */
+@protocol KIOEventStore <NSObject>
+
+/**
+ The most events kept in each collection of a project. Adding an event to a full collection evicts
+ that collection's oldest events. 0 means no cap.
+ */
+@property (nonatomic) NSUInteger maxEventsPerCollection;
+
+/**
+ How many events are evicted from a full collection at once. At least enough events are evicted to
+ make room.
+ */
+@property (nonatomic) NSUInteger eventsToEvictPerCollection;
+
+/**
+ Set the collection cap and eviction batch for one project, overriding maxEventsPerCollection and
+ eventsToEvictPerCollection for its collections. Clients of different projects can share a store,
+ so each client sets its caps for its own project.
+
+ @param maxEvents The most events kept in each collection of the project. 0 means no cap.
+ @param eventsToEvict How many events are evicted from a full collection of the project at once.
+ @param projectID The project.
+ */
+- (void)setMaxEventsPerCollection:(NSUInteger)maxEvents
+                    eventsToEvict:(NSUInteger)eventsToEvict
+                     forProjectID:(NSString *)projectID;
+
+/**
+ The most bytes of event data kept for each project. Adding an event that would go over evicts the
+ project's oldest events first. 0 means no budget.
+ */
+@property (nonatomic) NSUInteger maxBytesPerProject;
+
+/**
+ The most bytes of event data kept across every project. Adding an event that would go over evicts
+ the oldest events in the store first. 0 means no budget. Events larger than either budget on their
+ own aren't added.
+ */
+@property (nonatomic) NSUInteger maxTotalBytes;
+
+/**
+ Add an event to the store.
+
+ @param eventData Your event data.
+ @param eventCollection Your event collection.
+ @param projectID Project ID to add the event to.
+ @return Whether the event was stored.
+ */
+- (BOOL)addEvent:(NSData *)eventData collection:(NSString *)eventCollection projectID:(NSString *)projectID;
+
+/**
+ Add an event to the store without waiting for it to be written.
+
+ @param eventData Your event data.
+ @param eventCollection Your event collection.
+ @param projectID Project ID to add the event to.
+ @param completionQueue The queue the completion handler is called on. Pass nil for the main queue.
+ @param completionHandler Called with whether the event was stored, once it has been written or
+                          dropped. May be nil.
+ */
+- (void)addEvent:(NSData *)eventData
+           collection:(NSString *)eventCollection
+            projectID:(NSString *)projectID
+      completionQueue:(dispatch_queue_t)completionQueue
+    completionHandler:(void (^)(BOOL stored))completionHandler;
+
+/**
+ Claim one page of events for upload under a lease. Claimed events aren't claimed again until
+ the lease is released or expires.
+
+ @param maxAttempts Only events with fewer attempts than this are claimed. Other events are left in the store.
+ @param projectID Project ID to claim events from.
+ @param afterEventID Only events with a greater id are claimed. Pass nil to start from the oldest event.
+ @param maxEvents The most events to claim, oldest first. 0 means no limit.
+ @param maxBytes The most event data to claim, in bytes. At least one event is claimed
+                 even if it is larger than this. 0 means no limit.
+ @param leaseDuration How long, in seconds, the events are held.
+ @param leaseID Set to the id of the new lease, or nil if nothing was claimed.
+ @param lastEventID Set to the id of the last event claimed, or nil if nothing was claimed.
+                    Pass it as afterEventID to claim the next page.
+ @return The claimed events, which is empty if nothing was claimed.
+ */
+- (KIOEventBatch *)claimEventBatchWithMaxAttempts:(int)maxAttempts
+                                        projectID:(NSString *)projectID
+                                     afterEventID:(NSNumber *)afterEventID
+                                        maxEvents:(NSUInteger)maxEvents
+                                         maxBytes:(NSUInteger)maxBytes
+                                    leaseDuration:(NSTimeInterval)leaseDuration
+                                          leaseID:(NSNumber **)leaseID
+                                      lastEventID:(NSNumber **)lastEventID;
+
+/**
+ Release a lease taken by a claim, making any of its events that are still in the store
+ available to be claimed again.
+
+ @param leaseID The lease id returned by the claim.
+ */
+- (void)releaseLease:(NSNumber *)leaseID;
+
+/**
+ Acknowledge a set of events, removing them from the store.
+
+ @param eventIds The ids of the events to delete.
+ */
+- (void)deleteEvents:(NSArray<NSNumber *> *)eventIds;
+
+/**
+ Count an upload attempt against each of a set of events.
+
+ @param eventIds The ids of the events to increment.
+ */
+- (void)incrementUploadAttemptsForEvents:(NSArray<NSNumber *> *)eventIds;
+
+/**
+ Get a count of the events stored for a project.
+
+ @param projectID Your project ID.
+ */
+- (NSUInteger)getTotalEventCountWithProjectID:(NSString *)projectID;
+
+/**
+ Get the bytes of event data stored for a project.
+
+ @param projectID Your project ID.
+ */
+- (unsigned long long)getBytesUsedWithProjectID:(NSString *)projectID;
+
+/**
+ Get the bytes of event data stored across every project.
+ */
+- (unsigned long long)getTotalBytesUsed;
+
+/**
+ Delete all events from the store.
+ */
+- (void)deleteAllEvents;
+
+@end
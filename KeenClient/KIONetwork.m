@@ -252,7 +252,8 @@ typedef NS_ENUM(NSInteger, KeenHTTPMethod) { KeenHTTPMethodUnknown, KeenHTTPMeth
         [self.store findOrUpdateQuery:[query convertQueryToData]
                             queryType:query.queryType
                            collection:[query.propertiesDictionary objectForKey:@"event_collection"]
-                            projectID:projectID];
+                            projectID:projectID
+                             queryTTL:self.queryTTL];
     }
 }
 
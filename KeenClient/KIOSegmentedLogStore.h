@@ -0,0 +1,76 @@
+//
+//  KIOSegmentedLogStore.h
+//  KeenClient
+//
+//  Created by Keen Labs on 7/24/17.
+//  Copyright © 2017 Keen Labs. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "KIOEventStore.h"
+
+/**
+ An event store that appends events to a log instead of a database, for apps that add events
+ faster than SQLite keeps up with.
+
+ The log is split into fixed-size segment files. Each event is written to the end of the newest
+ segment as one length-prefixed, checksummed record, and segments are memory mapped for claims.
+ Deleting an event sets its bit in the segment's acknowledgement bitmap rather than rewriting
+ anything, and a segment's files are removed once every event in it has been acknowledged.
+ Upload attempts are kept alongside each segment, and leases are only held in memory. Events
+ that have used up their upload attempts stay in the log without being claimed, until they're
+ deleted or aged out by a cap or budget.
+
+ Collection caps and byte budgets are kept by acknowledging the oldest events, the same as
+ deleting them, so a log that can't upload still stops growing. maxEventsPerCollection defaults
+ to 0 and eventsToEvictPerCollection to 1. maxBytesPerProject and maxTotalBytes default to
+ kKeenMaxBytesPerProject (20 MB) and kKeenMaxTotalBytes (50 MB), as they do for KIODBStore.
+
+ Claims and evictions keep cursors past the acknowledged events at the front of each segment,
+ project and collection, so they don't rescan events that are already gone.
+
+ An app crash loses nothing that was written. A power loss or OS crash can lose:
+ - events appended to the newest segment since it was started. Segments are synced when they're
+   sealed, because they're full, and when the log is closed.
+ - acknowledgements from caps and budgets, which are never synced on their own. Those events
+   come back until they're evicted again.
+ Acknowledgements from deleteEvents: and upload attempts are synced as they're written, so
+ uploaded events aren't sent again and attempts aren't reset. A record torn by a crash fails its
+ checksum and is dropped when the log is reopened.
+ */
+@interface KIOSegmentedLogStore : NSObject <KIOEventStore>
+
+/**
+ The size of each segment file, in bytes. Events larger than a segment can't be added.
+ */
+@property (nonatomic, readonly) NSUInteger segmentSize;
+
+/**
+ The number of segment files in the log.
+ */
+@property (nonatomic, readonly) NSUInteger segmentCount;
+
+/**
+ The default directory for the log, in the app's Library directory.
+ */
++ (NSString *)defaultDirectory;
+
+/**
+ Open the log in the default directory with 1 MB segments.
+ */
+- (instancetype)init;
+
+/**
+ Open the log in a directory, creating it if needed. Events already in the log are kept.
+
+ @param directory The directory holding the segment files.
+ @param segmentSize The size of new segment files, in bytes.
+ */
+- (instancetype)initWithDirectory:(NSString *)directory segmentSize:(NSUInteger)segmentSize;
+
+/**
+ Unmap and close the log's segments. Called when the store is deallocated.
+ */
+- (void)close;
+
+@end
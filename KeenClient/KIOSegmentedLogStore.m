@@ -0,0 +1,1140 @@
+//
+//  KIOSegmentedLogStore.m
+//  KeenClient
+//
+//  Created by Keen Labs on 7/24/17.
+//  Copyright © 2017 Keen Labs. All rights reserved.
+//
+
+#import "KeenClient.h"
+#import "KIOSegmentedLogStore.h"
+#import "KeenConstants.h"
+
+#import <fcntl.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <unistd.h>
+#import <zlib.h>
+
+// The size of new segments when none is given.
+static const NSUInteger kKIODefaultSegmentSize = 1024 * 1024;
+
+// Records start on 8 byte boundaries.
+static const size_t kKIORecordAlignment = 8;
+
+// The header in front of every record. It's followed by the project id, the collection and a
+// NUL, then the event data, padded out to the record alignment. A record length of 0 marks the
+// end of the segment's records.
+typedef struct {
+    // The length of the whole record, including this header and the padding.
+    uint32_t recordLength;
+    // A CRC-32 of the lengths below and everything after the header.
+    uint32_t checksum;
+    uint32_t eventLength;
+    uint16_t projectIDLength;
+    uint16_t collectionLength;
+} KIOLogRecordHeader;
+
+// Segments are at most UINT32_MAX bytes, and every record holds at least a header and a NUL.
+static const int64_t kKIOMaxRecordsPerSegment =
+    UINT32_MAX / ((sizeof(KIOLogRecordHeader) + 1 + kKIORecordAlignment - 1) & ~(kKIORecordAlignment - 1));
+
+// What became of loading a segment file.
+typedef NS_ENUM(NSInteger, KIOLogSegmentLoadResult) {
+    KIOLogSegmentLoaded,
+    // The file couldn't be read right now, for instance before the device is first unlocked.
+    KIOLogSegmentUnreadable,
+    // The file isn't a segment, and never will be.
+    KIOLogSegmentInvalid,
+};
+
+static uint32_t KIOLogRecordChecksum(const KIOLogRecordHeader *header, const uint8_t *body, size_t bodyLength) {
+    uLong checksum = crc32(0L, (const Bytef *)&header->eventLength, 8);
+    return (uint32_t)crc32(checksum, body, (uInt)bodyLength);
+}
+
+// One segment file of the log, mapped into memory, and what's known about its records.
+@interface KIOLogSegment : NSObject
+
+// The id of the segment's first record. Record i has id firstID + i.
+@property (nonatomic, readonly) int64_t firstID;
+
+@property (nonatomic, readonly) NSString *path;
+
+// The size of the file and its mapping.
+@property (nonatomic, readonly) size_t capacity;
+
+// Where the next record will be written.
+@property (nonatomic) size_t length;
+
+// The offset of each record, as uint32_t.
+@property (nonatomic, readonly) NSMutableData *offsets;
+
+// A bit per record, set once the record has been acknowledged.
+@property (nonatomic, readonly) NSMutableData *acks;
+
+// The upload attempts of each record, as uint8_t.
+@property (nonatomic, readonly) NSMutableData *attempts;
+
+// When each record's lease expires, as NSTimeInterval. Leases don't outlive the store.
+@property (nonatomic, readonly) NSMutableData *leaseExpiry;
+
+@property (nonatomic) NSUInteger ackedCount;
+
+// The index of the oldest record that hasn't been acknowledged, or recordCount once they all have.
+@property (nonatomic) NSUInteger firstUnackedIndex;
+
+// Open for writing while this is the segment being appended to, otherwise -1.
+@property (nonatomic) int fd;
+
+@property (nonatomic, readonly) const uint8_t *map;
+
+@end
+
+@implementation KIOLogSegment
+
+- (instancetype)initWithPath:(NSString *)path firstID:(int64_t)firstID {
+    self = [super init];
+
+    if (self) {
+        _path = path;
+        _firstID = firstID;
+        _fd = -1;
+        _offsets = [NSMutableData data];
+        _acks = [NSMutableData data];
+        _attempts = [NSMutableData data];
+        _leaseExpiry = [NSMutableData data];
+    }
+    return self;
+}
+
+- (NSString *)acksPath {
+    return [[self.path stringByDeletingPathExtension] stringByAppendingPathExtension:@"ack"];
+}
+
+- (NSString *)attemptsPath {
+    return [[self.path stringByDeletingPathExtension] stringByAppendingPathExtension:@"attempts"];
+}
+
+- (BOOL)mapFileDescriptor:(int)fd capacity:(size_t)capacity {
+    void *map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map) {
+        KCLogError(@"Failed to map log segment %@: %s", self.path, strerror(errno));
+        return NO;
+    }
+    _map = map;
+    _capacity = capacity;
+    return YES;
+}
+
+- (BOOL)create:(size_t)capacity {
+    // Left over from a segment that wasn't removed completely
+    unlink([[self acksPath] fileSystemRepresentation]);
+    unlink([[self attemptsPath] fileSystemRepresentation]);
+
+    int fd = open([self.path fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        KCLogError(@"Failed to create log segment %@: %s", self.path, strerror(errno));
+        return NO;
+    }
+    // The file is zero filled, so an empty segment already ends with a zero record length.
+    if (ftruncate(fd, capacity) != 0 || ![self mapFileDescriptor:fd capacity:capacity]) {
+        KCLogError(@"Failed to size log segment %@: %s", self.path, strerror(errno));
+        close(fd);
+        return NO;
+    }
+    self.fd = fd;
+    return YES;
+}
+
+- (KIOLogSegmentLoadResult)load {
+    int fd = open([self.path fileSystemRepresentation], O_RDONLY);
+    struct stat fileInfo;
+    if (fd < 0 || fstat(fd, &fileInfo) != 0) {
+        KCLogError(@"Failed to open log segment %@: %s", self.path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return KIOLogSegmentUnreadable;
+    }
+    if (fileInfo.st_size < (off_t)sizeof(KIOLogRecordHeader) || fileInfo.st_size > UINT32_MAX) {
+        KCLogError(@"Log segment %@ has an invalid size of %lld bytes", self.path, (long long)fileInfo.st_size);
+        close(fd);
+        return KIOLogSegmentInvalid;
+    }
+    BOOL wasMapped = [self mapFileDescriptor:fd capacity:(size_t)fileInfo.st_size];
+    close(fd);
+    if (!wasMapped) {
+        return KIOLogSegmentUnreadable;
+    }
+
+    // Find the records, stopping at the end marker or at a record that was torn by a crash
+    size_t offset = 0;
+    while (offset + sizeof(KIOLogRecordHeader) <= self.capacity) {
+        KIOLogRecordHeader header;
+        memcpy(&header, self.map + offset, sizeof(header));
+        if (0 == header.recordLength) {
+            break;
+        }
+        size_t bodyLength = header.projectIDLength + header.collectionLength + 1 + header.eventLength;
+        if (header.recordLength > self.capacity - offset || sizeof(header) + bodyLength > header.recordLength ||
+            KIOLogRecordChecksum(&header, self.map + offset + sizeof(header), bodyLength) != header.checksum) {
+            KCLogWarn(@"Dropping a torn record at offset %zu of log segment %@", offset, self.path);
+            break;
+        }
+        uint32_t recordOffset = (uint32_t)offset;
+        [self.offsets appendBytes:&recordOffset length:sizeof(recordOffset)];
+        offset += header.recordLength;
+    }
+    self.length = offset;
+
+    NSUInteger count = self.recordCount;
+    NSData *acks = [NSData dataWithContentsOfFile:[self acksPath]];
+    if (acks) {
+        [self.acks setData:acks];
+    }
+    self.acks.length = (count + 7) / 8;
+    NSData *attempts = [NSData dataWithContentsOfFile:[self attemptsPath]];
+    if (attempts) {
+        [self.attempts setData:attempts];
+    }
+    self.attempts.length = count;
+    self.leaseExpiry.length = count * sizeof(NSTimeInterval);
+
+    NSUInteger ackedCount = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        if ([self isAcked:i]) {
+            ackedCount++;
+        }
+    }
+    self.ackedCount = ackedCount;
+    while (self.firstUnackedIndex < count && [self isAcked:self.firstUnackedIndex]) {
+        self.firstUnackedIndex++;
+    }
+    return KIOLogSegmentLoaded;
+}
+
+- (BOOL)openForWriting {
+    if (self.fd < 0) {
+        self.fd = open([self.path fileSystemRepresentation], O_RDWR);
+        if (self.fd < 0) {
+            KCLogError(@"Failed to open log segment %@ for writing: %s", self.path, strerror(errno));
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)close {
+    if (self.fd >= 0) {
+        close(self.fd);
+        self.fd = -1;
+    }
+    if (NULL != _map) {
+        munmap((void *)_map, self.capacity);
+        _map = NULL;
+    }
+}
+
+- (void)remove {
+    [self close];
+    unlink([self.path fileSystemRepresentation]);
+    unlink([[self acksPath] fileSystemRepresentation]);
+    unlink([[self attemptsPath] fileSystemRepresentation]);
+}
+
+- (void)dealloc {
+    [self close];
+}
+
+- (NSUInteger)recordCount {
+    return self.offsets.length / sizeof(uint32_t);
+}
+
+- (BOOL)isFinished {
+    return self.ackedCount == self.recordCount;
+}
+
+- (const KIOLogRecordHeader *)headerAtIndex:(NSUInteger)index {
+    return (const KIOLogRecordHeader *)(self.map + ((const uint32_t *)self.offsets.bytes)[index]);
+}
+
+- (BOOL)isAcked:(NSUInteger)index {
+    return (((const uint8_t *)self.acks.bytes)[index / 8] >> (index % 8)) & 1;
+}
+
+- (void)setAcked:(NSUInteger)index {
+    ((uint8_t *)self.acks.mutableBytes)[index / 8] |= 1 << (index % 8);
+    self.ackedCount++;
+    while (self.firstUnackedIndex < self.recordCount && [self isAcked:self.firstUnackedIndex]) {
+        self.firstUnackedIndex++;
+    }
+}
+
+// Where a scan for unacknowledged records from an event id starts in this segment.
+- (NSUInteger)scanIndexFromEventID:(int64_t)eventID {
+    NSUInteger index = eventID > self.firstID ? (NSUInteger)MIN(eventID - self.firstID, (int64_t)self.recordCount) : 0;
+    return MAX(index, self.firstUnackedIndex);
+}
+
+- (void)writeSidecar:(NSString *)path data:(NSData *)data range:(NSRange)range sync:(BOOL)sync {
+    int fd = open([path fileSystemRepresentation], O_WRONLY | O_CREAT, 0644);
+    const uint8_t *bytes = (const uint8_t *)data.bytes + range.location;
+    if (fd < 0 || pwrite(fd, bytes, range.length, range.location) != (ssize_t)range.length) {
+        KCLogError(@"Failed to write %@: %s", path, strerror(errno));
+    } else if (sync && fsync(fd) != 0) {
+        KCLogError(@"Failed to sync %@: %s", path, strerror(errno));
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+- (void)writeAcksInRange:(NSRange)range sync:(BOOL)sync {
+    [self writeSidecar:[self acksPath] data:self.acks range:range sync:sync];
+}
+
+- (void)writeAttemptsInRange:(NSRange)range {
+    [self writeSidecar:[self attemptsPath] data:self.attempts range:range sync:YES];
+}
+
+// Flushes the records and sidecars to disk, once the segment is sealed or the log is closed.
+- (void)sync {
+    if (self.fd >= 0 && fsync(self.fd) != 0) {
+        KCLogError(@"Failed to sync log segment %@: %s", self.path, strerror(errno));
+    }
+    for (NSString *path in @[[self acksPath], [self attemptsPath]]) {
+        // A sidecar that was never written doesn't exist.
+        int fd = open([path fileSystemRepresentation], O_WRONLY);
+        if (fd < 0) {
+            continue;
+        }
+        if (fsync(fd) != 0) {
+            KCLogError(@"Failed to sync %@: %s", path, strerror(errno));
+        }
+        close(fd);
+    }
+}
+
+@end
+
+@implementation KIOSegmentedLogStore {
+    NSString *directory;
+
+    // Every operation on the log runs on this queue.
+    dispatch_queue_t logQueue;
+
+    // Oldest first. Segments that have been removed leave gaps in the ids.
+    NSMutableArray<KIOLogSegment *> *segments;
+
+    int64_t nextEventID;
+
+    long long lastLeaseID;
+
+    // Lease ids to the ids of the events they hold.
+    NSMutableDictionary<NSNumber *, NSArray<NSNumber *> *> *leases;
+
+    // Project ids to the number of events and the bytes of event data they have in the log.
+    NSMutableDictionary<NSString *, NSNumber *> *projectEventCounts;
+    NSMutableDictionary<NSString *, NSNumber *> *projectBytesUsed;
+    unsigned long long totalBytesUsed;
+
+    // Project ids to the number of events each of their collections has in the log.
+    NSMutableDictionary<NSString *, NSMutableDictionary<NSString *, NSNumber *> *> *collectionEventCounts;
+
+    // Lower bounds on the id of the oldest unacknowledged event of each project, and of each of their
+    // collections, so claims and evictions start past the acknowledged events in front of them. A
+    // missing cursor is 0.
+    NSMutableDictionary<NSString *, NSNumber *> *projectCursors;
+    NSMutableDictionary<NSString *, NSMutableDictionary<NSString *, NSNumber *> *> *collectionCursors;
+
+    // Project ids to the collection caps and eviction batches set for them, overriding
+    // maxEventsPerCollection and eventsToEvictPerCollection.
+    NSMutableDictionary<NSString *, NSNumber *> *projectCollectionCaps;
+    NSMutableDictionary<NSString *, NSNumber *> *projectEvictionBatches;
+
+    // Reused to build each record before it's written.
+    NSMutableData *recordBuffer;
+}
+
+@synthesize maxEventsPerCollection = _maxEventsPerCollection;
+@synthesize eventsToEvictPerCollection = _eventsToEvictPerCollection;
+@synthesize maxBytesPerProject = _maxBytesPerProject;
+@synthesize maxTotalBytes = _maxTotalBytes;
+
++ (NSString *)defaultDirectory {
+    NSString *libraryPath =
+        [NSSearchPathForDirectoriesInDomains(NSLibraryDirectory, NSUserDomainMask, YES) objectAtIndex:0];
+    return [libraryPath stringByAppendingPathComponent:@"keenEvents.log"];
+}
+
+- (instancetype)init {
+    return [self initWithDirectory:[self.class defaultDirectory] segmentSize:kKIODefaultSegmentSize];
+}
+
+- (instancetype)initWithDirectory:(NSString *)logDirectory segmentSize:(NSUInteger)segmentSize {
+    self = [super init];
+
+    if (self) {
+        directory = [logDirectory copy];
+        _segmentSize = MIN(MAX(segmentSize, 4096), UINT32_MAX);
+        logQueue = dispatch_queue_create("io.keen.log", DISPATCH_QUEUE_SERIAL);
+        segments = [NSMutableArray array];
+        leases = [NSMutableDictionary dictionary];
+        projectEventCounts = [NSMutableDictionary dictionary];
+        projectBytesUsed = [NSMutableDictionary dictionary];
+        collectionEventCounts = [NSMutableDictionary dictionary];
+        projectCursors = [NSMutableDictionary dictionary];
+        collectionCursors = [NSMutableDictionary dictionary];
+        projectCollectionCaps = [NSMutableDictionary dictionary];
+        projectEvictionBatches = [NSMutableDictionary dictionary];
+        recordBuffer = [NSMutableData data];
+        nextEventID = 1;
+        _eventsToEvictPerCollection = 1;
+        _maxBytesPerProject = kKeenMaxBytesPerProject;
+        _maxTotalBytes = kKeenMaxTotalBytes;
+
+        NSError *error;
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:directory
+                                       withIntermediateDirectories:YES
+                                                        attributes:nil
+                                                             error:&error]) {
+            KCLogError(@"Failed to create log directory %@: %@", directory, [error localizedDescription]);
+        }
+        [self loadSegments];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    // Blocks on the logQueue hold on to the store, so the last release can happen on the logQueue
+    // itself, where syncing onto it would deadlock. Nothing else can reach the segments by now.
+    [self closeSegments];
+}
+
+- (void)close {
+    dispatch_sync(logQueue, ^{
+        [self closeSegments];
+    });
+}
+
+// Called on the logQueue, or from dealloc.
+- (void)closeSegments {
+    for (KIOLogSegment *segment in segments) {
+        // Only the segment being appended to has anything that hasn't been synced.
+        if (segment.fd >= 0) {
+            [segment sync];
+        }
+        [segment close];
+    }
+    [segments removeAllObjects];
+}
+
+- (NSUInteger)segmentCount {
+    __block NSUInteger count = 0;
+    dispatch_sync(logQueue, ^{
+        count = segments.count;
+    });
+    return count;
+}
+
+#pragma mark Segment Methods
+
+- (NSString *)pathForSegmentWithFirstID:(int64_t)firstID {
+    // Zero padded, so the segments sort by name in the order they were written
+    return [directory stringByAppendingPathComponent:[NSString stringWithFormat:@"%020lld.log", firstID]];
+}
+
+- (void)loadSegments {
+    int64_t lastSkippedFirstID = 0;
+    NSArray *fileNames = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:directory error:nil];
+    for (NSString *fileName in [fileNames sortedArrayUsingSelector:@selector(compare:)]) {
+        if (![[fileName pathExtension] isEqualToString:@"log"]) {
+            continue;
+        }
+
+        int64_t firstID = [[fileName stringByDeletingPathExtension] longLongValue];
+        KIOLogSegment *segment =
+            [[KIOLogSegment alloc] initWithPath:[directory stringByAppendingPathComponent:fileName] firstID:firstID];
+        KIOLogSegmentLoadResult result = firstID < nextEventID ? KIOLogSegmentInvalid : [segment load];
+        if (KIOLogSegmentUnreadable == result) {
+            // Its events are still on disk, so leave it for the next time the log is opened.
+            KCLogWarn(@"Skipping log segment %@ until it can be read", fileName);
+            lastSkippedFirstID = firstID;
+            continue;
+        }
+        if (KIOLogSegmentInvalid == result) {
+            KCLogError(@"Removing invalid log segment %@", fileName);
+            [segment remove];
+            continue;
+        }
+
+        NSUInteger count = segment.recordCount;
+        for (NSUInteger i = 0; i < count; i++) {
+            if (![segment isAcked:i]) {
+                [self adjustCountsForHeader:[segment headerAtIndex:i] by:1];
+            }
+        }
+        [segments addObject:segment];
+        nextEventID = firstID + count;
+    }
+
+    // New segments mustn't reuse the ids of a skipped segment that comes after every loaded one.
+    if (lastSkippedFirstID >= nextEventID) {
+        nextEventID = lastSkippedFirstID + kKIOMaxRecordsPerSegment;
+    }
+
+    [self removeFinishedSegments];
+}
+
+// Called on the logQueue. Finds the segment that holds an event, or nil if it's gone.
+- (KIOLogSegment *)segmentForEventID:(int64_t)eventID index:(NSUInteger *)index {
+    NSUInteger segmentIndex = [self indexOfSegmentForEventID:eventID];
+    if (NSNotFound == segmentIndex) {
+        return nil;
+    }
+    KIOLogSegment *segment = segments[segmentIndex];
+    if (eventID >= segment.firstID + (int64_t)segment.recordCount) {
+        return nil;
+    }
+    *index = (NSUInteger)(eventID - segment.firstID);
+    return segment;
+}
+
+// Called on the logQueue. The index of the last segment starting at or before an event id.
+- (NSUInteger)indexOfSegmentForEventID:(int64_t)eventID {
+    NSUInteger low = 0;
+    NSUInteger high = segments.count;
+    while (low < high) {
+        NSUInteger middle = low + (high - low) / 2;
+        if (segments[middle].firstID <= eventID) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return 0 == low ? NSNotFound : low - 1;
+}
+
+// Called on the logQueue. Returns the segment to append a record to, starting a new one if
+// the newest one doesn't have room.
+- (KIOLogSegment *)segmentWithRoomForRecord:(size_t)recordLength {
+    KIOLogSegment *segment = segments.lastObject;
+    if (nil != segment && segment.length + recordLength <= segment.capacity) {
+        return [segment openForWriting] ? segment : nil;
+    }
+
+    // Done with the newest segment, it's only read from now on
+    if (nil != segment) {
+        if ([segment isFinished]) {
+            [segment remove];
+            [segments removeLastObject];
+        } else {
+            // Sealed, so its records and the acknowledgements so far are synced.
+            [segment sync];
+            if (segment.fd >= 0) {
+                close(segment.fd);
+                segment.fd = -1;
+            }
+        }
+    }
+
+    segment = [[KIOLogSegment alloc] initWithPath:[self pathForSegmentWithFirstID:nextEventID] firstID:nextEventID];
+    if (![segment create:self.segmentSize]) {
+        [segment remove];
+        return nil;
+    }
+    [segments addObject:segment];
+    return segment;
+}
+
+// Called on the logQueue. Removes every segment whose events have all been acknowledged, other
+// than the one being appended to.
+- (void)removeFinishedSegments {
+    for (NSInteger i = (NSInteger)segments.count - 2; i >= 0; i--) {
+        if ([segments[i] isFinished]) {
+            [segments[i] remove];
+            [segments removeObjectAtIndex:i];
+        }
+    }
+}
+
+#pragma mark Count Methods
+
+// Called on the logQueue. Adds or removes a record from the counts of its project and collection.
+- (void)adjustCountsForHeader:(const KIOLogRecordHeader *)header by:(int)direction {
+    NSString *projectID = [self projectIDOfHeader:header];
+    NSString *collection = [self collectionOfHeader:header];
+    [self adjustCountsForProjectID:projectID
+                        collection:collection
+                            events:direction
+                             bytes:direction * (long long)header->eventLength];
+}
+
+- (NSString *)projectIDOfHeader:(const KIOLogRecordHeader *)header {
+    return [[NSString alloc] initWithBytes:header + 1 length:header->projectIDLength encoding:NSUTF8StringEncoding];
+}
+
+- (NSString *)collectionOfHeader:(const KIOLogRecordHeader *)header {
+    return [[NSString alloc] initWithBytes:(const uint8_t *)(header + 1) + header->projectIDLength
+                                    length:header->collectionLength
+                                  encoding:NSUTF8StringEncoding];
+}
+
+- (void)adjustCountsForProjectID:(NSString *)projectID
+                      collection:(NSString *)collection
+                          events:(long long)events
+                           bytes:(long long)bytes {
+    if (nil == projectID) {
+        return;
+    }
+    if (nil != collection) {
+        NSMutableDictionary<NSString *, NSNumber *> *collectionCounts = collectionEventCounts[projectID];
+        long long collectionCount = [collectionCounts[collection] longLongValue] + events;
+        if (collectionCount > 0) {
+            if (nil == collectionCounts) {
+                collectionCounts = [NSMutableDictionary dictionary];
+                collectionEventCounts[projectID] = collectionCounts;
+            }
+            collectionCounts[collection] = @(collectionCount);
+        } else {
+            [collectionCounts removeObjectForKey:collection];
+            if (0 == collectionCounts.count) {
+                [collectionEventCounts removeObjectForKey:projectID];
+            }
+            // Every event it had is acknowledged, so the next one will be newer than any in the log.
+            [self setCursor:nextEventID forProjectID:projectID collection:collection];
+        }
+    }
+
+    long long count = [projectEventCounts[projectID] longLongValue] + events;
+    long long used = [projectBytesUsed[projectID] longLongValue] + bytes;
+    if (count > 0) {
+        projectEventCounts[projectID] = @(count);
+        projectBytesUsed[projectID] = @(MAX(used, 0));
+    } else {
+        [projectEventCounts removeObjectForKey:projectID];
+        [projectBytesUsed removeObjectForKey:projectID];
+        [self setCursor:nextEventID forProjectID:projectID collection:nil];
+    }
+    totalBytesUsed = (unsigned long long)MAX((long long)totalBytesUsed + bytes, 0);
+}
+
+// Called on the logQueue. The cursor of a project, or of one of its collections.
+- (int64_t)cursorForProjectID:(NSString *)projectID collection:(NSString *)collection {
+    if (nil == projectID) {
+        return 0;
+    }
+    NSNumber *cursor = nil == collection ? projectCursors[projectID] : collectionCursors[projectID][collection];
+    return [cursor longLongValue];
+}
+
+// Called on the logQueue. Only called once every event of the project or collection before the cursor
+// has been acknowledged.
+- (void)setCursor:(int64_t)cursor forProjectID:(NSString *)projectID collection:(NSString *)collection {
+    if (nil == projectID) {
+        return;
+    }
+    if (nil == collection) {
+        projectCursors[projectID] = @(cursor);
+        return;
+    }
+    NSMutableDictionary<NSString *, NSNumber *> *cursors = collectionCursors[projectID];
+    if (nil == cursors) {
+        cursors = [NSMutableDictionary dictionary];
+        collectionCursors[projectID] = cursors;
+    }
+    cursors[collection] = @(cursor);
+}
+
+- (void)setMaxEventsPerCollection:(NSUInteger)maxEvents
+                    eventsToEvict:(NSUInteger)eventsToEvict
+                     forProjectID:(NSString *)projectID {
+    if (nil == projectID) {
+        return;
+    }
+
+    dispatch_async(logQueue, ^{
+        projectCollectionCaps[projectID] = @(maxEvents);
+        projectEvictionBatches[projectID] = @(eventsToEvict);
+    });
+}
+
+- (NSUInteger)getTotalEventCountWithProjectID:(NSString *)projectID {
+    __block NSUInteger count = 0;
+    dispatch_sync(logQueue, ^{
+        count = [projectEventCounts[projectID] unsignedIntegerValue];
+    });
+    return count;
+}
+
+- (unsigned long long)getBytesUsedWithProjectID:(NSString *)projectID {
+    __block unsigned long long bytesUsed = 0;
+    dispatch_sync(logQueue, ^{
+        bytesUsed = [projectBytesUsed[projectID] unsignedLongLongValue];
+    });
+    return bytesUsed;
+}
+
+- (unsigned long long)getTotalBytesUsed {
+    __block unsigned long long bytesUsed = 0;
+    dispatch_sync(logQueue, ^{
+        bytesUsed = totalBytesUsed;
+    });
+    return bytesUsed;
+}
+
+#pragma mark Event Methods
+
+- (BOOL)addEvent:(NSData *)eventData collection:(NSString *)eventCollection projectID:(NSString *)projectID {
+    KIOLogRecordHeader header;
+    if (![self recordHeader:&header forEvent:eventData collection:eventCollection projectID:projectID]) {
+        return NO;
+    }
+
+    __block BOOL wasAdded = NO;
+    dispatch_sync(logQueue, ^{
+        wasAdded = [self appendRecordWithHeader:header event:eventData collection:eventCollection projectID:projectID];
+    });
+    return wasAdded;
+}
+
+- (void)addEvent:(NSData *)eventData
+           collection:(NSString *)eventCollection
+            projectID:(NSString *)projectID
+      completionQueue:(dispatch_queue_t)completionQueue
+    completionHandler:(void (^)(BOOL stored))completionHandler {
+    // The caller is free to change these once this returns.
+    eventData = [eventData copy];
+    eventCollection = [eventCollection copy];
+    projectID = [projectID copy];
+    completionQueue = completionQueue ?: dispatch_get_main_queue();
+
+    KIOLogRecordHeader header;
+    if (![self recordHeader:&header forEvent:eventData collection:eventCollection projectID:projectID]) {
+        if (completionHandler) {
+            dispatch_async(completionQueue, ^{
+                completionHandler(NO);
+            });
+        }
+        return;
+    }
+
+    dispatch_async(logQueue, ^{
+        BOOL wasAdded =
+            [self appendRecordWithHeader:header event:eventData collection:eventCollection projectID:projectID];
+        if (completionHandler) {
+            dispatch_async(completionQueue, ^{
+                completionHandler(wasAdded);
+            });
+        }
+    });
+}
+
+// Fills in the lengths of the record for an event, or returns NO if it can't be added.
+- (BOOL)recordHeader:(KIOLogRecordHeader *)header
+            forEvent:(NSData *)eventData
+          collection:(NSString *)eventCollection
+           projectID:(NSString *)projectID {
+    const char *projectIDBytes = [projectID UTF8String];
+    const char *collectionBytes = [eventCollection UTF8String];
+    if (NULL == projectIDBytes || NULL == collectionBytes) {
+        KCLogError(@"Can't add an event without a project id and collection");
+        return NO;
+    }
+
+    size_t projectIDLength = strlen(projectIDBytes);
+    size_t collectionLength = strlen(collectionBytes);
+    size_t bodyLength = projectIDLength + collectionLength + 1 + eventData.length;
+    size_t recordLength = (sizeof(*header) + bodyLength + kKIORecordAlignment - 1) & ~(kKIORecordAlignment - 1);
+    if (projectIDLength > UINT16_MAX || collectionLength > UINT16_MAX || recordLength > self.segmentSize) {
+        KCLogError(@"Event of %lu bytes is too large for a log segment of %lu bytes",
+                   (unsigned long)eventData.length,
+                   (unsigned long)self.segmentSize);
+        return NO;
+    }
+
+    memset(header, 0, sizeof(*header));
+    header->recordLength = (uint32_t)recordLength;
+    header->eventLength = (uint32_t)eventData.length;
+    header->projectIDLength = (uint16_t)projectIDLength;
+    header->collectionLength = (uint16_t)collectionLength;
+    return YES;
+}
+
+// Called on the logQueue. Appends an event's record to the log.
+- (BOOL)appendRecordWithHeader:(KIOLogRecordHeader)header
+                         event:(NSData *)eventData
+                    collection:(NSString *)eventCollection
+                     projectID:(NSString *)projectID {
+    size_t recordLength = header.recordLength;
+    size_t projectIDLength = header.projectIDLength;
+    size_t collectionLength = header.collectionLength;
+    size_t bodyLength = projectIDLength + collectionLength + 1 + eventData.length;
+
+    if (![self makeRoomForEventOfLength:eventData.length collection:eventCollection projectID:projectID]) {
+        return NO;
+    }
+
+    KIOLogSegment *segment = [self segmentWithRoomForRecord:recordLength];
+    if (nil == segment) {
+        return NO;
+    }
+
+    // Build the record, followed by an end marker if the segment has room for one
+    size_t terminatorLength = MIN(sizeof(uint32_t), segment.capacity - segment.length - recordLength);
+    recordBuffer.length = recordLength + terminatorLength;
+    uint8_t *record = recordBuffer.mutableBytes;
+    uint8_t *body = record + sizeof(header);
+    memcpy(body, [projectID UTF8String], projectIDLength);
+    memcpy(body + projectIDLength, [eventCollection UTF8String], collectionLength + 1);
+    memcpy(body + projectIDLength + collectionLength + 1, eventData.bytes, eventData.length);
+    memset(body + bodyLength, 0, recordBuffer.length - sizeof(header) - bodyLength);
+
+    header.checksum = KIOLogRecordChecksum(&header, body, bodyLength);
+    memcpy(record, &header, sizeof(header));
+
+    if (pwrite(segment.fd, record, recordBuffer.length, segment.length) != (ssize_t)recordBuffer.length) {
+        KCLogError(@"Failed to append to log segment %@: %s", segment.path, strerror(errno));
+        return NO;
+    }
+
+    uint32_t offset = (uint32_t)segment.length;
+    [segment.offsets appendBytes:&offset length:sizeof(offset)];
+    NSUInteger count = segment.recordCount;
+    segment.acks.length = (count + 7) / 8;
+    segment.attempts.length = count;
+    segment.leaseExpiry.length = count * sizeof(NSTimeInterval);
+    segment.length += recordLength;
+    nextEventID++;
+
+    [self adjustCountsForProjectID:projectID collection:eventCollection events:1 bytes:eventData.length];
+    return YES;
+}
+
+// Called on the logQueue before an event is appended. Evicts the oldest events of its collection if
+// the collection is full, then the oldest events of its project and of the whole log until it fits the
+// byte budgets. Returns NO if the event is bigger than a budget on its own.
+- (BOOL)makeRoomForEventOfLength:(NSUInteger)eventLength
+                      collection:(NSString *)eventCollection
+                       projectID:(NSString *)projectID {
+    NSUInteger maxBytesPerProject = self.maxBytesPerProject;
+    NSUInteger maxTotalBytes = self.maxTotalBytes;
+    NSUInteger maxBytes = MIN(maxBytesPerProject ?: NSUIntegerMax, maxTotalBytes ?: NSUIntegerMax);
+    if (eventLength > maxBytes) {
+        KCLogError(@"Event of %lu bytes is larger than the storage budget of %lu bytes, dropping it.",
+                   (unsigned long)eventLength,
+                   (unsigned long)maxBytes);
+        return NO;
+    }
+
+    NSNumber *projectCap = projectID ? projectCollectionCaps[projectID] : nil;
+    NSUInteger maxEvents = projectCap ? projectCap.unsignedIntegerValue : self.maxEventsPerCollection;
+    NSUInteger eventCount = [collectionEventCounts[projectID][eventCollection] unsignedIntegerValue];
+    if (maxEvents > 0 && eventCount + 1 > maxEvents) {
+        // Evict a batch at a time so a full collection doesn't evict on every add.
+        NSNumber *projectBatch = projectID ? projectEvictionBatches[projectID] : nil;
+        NSUInteger evictionBatch = projectBatch ? projectBatch.unsignedIntegerValue : self.eventsToEvictPerCollection;
+        NSUInteger eventsToEvict = MAX(eventCount + 1 - maxEvents, MIN(evictionBatch, eventCount));
+        KCLogWarn(@"Too many events in cache for %@, aging out %lu old events.",
+                  eventCollection,
+                  (unsigned long)eventsToEvict);
+        [self evictOldestEventsOfProjectID:projectID collection:eventCollection events:eventsToEvict bytes:0];
+    }
+
+    if (maxBytesPerProject > 0) {
+        long long bytesToFree =
+            [projectBytesUsed[projectID] longLongValue] + (long long)eventLength - (long long)maxBytesPerProject;
+        if (bytesToFree > 0) {
+            KCLogWarn(@"Storage budget for project %@ exceeded, aging out old events.", projectID);
+            [self evictOldestEventsOfProjectID:projectID collection:nil events:0 bytes:bytesToFree];
+        }
+    }
+
+    if (maxTotalBytes > 0) {
+        long long bytesToFree = (long long)totalBytesUsed + (long long)eventLength - (long long)maxTotalBytes;
+        if (bytesToFree > 0) {
+            KCLogWarn(@"Storage budget exceeded, aging out old events.");
+            [self evictOldestEventsOfProjectID:nil collection:nil events:0 bytes:bytesToFree];
+        }
+    }
+
+    return YES;
+}
+
+// Called on the logQueue. Acknowledges the oldest events of a project's collection, of a project when
+// collection is nil, or of the whole log when projectID is nil too, until at least the given number of
+// events and bytes are gone. Segments left with nothing in them are removed.
+- (void)evictOldestEventsOfProjectID:(NSString *)projectID
+                          collection:(NSString *)eventCollection
+                              events:(NSUInteger)events
+                               bytes:(long long)bytes {
+    const char *projectIDBytes = [projectID UTF8String];
+    size_t projectIDLength = NULL == projectIDBytes ? 0 : strlen(projectIDBytes);
+    const char *collectionBytes = [eventCollection UTF8String];
+    size_t collectionLength = NULL == collectionBytes ? 0 : strlen(collectionBytes);
+    NSUInteger evictedEvents = 0;
+    long long evictedBytes = 0;
+
+    // Start where the last eviction of the same events left off. Everything of theirs it passes is
+    // evicted, so it ends up just past the last one, or past the whole log if none are left.
+    int64_t startID = [self cursorForProjectID:projectID collection:eventCollection];
+    int64_t cursor = nextEventID;
+    NSUInteger firstSegment = [self indexOfSegmentForEventID:startID];
+    BOOL isDone = NO;
+
+    for (NSUInteger s = NSNotFound == firstSegment ? 0 : firstSegment; s < segments.count && !isDone; s++) {
+        KIOLogSegment *segment = segments[s];
+        NSUInteger count = segment.recordCount;
+        NSMutableIndexSet *evicted = [NSMutableIndexSet indexSet];
+        for (NSUInteger i = [segment scanIndexFromEventID:startID]; i < count; i++) {
+            if (evictedEvents >= events && evictedBytes >= bytes) {
+                isDone = YES;
+                cursor = segment.firstID + (int64_t)i;
+                break;
+            }
+            if ([segment isAcked:i]) {
+                continue;
+            }
+            const KIOLogRecordHeader *header = [segment headerAtIndex:i];
+            const uint8_t *body = (const uint8_t *)(header + 1);
+            if (NULL != projectIDBytes &&
+                (header->projectIDLength != projectIDLength || memcmp(body, projectIDBytes, projectIDLength) != 0)) {
+                continue;
+            }
+            const uint8_t *collection = body + header->projectIDLength;
+            if (NULL != collectionBytes && (header->collectionLength != collectionLength ||
+                                            memcmp(collection, collectionBytes, collectionLength) != 0)) {
+                continue;
+            }
+            [evicted addIndex:i];
+            evictedEvents++;
+            evictedBytes += header->eventLength;
+        }
+        if (evicted.count > 0) {
+            // Evicted events coming back after a crash are just evicted again.
+            [self acknowledgeIndexes:evicted inSegment:segment sync:NO];
+        }
+    }
+    [self setCursor:cursor forProjectID:projectID collection:eventCollection];
+    [self removeFinishedSegments];
+}
+
+- (KIOEventBatch *)claimEventBatchWithMaxAttempts:(int)maxAttempts
+                                        projectID:(NSString *)projectID
+                                     afterEventID:(NSNumber *)afterEventID
+                                        maxEvents:(NSUInteger)maxEvents
+                                         maxBytes:(NSUInteger)maxBytes
+                                    leaseDuration:(NSTimeInterval)leaseDuration
+                                          leaseID:(NSNumber **)leaseID
+                                      lastEventID:(NSNumber **)lastEventID {
+    KIOEventBatch *batch = [[KIOEventBatch alloc] initWithEventCapacity:MIN(maxEvents, 1024)
+                                                           byteCapacity:MIN(maxBytes, 1024 * 1024)];
+    const char *projectIDBytes = [projectID UTF8String];
+    if (NULL == projectIDBytes) {
+        return batch;
+    }
+    size_t projectIDLength = strlen(projectIDBytes);
+    int64_t firstEventID = afterEventID ? [afterEventID longLongValue] + 1 : 0;
+
+    __block NSNumber *newLeaseID = nil;
+    __block NSNumber *newLastEventID = nil;
+    dispatch_sync(logQueue, ^{
+        NSTimeInterval now = [[NSDate date] timeIntervalSince1970];
+        NSMutableArray *claimedIDs = [NSMutableArray array];
+        NSUInteger claimedBytes = 0;
+        BOOL isFull = NO;
+
+        // Skip the project's acknowledged events. A scan from its cursor moves the cursor up to the
+        // project's oldest event that's still in the log.
+        int64_t projectCursor = [self cursorForProjectID:projectID collection:nil];
+        int64_t startID = MAX(firstEventID, projectCursor);
+        BOOL movesCursor = firstEventID <= projectCursor;
+        int64_t oldestEventID = -1;
+
+        NSUInteger firstSegment = [self indexOfSegmentForEventID:startID];
+        for (NSUInteger s = NSNotFound == firstSegment ? 0 : firstSegment; s < segments.count && !isFull; s++) {
+            KIOLogSegment *segment = segments[s];
+            NSUInteger count = segment.recordCount;
+            const uint8_t *attempts = segment.attempts.bytes;
+            NSTimeInterval *leaseExpiry = segment.leaseExpiry.mutableBytes;
+
+            for (NSUInteger i = [segment scanIndexFromEventID:startID]; i < count; i++) {
+                if ([segment isAcked:i]) {
+                    continue;
+                }
+                const KIOLogRecordHeader *header = [segment headerAtIndex:i];
+                const uint8_t *body = (const uint8_t *)header + sizeof(KIOLogRecordHeader);
+                if (header->projectIDLength != projectIDLength || memcmp(body, projectIDBytes, projectIDLength) != 0) {
+                    continue;
+                }
+                if (oldestEventID < 0) {
+                    oldestEventID = segment.firstID + (int64_t)i;
+                }
+                if (leaseExpiry[i] > now) {
+                    continue;
+                }
+                if (attempts[i] >= maxAttempts) {
+                    // Out of attempts, so it stays in the log without being claimed, as it does in KIODBStore.
+                    continue;
+                }
+                if ((maxEvents > 0 && batch.count >= maxEvents) ||
+                    (maxBytes > 0 && batch.count > 0 && claimedBytes + header->eventLength > maxBytes)) {
+                    isFull = YES;
+                    break;
+                }
+
+                const char *collection = (const char *)body + header->projectIDLength;
+                int64_t eventID = segment.firstID + (int64_t)i;
+                [batch appendEventID:eventID
+                          collection:collection
+                               bytes:(const uint8_t *)collection + header->collectionLength + 1
+                              length:header->eventLength];
+                leaseExpiry[i] = now + leaseDuration;
+                claimedBytes += header->eventLength;
+                [claimedIDs addObject:@(eventID)];
+            }
+        }
+
+        if (movesCursor) {
+            [self setCursor:oldestEventID < 0 ? nextEventID : oldestEventID forProjectID:projectID collection:nil];
+        }
+
+        if (claimedIDs.count > 0) {
+            newLeaseID = @(++lastLeaseID);
+            newLastEventID = claimedIDs.lastObject;
+            leases[newLeaseID] = claimedIDs;
+        }
+    });
+
+    if (leaseID) {
+        *leaseID = newLeaseID;
+    }
+    if (lastEventID) {
+        *lastEventID = newLastEventID;
+    }
+    return batch;
+}
+
+- (void)releaseLease:(NSNumber *)leaseID {
+    if (nil == leaseID) {
+        return;
+    }
+
+    dispatch_sync(logQueue, ^{
+        for (NSNumber *eventID in leases[leaseID]) {
+            NSUInteger index;
+            KIOLogSegment *segment = [self segmentForEventID:[eventID longLongValue] index:&index];
+            if (nil != segment) {
+                ((NSTimeInterval *)segment.leaseExpiry.mutableBytes)[index] = 0;
+            }
+        }
+        [leases removeObjectForKey:leaseID];
+    });
+}
+
+- (void)deleteEvents:(NSArray<NSNumber *> *)eventIds {
+    dispatch_sync(logQueue, ^{
+        [self forEachSegmentOfEventIDs:eventIds
+                                 block:^(KIOLogSegment *segment, NSIndexSet *indexes) {
+                                     [self acknowledgeIndexes:indexes inSegment:segment sync:YES];
+                                 }];
+        [self removeFinishedSegments];
+    });
+}
+
+- (void)incrementUploadAttemptsForEvents:(NSArray<NSNumber *> *)eventIds {
+    dispatch_sync(logQueue, ^{
+        [self forEachSegmentOfEventIDs:eventIds
+                                 block:^(KIOLogSegment *segment, NSIndexSet *indexes) {
+                                     uint8_t *attempts = segment.attempts.mutableBytes;
+                                     [indexes enumerateIndexesUsingBlock:^(NSUInteger i, BOOL *stop) {
+                                         if (attempts[i] < UINT8_MAX) {
+                                             attempts[i]++;
+                                         }
+                                     }];
+                                     NSUInteger first = indexes.firstIndex;
+                                     [segment writeAttemptsInRange:NSMakeRange(first, indexes.lastIndex - first + 1)];
+                                 }];
+    });
+}
+
+- (void)deleteAllEvents {
+    dispatch_sync(logQueue, ^{
+        for (KIOLogSegment *segment in segments) {
+            [segment remove];
+        }
+        [segments removeAllObjects];
+        [leases removeAllObjects];
+        [projectEventCounts removeAllObjects];
+        [projectBytesUsed removeAllObjects];
+        [collectionEventCounts removeAllObjects];
+        [projectCursors removeAllObjects];
+        [collectionCursors removeAllObjects];
+        totalBytesUsed = 0;
+    });
+}
+
+// Called on the logQueue. Groups event ids by the segment holding them. Ids that are no
+// longer in the log are skipped.
+- (void)forEachSegmentOfEventIDs:(NSArray<NSNumber *> *)eventIds
+                           block:(void (^)(KIOLogSegment *segment, NSIndexSet *indexes))block {
+    NSArray *sortedIDs = [eventIds sortedArrayUsingSelector:@selector(compare:)];
+    KIOLogSegment *currentSegment = nil;
+    NSMutableIndexSet *indexes = [NSMutableIndexSet indexSet];
+    for (NSNumber *eventID in sortedIDs) {
+        NSUInteger index;
+        KIOLogSegment *segment = [self segmentForEventID:[eventID longLongValue] index:&index];
+        if (nil == segment) {
+            continue;
+        }
+        if (segment != currentSegment) {
+            if (indexes.count > 0) {
+                block(currentSegment, indexes);
+            }
+            currentSegment = segment;
+            indexes = [NSMutableIndexSet indexSet];
+        }
+        [indexes addIndex:index];
+    }
+    if (indexes.count > 0) {
+        block(currentSegment, indexes);
+    }
+}
+
+// Called on the logQueue. Marks records as acknowledged, in memory and in the segment's bitmap, syncing
+// the bitmap to disk if asked to.
+- (void)acknowledgeIndexes:(NSIndexSet *)indexes inSegment:(KIOLogSegment *)segment sync:(BOOL)sync {
+    __block NSString *lastProjectID = nil;
+    __block NSString *lastCollection = nil;
+    __block const KIOLogRecordHeader *lastHeader = NULL;
+    __block long long events = 0;
+    __block long long bytes = 0;
+    [indexes enumerateIndexesUsingBlock:^(NSUInteger i, BOOL *stop) {
+        if ([segment isAcked:i]) {
+            return;
+        }
+        [segment setAcked:i];
+
+        // Runs of events from the same project and collection are common, so only look them up when they change
+        const KIOLogRecordHeader *header = [segment headerAtIndex:i];
+        if (NULL == lastHeader || header->projectIDLength != lastHeader->projectIDLength ||
+            header->collectionLength != lastHeader->collectionLength ||
+            memcmp(header + 1, lastHeader + 1, header->projectIDLength + header->collectionLength) != 0) {
+            [self adjustCountsForProjectID:lastProjectID collection:lastCollection events:-events bytes:-bytes];
+            lastProjectID = [self projectIDOfHeader:header];
+            lastCollection = [self collectionOfHeader:header];
+            lastHeader = header;
+            events = 0;
+            bytes = 0;
+        }
+        events++;
+        bytes += header->eventLength;
+    }];
+    [self adjustCountsForProjectID:lastProjectID collection:lastCollection events:-events bytes:-bytes];
+
+    NSUInteger firstByte = indexes.firstIndex / 8;
+    [segment writeAcksInRange:NSMakeRange(firstByte, indexes.lastIndex / 8 - firstByte + 1) sync:sync];
+}
+
+@end
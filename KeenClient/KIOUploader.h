@@ -7,6 +7,7 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "KIOEventStore.h"
 
 @interface KIOUploader : NSObject
 
@@ -15,12 +16,29 @@
  */
 @property int maxEventUploadAttempts;
 
+/**
+ How long, in seconds, events claimed for an upload are held before another upload can
+ claim them. Only matters if an upload never finishes, since finished uploads give their
+ events back right away.
+ */
+@property NSTimeInterval eventLeaseDuration;
+
+/**
+ The most events sent in a single request. Larger backlogs are uploaded over several requests.
+ */
+@property NSUInteger maxEventsPerUpload;
+
+/**
+ The most stored event data, in bytes, sent in a single request.
+ */
+@property NSUInteger maxBytesPerUpload;
+
 // A default shared instance of the object
 + (instancetype)sharedInstance;
 
 // Initialize an instance of the object
 - (instancetype)init NS_UNAVAILABLE;
-- (instancetype)initWithNetwork:(KIONetwork *)network andStore:(KIODBStore *)store;
+- (instancetype)initWithNetwork:(KIONetwork *)network andStore:(id<KIOEventStore>)store;
 
 // Upload events in the store for a given project
 - (void)uploadEventsForConfig:(KeenClientConfig *)config completionHandler:(void (^)())completionHandler;
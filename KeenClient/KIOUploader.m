@@ -36,7 +36,7 @@
 // A dispatch queue used for uploads.
 @property (nonatomic) dispatch_queue_t uploadQueue;
 
-@property (nonatomic) KIODBStore *store;
+@property (nonatomic) id<KIOEventStore> store;
 
 @property (nonatomic) KIONetwork *network;
 
@@ -67,7 +67,7 @@
     return s_sharedInstance;
 }
 
-- (instancetype)initWithNetwork:(KIONetwork *)network andStore:(KIODBStore *)store {
+- (instancetype)initWithNetwork:(KIONetwork *)network andStore:(id<KIOEventStore>)store {
     self = [super init];
     if (self) {
         // Create a serialized queue to handle all upload operations
@@ -75,6 +75,11 @@
 
         self.maxEventUploadAttempts = 3;
 
+        self.eventLeaseDuration = 120;
+
+        self.maxEventsPerUpload = 500;
+        self.maxBytesPerUpload = 1024 * 1024;
+
         self.isUploadingCondition = [NSCondition new];
         self.isUploading = NO;
 
@@ -87,6 +92,9 @@
 
 - (void)prepareJSONData:(NSData **)jsonData
             andEventIDs:(NSMutableDictionary **)eventIDs
+                leaseID:(NSNumber **)leaseID
+            lastEventID:(NSNumber **)lastEventID
+           afterEventID:(NSNumber *)afterEventID
            forProjectID:(NSString *)projectID {
     // set up the request dictionary we'll send out.
     NSMutableDictionary *requestDict = [NSMutableDictionary dictionary];
@@ -95,34 +103,38 @@
     NSMutableDictionary *eventIDDict = [NSMutableDictionary dictionary];
 
     // get data for the API request we'll make
-    NSMutableDictionary *events =
-        [self.store getEventsWithMaxAttempts:self.maxEventUploadAttempts andProjectID:projectID];
+    KIOEventBatch *events = [self.store claimEventBatchWithMaxAttempts:self.maxEventUploadAttempts
+                                                             projectID:projectID
+                                                          afterEventID:afterEventID
+                                                             maxEvents:self.maxEventsPerUpload
+                                                              maxBytes:self.maxBytesPerUpload
+                                                         leaseDuration:self.eventLeaseDuration
+                                                               leaseID:leaseID
+                                                           lastEventID:lastEventID];
 
     NSError *error;
-    for (NSString *coll in events) {
-        NSDictionary *collEvents = [events objectForKey:coll];
+    for (NSUInteger i = 0; i < events.count; i++) {
+        NSString *coll = [events collectionAtIndex:i];
+
+        // the event data shares the batch's buffer, so deserializing doesn't copy it first
+        NSDictionary *eventDict = [NSJSONSerialization JSONObjectWithData:[events eventDataAtIndex:i]
+                                                                  options:0
+                                                                    error:&error];
+        if (error) {
+            KCLogError(@"An error occurred when deserializing a saved event: %@", [error localizedDescription]);
+            error = nil;
+            continue;
+        }
 
         // create a separate array for event data so our dictionary serializes properly
-        NSMutableArray *eventsArray = [NSMutableArray array];
-
-        for (NSNumber *eid in collEvents) {
-            NSData *ev = [collEvents objectForKey:eid];
-            NSDictionary *eventDict = [NSJSONSerialization JSONObjectWithData:ev options:0 error:&error];
-            if (error) {
-                KCLogError(@"An error occurred when deserializing a saved event: %@", [error localizedDescription]);
-                continue;
-            }
-
-            // add it to the array of events
-            [eventsArray addObject:eventDict];
-            if ([eventIDDict objectForKey:coll] == nil) {
-                [eventIDDict setObject:[NSMutableArray array] forKey:coll];
-            }
-            [[eventIDDict objectForKey:coll] addObject:eid];
+        if ([requestDict objectForKey:coll] == nil) {
+            [requestDict setObject:[NSMutableArray array] forKey:coll];
+            [eventIDDict setObject:[NSMutableArray array] forKey:coll];
         }
 
-        // add the array of events to the request
-        [requestDict setObject:eventsArray forKey:coll];
+        // add it to the array of events
+        [[requestDict objectForKey:coll] addObject:eventDict];
+        [[eventIDDict objectForKey:coll] addObject:[NSNumber numberWithLongLong:[events eventIDAtIndex:i]]];
     }
 
     if ([requestDict count] == 0) {
@@ -162,48 +174,82 @@
         // for this project id.
         [KIOFileStore maybeMigrateDataFromFileStore:config.projectID];
 
-        // get data for the API request we'll make
-        NSData *data;
-        NSMutableDictionary *eventIDs;
-        [self prepareJSONData:&data andEventIDs:&eventIDs forProjectID:config.projectID];
+        // Upload the stored events a page at a time, so only one page is held in memory
+        NSNumber *afterEventID = nil;
+        while (YES) {
+            // Drain each page's objects before claiming the next one
+            @autoreleasepool {
+                // get data for the API request we'll make
+                NSData *data;
+                NSMutableDictionary *eventIDs;
+                NSNumber *leaseID;
+                NSNumber *lastEventID;
+                [self prepareJSONData:&data
+                          andEventIDs:&eventIDs
+                              leaseID:&leaseID
+                          lastEventID:&lastEventID
+                         afterEventID:afterEventID
+                         forProjectID:config.projectID];
+
+                if (nil == lastEventID) {
+                    // Nothing left to upload
+                    break;
+                }
+                afterEventID = lastEventID;
 
-        if ([data length] == 0) {
-            [self runUploadFinishedBlock:completionHandler];
-        } else {
-            // loop through events and increment their attempt count
-            for (NSString *collectionName in eventIDs) {
-                for (NSNumber *eid in eventIDs[collectionName]) {
-                    [self.store incrementEventUploadAttempts:eid];
+                if ([data length] == 0) {
+                    // None of the events in this page could be sent, move on to the next one
+                    [self.store releaseLease:leaseID];
+                    continue;
                 }
-            }
 
-            [self.isUploadingCondition lock];
-            self.isUploading = YES;
-            [self.isUploadingCondition unlock];
-
-            // then make an http request to the keen server.
-            [self.network sendEvents:data
-                              config:config
-                   completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
-                       // then parse the http response and deal with it appropriately
-                       [self handleEventAPIResponse:response andData:data forEvents:eventIDs];
-
-                       [self runUploadFinishedBlock:completionHandler];
-
-                       [self.isUploadingCondition lock];
-                       self.isUploading = NO;
-                       [self.isUploadingCondition signal];
-                       [self.isUploadingCondition unlock];
-                   }];
-
-            // Block the queue until uploading has finished.
-            // Otherwise we'll pick up events that are in flight and try to upload them again
-            [self.isUploadingCondition lock];
-            while (self.isUploading) {
-                [self.isUploadingCondition waitUntilDate:[NSDate dateWithTimeIntervalSinceNow:60]];
+                // increment the attempt count of every event in the request
+                NSMutableArray *allEventIDs = [NSMutableArray array];
+                for (NSString *collectionName in eventIDs) {
+                    [allEventIDs addObjectsFromArray:eventIDs[collectionName]];
+                }
+                [self.store incrementUploadAttemptsForEvents:allEventIDs];
+
+                [self.isUploadingCondition lock];
+                self.isUploading = YES;
+                [self.isUploadingCondition unlock];
+
+                // then make an http request to the keen server.
+                __block BOOL wasUploaded = NO;
+                [self.network sendEvents:data
+                                  config:config
+                       completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
+                           // then parse the http response and deal with it appropriately
+                           [self handleEventAPIResponse:response andData:data forEvents:eventIDs];
+
+                           // Whatever wasn't deleted can be claimed by the next upload
+                           [self.store releaseLease:leaseID];
+
+                           NSInteger responseCode = [((NSHTTPURLResponse *)response)statusCode];
+                           [self.isUploadingCondition lock];
+                           wasUploaded = nil != data && [HTTPCodes httpCodeType:responseCode] == HTTPCode2XXSuccess;
+                           self.isUploading = NO;
+                           [self.isUploadingCondition signal];
+                           [self.isUploadingCondition unlock];
+                       }];
+
+                // Block the queue until uploading has finished.
+                // Otherwise we'll pick up events that are in flight and try to upload them again
+                [self.isUploadingCondition lock];
+                while (self.isUploading) {
+                    [self.isUploadingCondition waitUntilDate:[NSDate dateWithTimeIntervalSinceNow:60]];
+                }
+                BOOL shouldUploadNextPage = wasUploaded;
+                [self.isUploadingCondition unlock];
+
+                if (!shouldUploadNextPage) {
+                    // Leave the rest for the next upload rather than retrying against a failing server
+                    break;
+                }
             }
-            [self.isUploadingCondition unlock];
         }
+
+        [self runUploadFinishedBlock:completionHandler];
     });
 }
 
@@ -245,6 +291,7 @@
         return;
     }
     // now iterate through the keys of the response, which represent collection names
+    NSMutableArray *eventIDsToDelete = [NSMutableArray array];
     NSArray *collectionNames = [responseDict allKeys];
     for (NSString *collectionName in collectionNames) {
         // grab the results for this collection
@@ -277,12 +324,15 @@
 
             // delete the file if we need to
             if (deleteFile) {
-                [self.store deleteEvent:eid];
-                KCLogVerbose(@"Successfully deleted event: %@", eid);
+                [eventIDsToDelete addObject:eid];
+                KCLogVerbose(@"Deleting event: %@", eid);
             }
             count++;
         }
     }
+
+    // delete them all in one go
+    [self.store deleteEvents:eventIDsToDelete];
 }
 
 @end
@@ -259,6 +259,21 @@ typedef void (^AnalysisCompletionBlock)(NSData *responseData, NSURLResponse *res
                        andReadKey:(NSString *)readKey
                   apiUrlAuthority:(NSString *)apiUrlAuthority;
 
+/**
+ Call this to keep events in a store other than the default SQLite database, e.g. a
+ KIOSegmentedLogStore. Queries are still cached in the default database.
+
+ @param projectID Your Keen IO Project ID.
+ @param writeKey Your Keen IO Write Key, Access Key with write permission, or nil if not doing writes.
+ @param readKey Your Keen IO Read Key, Access Key with read permission, or nil if not doing reads.
+ @param eventStore Where events are kept until they're uploaded.
+ @return An initialized instance of KeenClient.
+ */
+- (instancetype)initWithProjectID:(NSString *)projectID
+                      andWriteKey:(NSString *)writeKey
+                       andReadKey:(NSString *)readKey
+                       eventStore:(id<KIOEventStore>)eventStore;
+
 /**
  Call this to set the global properties block for this instance of the KeenClient. The block is invoked
  every time an event is added to an event collection.
@@ -315,6 +330,51 @@ typedef void (^AnalysisCompletionBlock)(NSData *responseData, NSURLResponse *res
      toEventCollection:(NSString *)eventCollection
                  error:(NSError **)anError;
 
+/**
+ Add an event without waiting for it to be written to the local store. The event is validated and
+ serialized on the calling thread, then written in the background, so the caller isn't held up
+ by the database.
+
+ @param event An NSDictionary that consists of key/value pairs.  Keen naming conventions apply.  Nested NSDictionaries
+ or NSArrays are acceptable.
+ @param eventCollection The name of the collection you want to put this event into.
+ @param completionQueue The queue completionHandler is called on. Pass nil for the main queue.
+ @param completionHandler Called with whether the event was stored, once it has been written or dropped. Not called if
+ the event was invalid. May be nil.
+ @param anError If the event was handed off to be stored, anError will be nil, otherwise it will contain information
+ about why it wasn't.
+
+ @return YES if the event was valid and handed off to be stored, or NO in case some error happened.
+ */
+- (BOOL)addEvent:(NSDictionary *)event
+    toEventCollection:(NSString *)eventCollection
+      completionQueue:(dispatch_queue_t)completionQueue
+    completionHandler:(void (^)(BOOL stored))completionHandler
+                error:(NSError **)anError;
+
+/**
+ Add an event that overrides keen-default properties without waiting for it to be written to the
+ local store. See addEvent:toEventCollection:completionQueue:completionHandler:error:.
+
+ @param event An NSDictionary that consists of key/value pairs.  Keen naming conventions apply.  Nested NSDictionaries
+ or NSArrays are acceptable.
+ @param keenProperties An instance of KeenProperties that consists of properties to override defaulted values.
+ @param eventCollection The name of the event collection you want to put this event into.
+ @param completionQueue The queue completionHandler is called on. Pass nil for the main queue.
+ @param completionHandler Called with whether the event was stored, once it has been written or dropped. Not called if
+ the event was invalid. May be nil.
+ @param anError If the event was handed off to be stored, anError will be nil, otherwise it will contain information
+ about why it wasn't.
+
+ @return YES if the event was valid and handed off to be stored, or NO in case some error happened.
+ */
+- (BOOL)addEvent:(NSDictionary *)event
+    withKeenProperties:(KeenProperties *)keenProperties
+     toEventCollection:(NSString *)eventCollection
+       completionQueue:(dispatch_queue_t)completionQueue
+     completionHandler:(void (^)(BOOL stored))completionHandler
+                 error:(NSError **)anError;
+
 /**
  Call this whenever you want to upload all the events captured so far.  This will spawn a low
  priority background thread and process all required HTTP requests.
@@ -57,6 +57,9 @@ static BOOL geoLocationRequestEnabled = YES;
 // Component for event durability
 @property (nonatomic) KIODBStore *store;
 
+// Where events are kept until they're uploaded. The store, unless another one was given.
+@property (nonatomic) id<KIOEventStore> eventStore;
+
 // Component for handling event uploads
 @property (nonatomic) KIOUploader *uploader;
 
@@ -182,7 +185,7 @@ static BOOL geoLocationRequestEnabled = YES;
 }
 
 - (void)clearAllEvents {
-    [self.store deleteAllEvents];
+    [self.eventStore deleteAllEvents];
 }
 
 + (void)clearAllEvents {
@@ -214,6 +217,7 @@ static BOOL geoLocationRequestEnabled = YES;
 
         self.network = network;
         self.store = store;
+        self.eventStore = store;
         self.uploader = uploader;
 
         [self refreshCurrentLocation];
@@ -241,6 +245,7 @@ static BOOL geoLocationRequestEnabled = YES;
                                                                apiUrlAuthority:apiUrlAuthority];
         if (config) {
             self.config = config;
+            [self applyCollectionCaps];
         } else {
             self = nil;
         }
@@ -261,6 +266,27 @@ static BOOL geoLocationRequestEnabled = YES;
     return [self initWithProjectID:projectID andWriteKey:writeKey andReadKey:readKey apiUrlAuthority:nil];
 }
 
+- (instancetype)initWithProjectID:(NSString *)projectID
+                      andWriteKey:(NSString *)writeKey
+                       andReadKey:(NSString *)readKey
+                       eventStore:(id<KIOEventStore>)eventStore {
+    // the shared uploader reads from the shared store, so this client needs its own
+    KIOUploader *uploader = [[KIOUploader alloc] initWithNetwork:[KIONetwork sharedInstance] andStore:eventStore];
+    self = [self initWithProjectID:projectID
+                       andWriteKey:writeKey
+                        andReadKey:readKey
+                        andNetwork:[KIONetwork sharedInstance]
+                          andStore:[KIODBStore sharedInstance]
+                       andUploader:uploader
+                   apiUrlAuthority:nil];
+
+    if (self) {
+        self.eventStore = eventStore;
+    }
+
+    return self;
+}
+
 - (instancetype)initWithProjectID:(NSString *)projectID
                       andWriteKey:(NSString *)writeKey
                        andReadKey:(NSString *)readKey
@@ -294,6 +320,7 @@ static BOOL geoLocationRequestEnabled = YES;
                                                            apiUrlAuthority:apiUrlAuthority];
     if (self.sharedClient.config) {
         client = self.sharedClient;
+        [client applyCollectionCaps];
     }
 
     return client;
@@ -475,6 +502,57 @@ static BOOL geoLocationRequestEnabled = YES;
     withKeenProperties:(KeenProperties *)keenProperties
      toEventCollection:(NSString *)eventCollection
                  error:(NSError **)error {
+    NSData *jsonData =
+        [self serializeEvent:event withKeenProperties:keenProperties toEventCollection:eventCollection error:error];
+    if (nil == jsonData) {
+        return NO;
+    }
+
+    // write JSON to store
+    [self.eventStore addEvent:jsonData collection:eventCollection projectID:self.config.projectID];
+
+    return YES;
+}
+
+- (BOOL)addEvent:(NSDictionary *)event
+    toEventCollection:(NSString *)eventCollection
+      completionQueue:(dispatch_queue_t)completionQueue
+    completionHandler:(void (^)(BOOL stored))completionHandler
+                error:(NSError **)error {
+    return [self addEvent:event
+           withKeenProperties:nil
+            toEventCollection:eventCollection
+              completionQueue:completionQueue
+            completionHandler:completionHandler
+                        error:error];
+}
+
+- (BOOL)addEvent:(NSDictionary *)event
+    withKeenProperties:(KeenProperties *)keenProperties
+     toEventCollection:(NSString *)eventCollection
+       completionQueue:(dispatch_queue_t)completionQueue
+     completionHandler:(void (^)(BOOL stored))completionHandler
+                 error:(NSError **)error {
+    NSData *jsonData =
+        [self serializeEvent:event withKeenProperties:keenProperties toEventCollection:eventCollection error:error];
+    if (nil == jsonData) {
+        return NO;
+    }
+
+    // hand the JSON off to the store without waiting for it to be written
+    [self.eventStore addEvent:jsonData
+                   collection:eventCollection
+                    projectID:self.config.projectID
+              completionQueue:completionQueue
+            completionHandler:completionHandler];
+    return YES;
+}
+
+// Validates an event and builds the JSON that's stored for it, or returns nil and sets error.
+- (NSData *)serializeEvent:(NSDictionary *)event
+        withKeenProperties:(KeenProperties *)keenProperties
+         toEventCollection:(NSString *)eventCollection
+                     error:(NSError **)error {
     // make sure the write key has been set - can't do anything without that
     if (self.config.writeKey == nil || self.config.writeKey.length <= 0) {
         [NSException raise:@"KeenNoWriteKeyProvided"
@@ -483,10 +561,10 @@ static BOOL geoLocationRequestEnabled = YES;
 
     // don't do anything if the event itself or the event collection name are invalid somehow.
     if (![self validateEventCollection:eventCollection error:error]) {
-        return NO;
+        return nil;
     }
     if (![self validateEvent:event withDepth:0 error:error]) {
-        return NO;
+        return nil;
     }
 
     KCLogVerbose(@"Adding event to collection: %@", eventCollection);
@@ -507,17 +585,6 @@ static BOOL geoLocationRequestEnabled = YES;
     [newEvent addEntriesFromDictionary:event];
     event = newEvent;
 
-    // now make sure that we haven't hit the max number of events in this collection already
-    NSUInteger eventCount = [self.store getTotalEventCountWithProjectID:self.config.projectID];
-
-    // We add 1 because we want to know if this will push us over the limit
-    if (eventCount + 1 > self.maxEventsPerCollection) {
-        // need to age out old data so the cache doesn't grow too large
-        KCLogWarn(@"Too many events in cache for %@, aging out old data.", eventCollection);
-        KCLogWarn(@"Count: %lu and Max: %lu", (unsigned long)eventCount, (unsigned long)self.maxEventsPerCollection);
-        [self.store deleteEventsFromOffset:[NSNumber numberWithUnsignedInteger:eventCount - self.numberEventsToForget]];
-    }
-
     if (!keenProperties) {
         KeenProperties *newProperties = [KeenProperties new];
         keenProperties = newProperties;
@@ -544,19 +611,17 @@ static BOOL geoLocationRequestEnabled = YES;
     NSError *serializationError;
     NSData *jsonData = [KIOUtil serializeEventToJSON:eventToWrite error:&serializationError];
     if (serializationError) {
-        return [KIOUtil handleError:error
-                   withErrorMessage:[NSString stringWithFormat:@"An error occurred when serializing event to JSON: %@",
-                                                               [serializationError localizedDescription]]
-                    underlyingError:serializationError];
+        [KIOUtil handleError:error
+            withErrorMessage:[NSString stringWithFormat:@"An error occurred when serializing event to JSON: %@",
+                                                        [serializationError localizedDescription]]
+             underlyingError:serializationError];
+        return nil;
     }
 
-    // write JSON to store
-    [self.store addEvent:jsonData collection:eventCollection projectID:self.config.projectID];
-
     // log the event
     KCLogVerbose(@"Event: %@", eventToWrite);
 
-    return YES;
+    return jsonData;
 }
 
 - (void)importFileData {
@@ -663,8 +728,31 @@ static BOOL geoLocationRequestEnabled = YES;
     return kKeenSdkVersion;
 }
 
+- (void)setEventStore:(id<KIOEventStore>)eventStore {
+    _eventStore = eventStore;
+    [self applyCollectionCaps];
+}
+
+// The event store caps each collection on its own, aging out the collection's oldest events once it's full.
+// Set whenever the store, the project or the caps change, rather than on every event. The caps are set for
+// this client's project only, since clients of other projects can share the store.
+- (void)applyCollectionCaps {
+    NSString *projectID = self.config.projectID;
+    if (nil == projectID) {
+        return;
+    }
+    [self.eventStore setMaxEventsPerCollection:self.maxEventsPerCollection
+                                 eventsToEvict:self.numberEventsToForget
+                                  forProjectID:projectID];
+}
+
 #pragma mark - To make testing easier
 
+- (void)setIsRunningTests:(BOOL)isRunningTests {
+    _isRunningTests = isRunningTests;
+    [self applyCollectionCaps];
+}
+
 - (NSUInteger)maxEventsPerCollection {
     if (self.isRunningTests) {
         return 5;
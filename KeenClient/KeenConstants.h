@@ -25,6 +25,9 @@ extern NSString * const kKeenInvalidPropertyValueError;
 
 extern NSUInteger const kKeenMaxEventsPerCollection;
 extern NSUInteger const kKeenNumberEventsToForget;
+extern NSUInteger const kKeenMaxBytesPerProject;
+extern NSUInteger const kKeenMaxTotalBytes;
+extern NSUInteger const kKeenBytesToEvictOverBudget;
 
 extern NSString * const kKeenErrorDomain;
 
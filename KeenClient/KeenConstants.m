@@ -29,6 +29,12 @@ NSString *const kKeenInvalidPropertyValueError = @"InvalidPropertyValueError";
 NSUInteger const kKeenMaxEventsPerCollection = 10000;
 // how many events to drop when aging out
 NSUInteger const kKeenNumberEventsToForget = 100;
+// how many bytes of events can be stored for a single project before aging them out
+NSUInteger const kKeenMaxBytesPerProject = 20 * 1024 * 1024;
+// how many bytes of events can be stored across every project before aging them out
+NSUInteger const kKeenMaxTotalBytes = 50 * 1024 * 1024;
+// how many bytes past a budget to drop when aging out
+NSUInteger const kKeenBytesToEvictOverBudget = 512 * 1024;
 
 // custom domain for NSErrors
 NSString *const kKeenErrorDomain = @"io.keen";
@@ -21,7 +21,10 @@ FOUNDATION_EXPORT const unsigned char KeenClientFrameworkVersionString[];
 #import <KeenClient/KeenProperties.h>
 
 #import <KeenClient/KIODBStore.h>
+#import <KeenClient/KIOEventBatch.h>
+#import <KeenClient/KIOEventStore.h>
 #import <KeenClient/KIOQuery.h>
 #import <KeenClient/KIOReachability.h>
+#import <KeenClient/KIOSegmentedLogStore.h>
 
 #import <KeenClient/HTTPCodes.h>
\ No newline at end of file
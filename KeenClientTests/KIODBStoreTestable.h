@@ -10,4 +10,6 @@
 
 + (NSString *)getSqliteFullFileName;
 
+@property (nonatomic) dispatch_queue_t dbQueue;
+
 @end
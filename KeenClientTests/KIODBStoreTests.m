@@ -15,6 +15,9 @@
 #import "KIODBStorePrivate.h"
 #import "KIODBStoreTestable.h"
 #import "KIOQuery.h"
+#import "keen_io_sqlite3.h"
+
+#import <malloc/malloc.h>
 
 @interface KIODBStoreTests ()
 
@@ -175,6 +178,401 @@
     XCTAssertFalse([self.store hasPendingEventsWithProjectID:projectID], @"No pending events now!");
 }
 
+- (void)testEventClaimLeasesBatch {
+    self.store = [[KIODBStore alloc] init];
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    }
+
+    NSNumber *leaseID;
+    NSMutableDictionary *events =
+        [self.store claimEventsWithMaxAttempts:3 projectID:projectID limit:2 leaseDuration:60 leaseID:&leaseID];
+    XCTAssertNotNil(leaseID, @"claim returns a lease");
+    XCTAssertTrue([[events objectForKey:@"foo"] count] == 2, @"2 events claimed");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 2, @"2 pending events after claim");
+
+    NSNumber *otherLeaseID;
+    events =
+        [self.store claimEventsWithMaxAttempts:3 projectID:projectID limit:2 leaseDuration:60 leaseID:&otherLeaseID];
+    XCTAssertTrue([[events objectForKey:@"foo"] count] == 1, @"leased events aren't claimed again");
+    XCTAssertNotEqualObjects(leaseID, otherLeaseID, @"each claim gets its own lease");
+
+    [self.store releaseLease:leaseID];
+    events = [self.store claimEventsWithMaxAttempts:3 projectID:projectID limit:0 leaseDuration:60 leaseID:NULL];
+    XCTAssertTrue([[events objectForKey:@"foo"] count] == 2, @"released events can be claimed again");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 3, @"3 pending events");
+}
+
+- (void)testEventClaimReclaimsExpiredLease {
+    self.store = [[KIODBStore alloc] init];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    NSMutableDictionary *events =
+        [self.store claimEventsWithMaxAttempts:3 projectID:projectID limit:0 leaseDuration:0.1 leaseID:NULL];
+    XCTAssertTrue([[events objectForKey:@"foo"] count] == 1, @"1 event claimed");
+    events = [self.store claimEventsWithMaxAttempts:3 projectID:projectID limit:0 leaseDuration:0.1 leaseID:NULL];
+    XCTAssertTrue([events count] == 0, @"nothing to claim while the lease is held");
+
+    [NSThread sleepForTimeInterval:0.2];
+    events = [self.store claimEventsWithMaxAttempts:3 projectID:projectID limit:0 leaseDuration:0.1 leaseID:NULL];
+    XCTAssertTrue([[events objectForKey:@"foo"] count] == 1, @"expired lease is reclaimed");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 1, @"still 1 pending event");
+}
+
+- (void)testEventClaimPages {
+    self.store = [[KIODBStore alloc] init];
+    for (int i = 0; i < 5; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    }
+
+    // Zero length leases, so only the cursor keeps pages from overlapping
+    NSNumber *cursor = nil;
+    NSMutableArray *pageSizes = [NSMutableArray array];
+    while (YES) {
+        NSNumber *lastEventID;
+        NSMutableDictionary *events = [self.store claimEventsWithMaxAttempts:3
+                                                                   projectID:projectID
+                                                                afterEventID:cursor
+                                                                   maxEvents:2
+                                                                    maxBytes:0
+                                                               leaseDuration:0
+                                                                     leaseID:NULL
+                                                                 lastEventID:&lastEventID];
+        if (nil == lastEventID) {
+            XCTAssertTrue([events count] == 0, @"no cursor once nothing is left");
+            break;
+        }
+        XCTAssertTrue([lastEventID longLongValue] > [cursor longLongValue], @"cursor moves forward");
+        [pageSizes addObject:@([[events objectForKey:@"foo"] count])];
+        cursor = lastEventID;
+    }
+    XCTAssertEqualObjects(pageSizes, (@[ @2, @2, @1 ]), @"5 events in pages of 2");
+}
+
+- (void)testEventClaimByteBudget {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self benchmarkEvent];
+    for (int i = 0; i < 5; i++) {
+        [self.store addEvent:event collection:@"foo" projectID:projectID];
+    }
+
+    NSMutableDictionary *events = [self.store claimEventsWithMaxAttempts:3
+                                                               projectID:projectID
+                                                            afterEventID:nil
+                                                               maxEvents:0
+                                                                maxBytes:event.length * 3 + 1
+                                                           leaseDuration:60
+                                                                 leaseID:NULL
+                                                             lastEventID:NULL];
+    XCTAssertTrue([[events objectForKey:@"foo"] count] == 3, @"3 events fit the byte budget");
+
+    events = [self.store claimEventsWithMaxAttempts:3
+                                          projectID:projectID
+                                       afterEventID:nil
+                                          maxEvents:0
+                                           maxBytes:1
+                                      leaseDuration:60
+                                            leaseID:NULL
+                                        lastEventID:NULL];
+    XCTAssertTrue([[events objectForKey:@"foo"] count] == 1, @"an oversized event is still claimed on its own");
+}
+
+- (void)testEventClaimBatch {
+    self.store = [[KIODBStore alloc] init];
+    for (int i = 0; i < 5; i++) {
+        [self.store addEvent:[self typicalEvent:i] collection:i % 2 ? @"bar" : @"foo" projectID:projectID];
+    }
+
+    NSNumber *leaseID;
+    NSNumber *lastEventID;
+    KIOEventBatch *batch = [self.store claimEventBatchWithMaxAttempts:3
+                                                            projectID:projectID
+                                                         afterEventID:nil
+                                                            maxEvents:4
+                                                             maxBytes:0
+                                                        leaseDuration:60
+                                                              leaseID:&leaseID
+                                                          lastEventID:&lastEventID];
+    XCTAssertEqual(batch.count, 4, @"4 events claimed");
+    XCTAssertNotNil(leaseID, @"the batch is leased");
+    XCTAssertEqual(batch.eventIDs[3], [lastEventID longLongValue], @"the last id is the cursor");
+    XCTAssertEqualObjects(batch.collections, (@[ @"foo", @"bar" ]), @"collections in the order they were claimed");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 4, @"4 pending events");
+
+    NSData *firstEvent = [batch eventDataAtIndex:0];
+    for (NSUInteger i = 0; i < batch.count; i++) {
+        XCTAssertEqualObjects([batch collectionAtIndex:i], i % 2 ? @"bar" : @"foo", @"collection of each event");
+        XCTAssertEqualObjects([batch eventDataAtIndex:i], [self typicalEvent:(int)i], @"data of each event");
+        if (i > 0) {
+            XCTAssertTrue([batch eventIDAtIndex:i] > [batch eventIDAtIndex:i - 1], @"events in id order");
+        }
+    }
+
+    // Views into the batch keep its buffer alive
+    batch = nil;
+    XCTAssertEqualObjects(firstEvent, [self typicalEvent:0], @"event data outlives the batch");
+
+    batch = [self.store claimEventBatchWithMaxAttempts:3
+                                             projectID:projectID
+                                          afterEventID:lastEventID
+                                             maxEvents:0
+                                              maxBytes:0
+                                         leaseDuration:60
+                                               leaseID:&leaseID
+                                           lastEventID:&lastEventID];
+    XCTAssertEqual(batch.count, 1, @"the rest of the events claimed");
+
+    batch = [self.store claimEventBatchWithMaxAttempts:3
+                                             projectID:projectID
+                                          afterEventID:nil
+                                             maxEvents:0
+                                              maxBytes:0
+                                         leaseDuration:60
+                                               leaseID:&leaseID
+                                           lastEventID:&lastEventID];
+    XCTAssertEqual(batch.count, 0, @"nothing left to claim");
+    XCTAssertNil(leaseID, @"no lease when nothing was claimed");
+}
+
+- (void)testEventBulkDeleteAndIncrement {
+    self.store = [[KIODBStore alloc] init];
+    // More than one bulk statement's worth of ids
+    for (int i = 0; i < 250; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    }
+
+    NSArray *eventIds = [[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"] allKeys];
+    XCTAssertTrue(eventIds.count == 250, @"250 events claimed");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 250, @"250 pending events");
+
+    NSArray *sortedIds = [eventIds sortedArrayUsingSelector:@selector(compare:)];
+    NSArray *incrementedIds = [sortedIds subarrayWithRange:NSMakeRange(0, 150)];
+    for (int i = 0; i < 3; i++) {
+        [self.store incrementUploadAttemptsForEvents:incrementedIds];
+    }
+    XCTAssertTrue([[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"] count] == 100,
+                  @"incremented events reached max attempts");
+
+    [self.store deleteEvents:[sortedIds subarrayWithRange:NSMakeRange(50, 200)]];
+    XCTAssertTrue([self.store getTotalEventCountWithProjectID:projectID] == 50, @"50 total events after delete");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 50, @"50 pending events after delete");
+}
+
+- (void)testEventCountsSeededFromExistingRows {
+    self.store = [[KIODBStore alloc] init];
+    // 1000 rows split over two projects, every 10th one pending
+    [self insertEventRows:1000];
+
+    XCTAssertTrue([self.store getTotalEventCountWithProjectID:projectID] == 500, @"500 total events seeded");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 50, @"50 pending events seeded");
+
+    [self.store addEvent:[@"I AM AN EVENT" dataUsingEncoding:NSUTF8StringEncoding] collection:@"foo" projectID:projectID];
+    XCTAssertTrue([self.store getTotalEventCountWithProjectID:projectID] == 501, @"501 total events after add");
+
+    [self.store purgePendingEventsWithProjectID:projectID];
+    XCTAssertTrue([self.store getTotalEventCountWithProjectID:projectID] == 451, @"451 total events after purge");
+    XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 0, @"0 pending events after purge");
+    XCTAssertTrue([self.store getTotalEventCountWithProjectID:@"otherpid"] == 500, @"other project is untouched");
+}
+
+- (void)testCollectionCapEvictsOldestInCollection {
+    self.store = [[KIODBStore alloc] init];
+    self.store.maxEventsPerCollection = 3;
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:[self typicalEvent:i] collection:@"quiet" projectID:projectID];
+    }
+    for (int i = 0; i < 10; i++) {
+        [self.store addEvent:[self typicalEvent:i] collection:@"noisy" projectID:projectID];
+    }
+
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"quiet"], 3, @"quiet collection kept");
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"noisy"], 3, @"noisy collection capped");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 6, @"6 total events");
+
+    NSArray *noisyEvents = [[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"noisy"]
+        allValues];
+    for (int i = 7; i < 10; i++) {
+        XCTAssertTrue([noisyEvents containsObject:[self typicalEvent:i]], @"newest events kept");
+    }
+}
+
+- (void)testCollectionCapEvictsInBatches {
+    self.store = [[KIODBStore alloc] init];
+    self.store.maxEventsPerCollection = 5;
+    self.store.eventsToEvictPerCollection = 2;
+    for (int i = 0; i < 5; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    }
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 5, @"5 total events");
+
+    // 5 - 2 + 1
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 4, @"4 total events");
+}
+
+- (void)testCollectionCapOverride {
+    self.store = [[KIODBStore alloc] init];
+    self.store.maxEventsPerCollection = 2;
+    [self.store setMaxEvents:4 forCollection:@"big"];
+    [self.store setMaxEvents:0 forCollection:@"unbounded"];
+    XCTAssertEqual([self.store maxEventsForCollection:@"foo"], 2, @"default cap");
+    XCTAssertEqual([self.store maxEventsForCollection:@"big"], 4, @"collection cap");
+
+    for (int i = 0; i < 6; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+        [self.store addEvent:[self benchmarkEvent] collection:@"big" projectID:projectID];
+        [self.store addEvent:[self benchmarkEvent] collection:@"unbounded" projectID:projectID];
+    }
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"foo"], 2);
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"big"], 4);
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"unbounded"], 6);
+}
+
+- (void)testCollectionCapPerProject {
+    self.store = [[KIODBStore alloc] init];
+    self.store.maxEventsPerCollection = 4;
+    [self.store setMaxEventsPerCollection:2 eventsToEvict:1 forProjectID:projectID];
+    [self.store setMaxEvents:3 forCollection:@"big"];
+    XCTAssertEqual([self.store maxEventsForCollection:@"foo"], 4, @"the default cap is left alone");
+
+    for (int i = 0; i < 6; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+        [self.store addEvent:[self benchmarkEvent] collection:@"big" projectID:projectID];
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:@"otherpid"];
+    }
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"foo"], 2, @"project cap");
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"big"], 3, @"collection cap");
+    XCTAssertEqual([self.store getEventCountWithProjectID:@"otherpid" collection:@"foo"], 4, @"default cap");
+}
+
+- (void)testCollectionCapCountFollowsDeletes {
+    self.store = [[KIODBStore alloc] init];
+    self.store.maxEventsPerCollection = 3;
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:[self typicalEvent:i] collection:@"foo" projectID:projectID];
+    }
+
+    NSDictionary *events = [[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"];
+    NSArray *sortedIds = [[events allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    [self.store deleteEvent:sortedIds[2]];
+    [self.store deleteEvents:@[ sortedIds[1] ]];
+    XCTAssertEqual([self.store getEventCountWithProjectID:projectID collection:@"foo"], 1, @"deletes counted");
+
+    // Room for two more without evicting the oldest
+    [self.store addEvent:[self typicalEvent:3] collection:@"foo" projectID:projectID];
+    [self.store addEvent:[self typicalEvent:4] collection:@"foo" projectID:projectID];
+    events = [[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"];
+    XCTAssertEqualObjects(events[sortedIds[0]], [self typicalEvent:0], @"oldest event kept");
+    XCTAssertEqual(events.count, 3, @"3 events in the collection");
+}
+
+- (void)testBytesUsedFollowsAddsAndDeletes {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self benchmarkEvent];
+    for (int i = 0; i < 4; i++) {
+        [self.store addEvent:event collection:@"foo" projectID:projectID];
+    }
+    [self.store addEvent:event collection:@"foo" projectID:@"otherpid"];
+    XCTAssertEqual([self.store getBytesUsedWithProjectID:projectID], event.length * 4, @"4 events of bytes");
+    XCTAssertEqual([self.store getTotalBytesUsed], event.length * 5, @"5 events of bytes in every project");
+
+    NSArray *eventIds = [[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"] allKeys];
+    [self.store deleteEvent:eventIds[0]];
+    [self.store deleteEvents:@[ eventIds[1], eventIds[2] ]];
+    XCTAssertEqual([self.store getBytesUsedWithProjectID:projectID], event.length, @"1 event of bytes left");
+    XCTAssertEqual([self.store getTotalBytesUsed], event.length * 2, @"2 events of bytes left in every project");
+
+    [self.store purgePendingEventsWithProjectID:projectID];
+    XCTAssertEqual([self.store getBytesUsedWithProjectID:projectID], 0, @"no bytes left after purge");
+    XCTAssertEqual([self.store getTotalBytesUsed], event.length, @"other project's bytes left after purge");
+}
+
+- (void)testProjectByteBudgetEvictsOldest {
+    self.store = [[KIODBStore alloc] init];
+    [self.store addEvent:[self typicalEvent:0] collection:@"foo" projectID:@"otherpid"];
+    NSUInteger eventLength = [self typicalEvent:0].length;
+    self.store.maxBytesPerProject = eventLength * 3;
+    self.store.bytesToEvictOverBudget = 0;
+    for (int i = 0; i < 5; i++) {
+        [self.store addEvent:[self typicalEvent:i] collection:i % 2 ? @"foo" : @"bar" projectID:projectID];
+    }
+
+    XCTAssertTrue([self.store getBytesUsedWithProjectID:projectID] <= eventLength * 3, @"project within its budget");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 3, @"3 events fit the budget");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:@"otherpid"], 1, @"other project untouched");
+
+    NSDictionary *events = [self.store getEventsWithMaxAttempts:3 andProjectID:projectID];
+    XCTAssertTrue([[events[@"bar"] allValues] containsObject:[self typicalEvent:4]], @"newest event kept");
+    XCTAssertFalse([[events[@"bar"] allValues] containsObject:[self typicalEvent:0]], @"oldest event evicted");
+}
+
+- (void)testTotalByteBudgetEvictsOldest {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self benchmarkEvent];
+    self.store.maxTotalBytes = event.length * 4;
+    self.store.bytesToEvictOverBudget = 0;
+    [self.store addEvent:event collection:@"foo" projectID:@"otherpid"];
+    [self.store addEvent:event collection:@"foo" projectID:@"otherpid"];
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:event collection:@"foo" projectID:projectID];
+    }
+
+    XCTAssertEqual([self.store getTotalBytesUsed], event.length * 4, @"store within its budget");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:@"otherpid"], 1, @"oldest event evicted");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 3, @"newer events kept");
+}
+
+- (void)testByteBudgetEvictsDownToLowWaterMark {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self benchmarkEvent];
+    self.store.maxBytesPerProject = event.length * 10;
+    self.store.bytesToEvictOverBudget = event.length * 4;
+    for (int i = 0; i < 10; i++) {
+        [self.store addEvent:event collection:@"foo" projectID:projectID];
+    }
+
+    // Going over evicts the event that doesn't fit plus 4 more, so the next 4 adds don't evict.
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 6);
+    for (int i = 0; i < 4; i++) {
+        [self.store addEvent:event collection:@"foo" projectID:projectID];
+    }
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 10);
+}
+
+- (void)testByteBudgetSkipsLeasedEvents {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self benchmarkEvent];
+    self.store.bytesToEvictOverBudget = 0;
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+    NSNumber *leaseID;
+    [self.store claimEventsWithMaxAttempts:3 projectID:projectID limit:0 leaseDuration:60 leaseID:&leaseID];
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+
+    // The leased event is in flight, so the unleased one is evicted instead.
+    self.store.maxBytesPerProject = event.length * 2;
+    XCTAssertTrue([self.store addEvent:event collection:@"foo" projectID:projectID]);
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 2);
+    XCTAssertEqual([self.store getPendingEventCountWithProjectID:projectID], 1, @"leased event kept");
+}
+
+- (void)testByteBudgetRejectsOversizedEvent {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self benchmarkEvent];
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+    self.store.maxBytesPerProject = event.length - 1;
+
+    XCTAssertFalse([self.store addEvent:event collection:@"foo" projectID:projectID], @"oversized event not added");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 1, @"nothing evicted for it");
+}
+
+- (void)testBytesUsedSeededFromExistingRows {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:100];
+    XCTAssertEqual([self.store getBytesUsedWithProjectID:projectID], [self benchmarkEvent].length * 50);
+    XCTAssertEqual([self.store getTotalBytesUsed], [self benchmarkEvent].length * 100);
+}
+
 - (void)testEventDeleteFromOffset {
     self.store = [[KIODBStore alloc] init];
     [self.store addEvent:[@"I AM AN EVENT" dataUsingEncoding:NSUTF8StringEncoding] collection:@"foo" projectID:projectID];
@@ -190,6 +588,28 @@
                   @"2 total events after deleteEventsFromOffset");
 }
 
+- (void)testEventDeleteFromOffsetKeepsCounts {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:100];
+    // Seed the cached counts so the age out has to adjust them
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 50);
+    XCTAssertEqual([self.store getPendingEventCountWithProjectID:projectID], 10);
+    XCTAssertEqual([self.store getTotalBytesUsed], [self benchmarkEvent].length * 100);
+
+    [self.store deleteEventsFromOffset:@30];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 15);
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:@"otherpid"], 15);
+    XCTAssertEqual([self.store getPendingEventCountWithProjectID:projectID], 3);
+    XCTAssertEqual([self.store getTotalBytesUsed], [self benchmarkEvent].length * 30);
+
+    // An offset past the last event leaves everything in place
+    [self.store deleteEventsFromOffset:@100];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 15);
+    [self.store deleteEventsFromOffset:@0];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 0);
+    XCTAssertEqual([self.store getTotalBytesUsed], 0);
+}
+
 #pragma mark - Query Methods
 
 - (void)testQueryAdd {
@@ -407,6 +827,97 @@
     XCTAssertTrue(totalQueries == 0, @"0 total query after trying to delete queries older than 1 seconds");
 }
 
+- (void)testHasQueryWithMaxAttemptsIgnoresExpiredQueries {
+    self.store = [[KIODBStore alloc] init];
+    self.store.querySweepInterval = 3600;
+    NSData *queryData = [@"{\"event_collection\": \"c\"}" dataUsingEncoding:NSUTF8StringEncoding];
+
+    // The first check sweeps, and the next one isn't due for an hour
+    XCTAssertFalse([self.store hasQueryWithMaxAttempts:queryData
+                                             queryType:@"count"
+                                            collection:@"c"
+                                             projectID:projectID
+                                           maxAttempts:0
+                                              queryTTL:1]);
+    [self.store addQuery:queryData queryType:@"count" collection:@"c" projectID:projectID];
+    [NSThread sleepForTimeInterval:2.0];
+
+    XCTAssertFalse([self.store hasQueryWithMaxAttempts:queryData
+                                             queryType:@"count"
+                                            collection:@"c"
+                                             projectID:projectID
+                                           maxAttempts:0
+                                              queryTTL:1],
+                   @"expired query is ignored");
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 1, @"and left for the next sweep");
+}
+
+- (void)testExpiredQueriesAreSweptInBackground {
+    self.store = [[KIODBStore alloc] init];
+    self.store.querySweepInterval = 0;
+    NSData *queryData = [@"{\"event_collection\": \"c\"}" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.store addQuery:queryData queryType:@"count" collection:@"c" projectID:projectID];
+    [NSThread sleepForTimeInterval:2.0];
+
+    [self.store hasQueryWithMaxAttempts:queryData
+                              queryType:@"count"
+                             collection:@"c"
+                              projectID:projectID
+                            maxAttempts:0
+                               queryTTL:1];
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5];
+    while ([self.store getTotalQueryCountWithProjectID:projectID] > 0 && [deadline timeIntervalSinceNow] > 0) {
+        [NSThread sleepForTimeInterval:0.05];
+    }
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 0);
+}
+
+- (void)testFindOrUpdateQueryAddsNewRowForExpiredQuery {
+    self.store = [[KIODBStore alloc] init];
+    NSData *queryData = [@"{\"event_collection\": \"c\"}" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.store addQuery:queryData queryType:@"count" collection:@"c" projectID:projectID];
+    [NSThread sleepForTimeInterval:3.0];
+
+    // The expired row hasn't been swept, but it mustn't be found and incremented either
+    [self.store findOrUpdateQuery:queryData queryType:@"count" collection:@"c" projectID:projectID queryTTL:2];
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 2);
+
+    // The fresh row is the one that's incremented next time
+    [self.store findOrUpdateQuery:queryData queryType:@"count" collection:@"c" projectID:projectID queryTTL:2];
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 2);
+    XCTAssertTrue([self.store hasQueryWithMaxAttempts:queryData
+                                            queryType:@"count"
+                                           collection:@"c"
+                                            projectID:projectID
+                                          maxAttempts:1
+                                             queryTTL:3600]);
+}
+
+- (void)testHasQueryWithMaxAttemptsPerformance5k {
+    self.store = [[KIODBStore alloc] init];
+    for (int i = 0; i < 5000; i++) {
+        NSString *json = [NSString stringWithFormat:@"{\"event_collection\": \"c\", \"filter\": %d}", i];
+        [self.store addQuery:[json dataUsingEncoding:NSUTF8StringEncoding]
+                   queryType:@"count"
+                  collection:@"c"
+                   projectID:projectID];
+    }
+    NSData *missing = [@"{\"event_collection\": \"c\"}" dataUsingEncoding:NSUTF8StringEncoding];
+
+    // The pre-flight check before each runQuery:, no longer a table scan behind a sweep
+    [self measureBlock:^{
+        for (int i = 0; i < 200; i++) {
+            [self.store hasQueryWithMaxAttempts:missing
+                                      queryType:@"count"
+                                     collection:@"c"
+                                      projectID:projectID
+                                    maxAttempts:3
+                                       queryTTL:3600];
+        }
+    }];
+}
+
 - (void)testRecoverFromCorruptDb {
     // Copy a canned corrupt db to the db path
     [self setUpCorruptDb];
@@ -436,8 +947,1415 @@
     XCTAssertTrue([self.store getPendingEventCountWithProjectID:projectID] == 0, @"0 pending events after init");
 }
 
+#pragma mark - Concurrent Read Methods
+
+- (void)testConcurrentReadsSeeEarlierWrites {
+    self.store = [[KIODBStore alloc] init];
+    self.store.concurrentReadsEnabled = YES;
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    }
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 3, @"3 total events");
+
+    // deleteEvent returns before the delete runs, the count still has to include it
+    NSNumber *eventId = [[[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"]
+        allKeys] firstObject];
+    [self.store deleteEvent:eventId];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 2, @"2 total events after delete");
+    XCTAssertEqual([self.store getPendingEventCountWithProjectID:projectID], 2, @"2 pending events after delete");
+
+    NSData *queryData = [@"query" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.store addQuery:queryData queryType:@"count" collection:@"foo" projectID:projectID];
+    XCTAssertNotNil([self.store getQuery:queryData queryType:@"count" collection:@"foo" projectID:projectID],
+                    @"query found");
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 1, @"1 total query");
+
+    [self.store deleteAllQueries];
+    XCTAssertNil([self.store getQuery:queryData queryType:@"count" collection:@"foo" projectID:projectID],
+                 @"query deleted");
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 0, @"0 total queries");
+}
+
+- (void)testConcurrentReadsDontWaitOnWrites {
+    self.store = [[KIODBStore alloc] init];
+    self.store.concurrentReadsEnabled = YES;
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 1, @"1 total event");
+
+    // Hold up the database queue, as a long write would
+    dispatch_semaphore_t writeDone = dispatch_semaphore_create(0);
+    dispatch_async(self.store.dbQueue, ^{
+        dispatch_semaphore_wait(writeDone, DISPATCH_TIME_FOREVER);
+    });
+
+    XCTestExpectation *readsDone = [self expectationWithDescription:@"reads finished while the queue was busy"];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 1, @"1 total event");
+        XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 0, @"0 total queries");
+        [readsDone fulfill];
+    });
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    dispatch_semaphore_signal(writeDone);
+}
+
+- (void)testUncachedEventCountsDontWaitOnWrites {
+    self.store = [[KIODBStore alloc] init];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    [self.store closeDB];
+
+    // A new store hasn't seeded its counts, so they're read from the read connection
+    self.store = [[KIODBStore alloc] init];
+    self.store.concurrentReadsEnabled = YES;
+    dispatch_semaphore_t writeDone = dispatch_semaphore_create(0);
+    dispatch_async(self.store.dbQueue, ^{
+        dispatch_semaphore_wait(writeDone, DISPATCH_TIME_FOREVER);
+    });
+
+    XCTestExpectation *readsDone = [self expectationWithDescription:@"counts read while the queue was busy"];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 1, @"1 total event");
+        XCTAssertEqual([self.store getPendingEventCountWithProjectID:projectID], 0, @"0 pending events");
+        XCTAssertEqual([self.store getTotalEventCountWithProjectID:@"otherpid"], 0, @"unknown project");
+        [readsDone fulfill];
+    });
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    dispatch_semaphore_signal(writeDone);
+}
+
+- (void)testConcurrentReadsNeedWAL {
+    self.store = [[KIODBStore alloc] init];
+    self.store.durability = KIODBStoreDurabilityStrict;
+    self.store.concurrentReadsEnabled = YES;
+
+    // Without WAL, reads go through the database queue and still work
+    NSData *queryData = [@"query" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.store addQuery:queryData queryType:@"count" collection:@"foo" projectID:projectID];
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 1, @"1 total query");
+
+    // Switching to WAL opens the read connection
+    self.store.durability = KIODBStoreDurabilityBalanced;
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 1, @"1 total query");
+}
+
+- (void)testReadLatencyWhileWritingSerial {
+    [self measureReadLatencyWhileWritingWithConcurrentReads:NO];
+}
+
+- (void)testReadLatencyWhileWritingConcurrent {
+    [self measureReadLatencyWhileWritingWithConcurrentReads:YES];
+}
+
+#pragma mark - Index Methods
+
+- (void)testHotPathStatementsUseIndexes {
+    self.store = [[KIODBStore alloc] init];
+
+    NSArray *statements = @[
+        @"SELECT events.id, collections.collection, eventData, pending FROM events LEFT JOIN collections ON "
+        @"collections.id=collectionKey WHERE projectKey=1 AND leaseExpiry<=0 AND attempts<3 ORDER BY events.id "
+        @"LIMIT 10",
+        @"UPDATE events SET leaseExpiry=0 WHERE leaseID=1",
+        @"SELECT count(*) FROM events WHERE projectKey=1",
+        @"SELECT count(*) FROM events WHERE pending=1 AND projectKey=1",
+        @"DELETE FROM events WHERE pending=1 AND projectKey=1",
+        @"SELECT id FROM projects WHERE projectID='pid'",
+        @"SELECT id FROM collections WHERE collection='foo'",
+        @"SELECT id FROM queries WHERE projectID='pid' AND collection='c' AND queryData=x'00' AND queryType='count'",
+        @"SELECT count(*) FROM events WHERE projectKey=1 AND collectionKey=1",
+        @"DELETE FROM events WHERE projectKey=1 AND collectionKey=1 AND id<=10",
+        @"SELECT id FROM queries INDEXED BY queries_queryHash WHERE projectID='pid' AND collection='c' AND "
+        @"queryData=x'00' AND queryType='count' AND queryHash=1",
+        @"DELETE FROM queries WHERE dateCreated <= datetime('now', '-3600 seconds')"
+    ];
+    for (NSString *sql in statements) {
+        NSString *plan = [self queryPlanForSQL:sql];
+        XCTAssertTrue([plan rangeOfString:@"USING"].location != NSNotFound, @"%@ uses an index: %@", sql, plan);
+    }
+
+    // Eviction reads a collection's oldest events straight off the index, without sorting
+    NSString *plan =
+        [self queryPlanForSQL:@"SELECT id, pending FROM events WHERE projectKey=1 AND collectionKey=1 ORDER BY id "
+                              @"LIMIT 10"];
+    XCTAssertTrue([plan rangeOfString:@"events_projectKey_collectionKey"].location != NSNotFound, @"%@", plan);
+    XCTAssertTrue([plan rangeOfString:@"TEMP B-TREE"].location == NSNotFound, @"%@", plan);
+}
+
+- (void)testQueryHashIgnoresKeyOrder {
+    NSData *query = [@"{\"event_collection\": \"c\", \"filters\": [{\"a\": 1, \"b\": \"x\"}]}"
+        dataUsingEncoding:NSUTF8StringEncoding];
+    NSData *reordered = [@"{\"filters\": [{\"b\": \"x\", \"a\": 1}], \"event_collection\": \"c\"}"
+        dataUsingEncoding:NSUTF8StringEncoding];
+    int64_t hash = [KIODBStore hashForQuery:query queryType:@"count" collection:@"c"];
+
+    XCTAssertEqual(hash, [KIODBStore hashForQuery:reordered queryType:@"count" collection:@"c"]);
+    XCTAssertNotEqual(hash, [KIODBStore hashForQuery:query queryType:@"sum" collection:@"c"]);
+    XCTAssertNotEqual(hash, [KIODBStore hashForQuery:query queryType:@"count" collection:@"d"]);
+}
+
+- (void)testQueryHashBackfill {
+    KIOQuery *query = [[KIOQuery alloc] initWithQuery:@"count" andPropertiesDictionary:@{@"event_collection": @"c"}];
+    NSData *queryData = [query convertQueryToData];
+
+    // A database from before any migration, with a failed query already stored
+    NSString *path = [self temporaryDatabasePath:@"unmigrated.sqlite"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:nil];
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_stmt *stmt = NULL;
+    keen_io_sqlite3_open([path UTF8String], &db);
+    keen_io_sqlite3_exec(db,
+                         "CREATE TABLE events (ID INTEGER PRIMARY KEY AUTOINCREMENT, collection TEXT, projectID TEXT, "
+                         "eventData BLOB, pending INTEGER, dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"
+                         "CREATE TABLE queries (ID INTEGER PRIMARY KEY AUTOINCREMENT, collection TEXT, projectID TEXT, "
+                         "queryData BLOB, queryType TEXT, attempts INTEGER DEFAULT 0, "
+                         "dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP);",
+                         NULL,
+                         NULL,
+                         NULL);
+    keen_io_sqlite3_prepare_v2(
+        db, "INSERT INTO queries (projectID, collection, queryData, queryType) VALUES ('pid', 'c', ?, 'count')", -1,
+        &stmt, NULL);
+    keen_io_sqlite3_bind_blob(stmt, 1, queryData.bytes, (int)queryData.length, SQLITE_TRANSIENT);
+    keen_io_sqlite3_step(stmt);
+    keen_io_sqlite3_finalize(stmt);
+    keen_io_sqlite3_close(db);
+
+    self.store = [[KIODBStore alloc] initWithDatabasePath:path options:nil];
+    XCTAssertNotNil([self.store getQuery:queryData queryType:@"count" collection:@"c" projectID:projectID],
+                    @"migration hashes the queries already stored");
+}
+
+- (void)testEventClaimSkipsEventsWithoutCollection {
+    NSString *path = [self temporaryDatabasePath:@"missingcollection.sqlite"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:nil];
+    self.store = [[KIODBStore alloc] initWithDatabasePath:path options:nil];
+    [self.store addEvent:[self typicalEvent:0] collection:@"foo" projectID:projectID];
+    [self.store addEvent:[self typicalEvent:1] collection:@"bar" projectID:projectID];
+    [self.store addEvent:[self typicalEvent:2] collection:@"foo" projectID:projectID];
+
+    // Lose the collection of the second event, so the claim's LEFT JOIN gives it a NULL collection.
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_open([path UTF8String], &db);
+    keen_io_sqlite3_exec(db, "DELETE FROM collections WHERE collection='bar';", NULL, NULL, NULL);
+    keen_io_sqlite3_close(db);
+
+    NSNumber *leaseID;
+    NSNumber *lastEventID;
+    KIOEventBatch *batch = [self.store claimEventBatchWithMaxAttempts:3
+                                                            projectID:projectID
+                                                         afterEventID:nil
+                                                            maxEvents:0
+                                                             maxBytes:0
+                                                        leaseDuration:60
+                                                              leaseID:&leaseID
+                                                          lastEventID:&lastEventID];
+    XCTAssertEqual(batch.count, 2, @"the event without a collection is skipped");
+    XCTAssertEqualObjects(batch.collections, (@[ @"foo" ]));
+    XCTAssertEqualObjects([batch eventDataAtIndex:1], [self typicalEvent:2], @"the events after it are claimed");
+
+    [self.store releaseLease:leaseID];
+    NSMutableDictionary *events = [self.store getEventsWithMaxAttempts:3 andProjectID:projectID];
+    XCTAssertEqualObjects(events.allKeys, (@[ @"foo" ]), @"the dictionary claim skips it too");
+    XCTAssertEqual([events[@"foo"] count], 2);
+}
+
+- (void)testLookupTableMigrationKeepsEvents {
+    // A database from before any migration, with events named by project and collection. The
+    // last event was already uploaded, so its id mustn't be handed out again.
+    NSString *path = [self temporaryDatabasePath:@"unmigrated.sqlite"];
+    [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+                              withIntermediateDirectories:YES
+                                               attributes:nil
+                                                    error:nil];
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_open([path UTF8String], &db);
+    keen_io_sqlite3_exec(db,
+                         "CREATE TABLE events (ID INTEGER PRIMARY KEY AUTOINCREMENT, collection TEXT, projectID TEXT, "
+                         "eventData BLOB, pending INTEGER, dateCreated TIMESTAMP DEFAULT CURRENT_TIMESTAMP);"
+                         "INSERT INTO events (projectID, collection, eventData, pending) VALUES "
+                         "('pid', 'foo', x'7b7d', 0), ('otherpid', 'foo', x'7b7d', 0), ('pid', 'bar', x'7b7d', 0), "
+                         "('pid', 'foo', x'7b7d', 0);"
+                         "DELETE FROM events WHERE ID=4;",
+                         NULL,
+                         NULL,
+                         NULL);
+    keen_io_sqlite3_close(db);
+
+    self.store = [[KIODBStore alloc] initWithDatabasePath:path options:nil];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 2);
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:@"otherpid"], 1);
+
+    [self.store addEvent:[self typicalEvent:0] collection:@"foo" projectID:projectID];
+    NSNumber *leaseID;
+    NSNumber *lastEventID;
+    KIOEventBatch *batch = [self.store claimEventBatchWithMaxAttempts:3
+                                                            projectID:projectID
+                                                         afterEventID:nil
+                                                            maxEvents:0
+                                                             maxBytes:0
+                                                        leaseDuration:60
+                                                              leaseID:&leaseID
+                                                          lastEventID:&lastEventID];
+    XCTAssertEqual(batch.count, 3);
+    XCTAssertEqual([batch eventIDAtIndex:0], 1, @"ids are kept");
+    XCTAssertEqual([batch eventIDAtIndex:1], 3, @"ids are kept");
+    XCTAssertEqual([batch eventIDAtIndex:2], 5, @"new ids continue past the last one ever used");
+    XCTAssertEqualObjects([batch collectionAtIndex:0], @"foo");
+    XCTAssertEqualObjects([batch collectionAtIndex:1], @"bar");
+    XCTAssertEqualObjects([batch collectionAtIndex:2], @"foo");
+    XCTAssertEqualObjects([batch eventDataAtIndex:0], [@"{}" dataUsingEncoding:NSUTF8StringEncoding]);
+}
+
+- (void)testQueryLookupPerformance5k {
+    self.store = [[KIODBStore alloc] init];
+    for (int i = 0; i < 5000; i++) {
+        NSString *json =
+            [NSString stringWithFormat:@"{\"event_collection\": \"c\", \"timeframe\": \"this_%d_days\"}", i];
+        [self.store addQuery:[json dataUsingEncoding:NSUTF8StringEncoding]
+                   queryType:@"count"
+                  collection:@"c"
+                   projectID:projectID];
+    }
+    NSData *missing = [@"{\"event_collection\": \"c\"}" dataUsingEncoding:NSUTF8StringEncoding];
+
+    // Each lookup is an index probe, however many failed queries are stored
+    [self measureBlock:^{
+        for (int i = 0; i < 200; i++) {
+            [self.store getQuery:missing queryType:@"count" collection:@"c" projectID:projectID];
+        }
+    }];
+}
+
+- (void)testEventCountPerformance1k {
+    [self measureEventCountsWithRows:1000];
+}
+
+- (void)testEventCountPerformance10k {
+    [self measureEventCountsWithRows:10000];
+}
+
+- (void)testEventCountPerformance100k {
+    [self measureEventCountsWithRows:100000];
+}
+
+- (void)testDeleteEventPerformance {
+    [self measureDeleteWithBulk:NO];
+}
+
+- (void)testDeleteEventsPerformance {
+    [self measureDeleteWithBulk:YES];
+}
+
+- (void)testClaimMemory10k {
+    [self measureClaimMemoryWithRows:10000];
+}
+
+- (void)testClaimMemory100k {
+    [self measureClaimMemoryWithRows:100000];
+}
+
+- (void)testClaimPerformanceDictionary {
+    [self measureClaimWithBatch:NO];
+}
+
+- (void)testClaimPerformanceBatch {
+    [self measureClaimWithBatch:YES];
+}
+
+- (void)testCollectionEvictionPerformance10k {
+    [self measureCollectionEvictionWithRows:10000];
+}
+
+- (void)testCollectionEvictionPerformance100k {
+    [self measureCollectionEvictionWithRows:100000];
+}
+
+- (void)testDeleteFromOffsetPerformance100k {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:100000];
+    __block int remaining = 100000;
+
+    // Each age out only walks the events it removes, not the ones being kept
+    [self measureBlock:^{
+        remaining -= 100;
+        [self.store deleteEventsFromOffset:@(remaining)];
+        [self.store getTotalEventCountWithProjectID:projectID];
+    }];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], remaining / 2);
+}
+
+- (void)testBytesUsedPerformance100k {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:100000];
+    [self.store getTotalBytesUsed];
+
+    // Once seeded, reading the bytes used doesn't scan, however many events are stored
+    [self measureBlock:^{
+        for (int i = 0; i < 100; i++) {
+            [self.store getBytesUsedWithProjectID:projectID];
+            [self.store getTotalBytesUsed];
+        }
+    }];
+}
+
+#pragma mark - Durability Methods
+
+- (void)testDurabilityProfileJournalMode {
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    NSString *walPath = [[self databaseFile] stringByAppendingString:@"-wal"];
+
+    self.store = [[KIODBStore alloc] init];
+    XCTAssertEqual(self.store.durability, KIODBStoreDurabilityBalanced, @"balanced is the default profile");
+    [self.store addEvent:[@"I AM AN EVENT" dataUsingEncoding:NSUTF8StringEncoding] collection:@"foo" projectID:projectID];
+    XCTAssertTrue([fileManager fileExistsAtPath:walPath], @"balanced profile writes through a WAL");
+
+    self.store.durability = KIODBStoreDurabilityStrict;
+    [self.store addEvent:[@"I AM AN EVENT" dataUsingEncoding:NSUTF8StringEncoding] collection:@"foo" projectID:projectID];
+    XCTAssertFalse([fileManager fileExistsAtPath:walPath], @"strict profile uses the rollback journal");
+    XCTAssertTrue([self.store getTotalEventCountWithProjectID:projectID] == 2, @"2 total events after switching");
+}
+
+- (void)testAddEventPerformanceStrict {
+    [self measureAddEventWithDurability:KIODBStoreDurabilityStrict];
+}
+
+- (void)testAddEventPerformanceBalanced {
+    [self measureAddEventWithDurability:KIODBStoreDurabilityBalanced];
+}
+
+- (void)testAddEventPerformanceRelaxed {
+    [self measureAddEventWithDurability:KIODBStoreDurabilityRelaxed];
+}
+
+- (void)testGetEventsPerformanceStrict {
+    [self measureGetEventsWithDurability:KIODBStoreDurabilityStrict];
+}
+
+- (void)testGetEventsPerformanceBalanced {
+    [self measureGetEventsWithDurability:KIODBStoreDurabilityBalanced];
+}
+
+- (void)testGetEventsPerformanceRelaxed {
+    [self measureGetEventsWithDurability:KIODBStoreDurabilityRelaxed];
+}
+
+#pragma mark - Compression Methods
+
+- (void)testCompressionRoundTrip {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self typicalEvent:0];
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+    self.store.compression = KIODBStoreCompressionDeflate;
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+    [self.store drainQueue];
+
+    XCTAssertTrue([self storedEventBytes] < event.length * 2, @"second event was stored compressed");
+    NSDictionary *events = [[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"];
+    XCTAssertTrue(events.count == 2, @"both events read back");
+    for (NSNumber *eventId in events) {
+        XCTAssertEqualObjects(events[eventId], event, @"event data survives compression");
+    }
+}
+
+- (void)testCompressionDictionary {
+    self.store = [[KIODBStore alloc] init];
+    self.store.compression = KIODBStoreCompressionDeflate;
+    self.store.compressionDictionary = [self typicalEvent:0];
+    NSData *event = [self typicalEvent:1];
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+
+    NSDictionary *events = [[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"];
+    XCTAssertEqualObjects([[events allValues] firstObject], event, @"event data survives dictionary compression");
+
+    // The old dictionary stays registered, so events written with it are still readable.
+    self.store.compressionDictionary = [self typicalEvent:2];
+    NSData *otherEvent = [self typicalEvent:3];
+    [self.store addEvent:otherEvent collection:@"foo" projectID:projectID];
+    self.store.compressionDictionary = nil;
+
+    events = [[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"];
+    XCTAssertEqual(events.count, 2, @"events from both dictionaries read back");
+    XCTAssertTrue([[events allValues] containsObject:event]);
+    XCTAssertTrue([[events allValues] containsObject:otherEvent]);
+}
+
+- (void)testEventWithUnregisteredDictionaryIsKept {
+    NSString *path = [self temporaryDatabasePath:@"dictionary.sqlite"];
+    NSData *dictionary = [self typicalEvent:0];
+    NSData *event = [self typicalEvent:1];
+    self.store = [[KIODBStore alloc] initWithDatabasePath:path options:nil];
+    self.store.compression = KIODBStoreCompressionDeflate;
+    self.store.compressionDictionary = dictionary;
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+    [self.store drainQueue];
+    [self.store closeDB];
+
+    // A later launch that doesn't know the dictionary skips the event, but doesn't delete it.
+    self.store = [[KIODBStore alloc] initWithDatabasePath:path options:nil];
+    XCTAssertEqual([[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] count], 0, @"nothing readable");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 1, @"undecodable event was kept");
+
+    [self.store addDecompressionDictionary:dictionary];
+    NSDictionary *events = [[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"];
+    XCTAssertEqualObjects([[events allValues] firstObject], event, @"readable once its dictionary is registered");
+}
+
+- (void)testCompressionPerformanceNone {
+    [self measureCompression:KIODBStoreCompressionNone withDictionary:NO];
+}
+
+- (void)testCompressionPerformanceDeflate {
+    [self measureCompression:KIODBStoreCompressionDeflate withDictionary:NO];
+}
+
+- (void)testCompressionPerformanceDeflateWithDictionary {
+    [self measureCompression:KIODBStoreCompressionDeflate withDictionary:YES];
+}
+
+#pragma mark - Group Commit Methods
+
+- (void)testGroupCommitCountsSeeQueuedEvents {
+    self.store = [[KIODBStore alloc] init];
+    self.store.groupCommitEnabled = YES;
+    self.store.groupCommitInterval = 60;
+    for (int i = 0; i < 3; i++) {
+        XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID]);
+    }
+
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 3, @"counts flush queued events");
+    XCTAssertEqual([self eventRowsOnDisk], 3, @"queued events were committed");
+    XCTAssertEqual([[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] count], 1, @"one collection");
+}
+
+- (void)testGroupCommitWritesAfterInterval {
+    self.store = [[KIODBStore alloc] init];
+    self.store.groupCommitEnabled = YES;
+    self.store.groupCommitInterval = 0.05;
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    // Nothing forces a write here, so the row only shows up once the interval passes.
+    XCTAssertTrue([self waitForEventRowsOnDisk:1], @"queued event was committed after the interval");
+}
+
+- (void)testGroupCommitWritesWhenBatchIsFull {
+    self.store = [[KIODBStore alloc] init];
+    self.store.groupCommitEnabled = YES;
+    self.store.groupCommitBatchSize = 4;
+    self.store.groupCommitInterval = 60;
+    for (int i = 0; i < 4; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    }
+
+    XCTAssertTrue([self waitForEventRowsOnDisk:4], @"full batch was committed without a flush");
+}
+
+- (void)testGroupCommitPerformance1Producer {
+    [self measureGroupCommitWithProducers:1];
+}
+
+- (void)testGroupCommitPerformance4Producers {
+    [self measureGroupCommitWithProducers:4];
+}
+
+- (void)testGroupCommitPerformance16Producers {
+    [self measureGroupCommitWithProducers:16];
+}
+
+#pragma mark - SQLite Configuration Methods
+
+- (void)testPageSizeOption {
+    self.store = [[KIODBStore alloc] initWithDatabasePath:[self databaseFile]
+                                                  options:@{kKIODBStoreOptionPageSize: @8192}];
+    XCTAssertEqual(self.store.pageSize, 8192);
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA page_size;"], 8192, @"new database uses the page size");
+}
+
+- (void)testMmapSizeOption {
+    self.store = [[KIODBStore alloc] initWithDatabasePath:[self databaseFile]
+                                                  options:@{
+                                                      kKIODBStoreOptionMmapSize: @(64 * 1024 * 1024),
+                                                      kKIODBStoreOptionConcurrentReads: @YES
+                                                  }];
+    XCTAssertEqual(self.store.mmapSize, 64ULL * 1024 * 1024);
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    }
+    XCTAssertEqual([[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"] count], 3);
+}
+
+- (void)testReopeningKeepsOtherStoresWorking {
+    // SQLite used to be shut down and reconfigured on every open, under any other open connection
+    self.store = [[KIODBStore alloc] init];
+    KIODBStore *otherStore = [[KIODBStore alloc] initInMemory];
+    [otherStore addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    [self.store closeDB];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    XCTAssertEqual([otherStore getTotalEventCountWithProjectID:projectID], 1);
+    XCTAssertTrue([otherStore addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID]);
+    [otherStore closeDB];
+}
+
+- (void)testAddEventPerformanceWithMmap {
+    [self measureAddEventWithOptions:@{kKIODBStoreOptionMmapSize: @(64 * 1024 * 1024)}];
+}
+
+- (void)testAddEventPerformanceWith16KPages {
+    // Pages past the page cache slot size are allocated with malloc
+    [self measureAddEventWithOptions:@{kKIODBStoreOptionPageSize: @16384}];
+}
+
+- (void)testReopenPerformance {
+    self.store = [[KIODBStore alloc] init];
+
+    // Reopening after a failure used to reinitialize SQLite as well
+    [self measureBlock:^{
+        for (int i = 0; i < 20; i++) {
+            [self.store closeDB];
+            [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+        }
+    }];
+}
+
+#pragma mark - Warm-Up Methods
+
+- (KIODBStore *)warmingUpStore {
+    return [[KIODBStore alloc] initWithDatabasePath:[self databaseFile]
+                                            options:@{kKIODBStoreOptionAsyncWarmUp: @YES}];
+}
+
+- (void)waitUntilReady:(KIODBStore *)store {
+    XCTestExpectation *ready = [self expectationWithDescription:@"store is ready"];
+    [store whenReady:^(BOOL opened) {
+        XCTAssertTrue(opened);
+        [ready fulfill];
+    }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+}
+
+- (void)testSynchronousStoreIsReadyAfterInit {
+    self.store = [[KIODBStore alloc] init];
+    XCTAssertTrue(self.store.isReady);
+    [self waitUntilReady:self.store];
+}
+
+- (void)testAsyncWarmUpWritesEarlyEvents {
+    self.store = [self warmingUpStore];
+    for (int i = 0; i < 3; i++) {
+        XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID]);
+    }
+
+    // Reads wait for the open, and see the events that were held while it ran
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 3);
+    XCTAssertTrue(self.store.isReady);
+    XCTAssertGreaterThan(self.store.openDuration, 0);
+}
+
+- (void)testAsyncWarmUpKeepsEventOrder {
+    self.store = [self warmingUpStore];
+    [self.store addEvent:[self benchmarkEvent] collection:@"first" projectID:projectID];
+    [self waitUntilReady:self.store];
+    [self.store addEvent:[self benchmarkEvent] collection:@"second" projectID:projectID];
+
+    NSNumber *leaseID;
+    NSNumber *lastEventID;
+    KIOEventBatch *batch = [self.store claimEventBatchWithMaxAttempts:3
+                                                            projectID:projectID
+                                                         afterEventID:nil
+                                                            maxEvents:1
+                                                             maxBytes:0
+                                                        leaseDuration:60
+                                                              leaseID:&leaseID
+                                                          lastEventID:&lastEventID];
+    XCTAssertEqualObjects([batch collectionAtIndex:0], @"first", @"held events are written before later ones");
+}
+
+- (void)testAsyncWarmUpReadyCallback {
+    self.store = [self warmingUpStore];
+    [self waitUntilReady:self.store];
+    XCTAssertTrue(self.store.isReady);
+
+    // Once ready the block is still called, straight away
+    [self waitUntilReady:self.store];
+}
+
+- (void)testAsyncInitPerformance {
+    // An existing database, so this measures a warm start rather than creating the tables
+    [[[KIODBStore alloc] init] closeDB];
+
+    // Only the time init blocks the caller, which leaves out the open
+    [self measureMetrics:[[self class] defaultPerformanceMetrics]
+        automaticallyStartMeasuring:NO
+                           forBlock:^{
+                               [self startMeasuring];
+                               KIODBStore *store = [self warmingUpStore];
+                               [self stopMeasuring];
+                               // Reads wait for the open to finish before it's closed
+                               [store getTotalEventCountWithProjectID:projectID];
+                               [store closeDB];
+                           }];
+}
+
+#pragma mark - Statement Cache Methods
+
+- (void)testStatementsArePreparedOnFirstUse {
+    self.store = [[KIODBStore alloc] init];
+    XCTAssertEqual(self.store.preparedStatementCount, 0, @"opening doesn't prepare anything");
+
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    NSUInteger preparedAfterAdd = self.store.preparedStatementCount;
+    XCTAssertGreaterThan(preparedAfterAdd, 0);
+
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    XCTAssertEqual(self.store.preparedStatementCount, preparedAfterAdd, @"statements are reused");
+
+    [self.store closeDB];
+    XCTAssertEqual(self.store.preparedStatementCount, 0, @"closing finalizes the cache");
+
+    XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID]);
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 3, @"prepared again after reopening");
+}
+
+- (void)testStartupMetrics {
+    self.store = [[KIODBStore alloc] init];
+    XCTAssertGreaterThan(self.store.openDuration, 0);
+    XCTAssertEqual(self.store.timeToFirstEvent, 0, @"no event written yet");
+
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    NSTimeInterval timeToFirstEvent = self.store.timeToFirstEvent;
+    XCTAssertGreaterThanOrEqual(timeToFirstEvent, self.store.openDuration);
+
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    XCTAssertEqual(self.store.timeToFirstEvent, timeToFirstEvent, @"only the first event is timed");
+}
+
+- (void)testOpenPerformance {
+    // An existing database, so this measures a warm start rather than creating the tables
+    [[[KIODBStore alloc] init] closeDB];
+
+    [self measureBlock:^{
+        KIODBStore *store = [[KIODBStore alloc] init];
+        [store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+        [store closeDB];
+    }];
+}
+
+#pragma mark - Custom Path Methods
+
+- (void)testCustomPathStoresAreIndependent {
+    NSString *firstPath = [self temporaryDatabasePath:@"first/keenEvents.sqlite"];
+    NSString *secondPath = [self temporaryDatabasePath:@"second/keenEvents.sqlite"];
+    self.store = [[KIODBStore alloc] initWithDatabasePath:firstPath options:nil];
+    KIODBStore *secondStore = [[KIODBStore alloc] initWithDatabasePath:secondPath options:nil];
+    XCTAssertEqualObjects(self.store.databasePath, firstPath);
+
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 1);
+    XCTAssertEqual([secondStore getTotalEventCountWithProjectID:projectID], 0, @"each store has its own database");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:firstPath], @"directory and file were created");
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:secondPath]);
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[self databaseFile]], @"shared file untouched");
+
+    [secondStore closeDB];
+}
+
+- (void)testCustomPathOptions {
+    NSString *path = [self temporaryDatabasePath:@"options.sqlite"];
+    self.store = [[KIODBStore alloc] initWithDatabasePath:path
+                                                  options:@{
+                                                      kKIODBStoreOptionDurability: @(KIODBStoreDurabilityStrict),
+                                                      kKIODBStoreOptionGroupCommit: @YES,
+                                                      kKIODBStoreOptionCompression: @(KIODBStoreCompressionDeflate)
+                                                  }];
+    XCTAssertEqual(self.store.durability, KIODBStoreDurabilityStrict);
+    XCTAssertTrue(self.store.groupCommitEnabled);
+    XCTAssertEqual(self.store.compression, KIODBStoreCompressionDeflate);
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[path stringByAppendingString:@"-wal"]],
+                   @"opened with the strict profile's rollback journal from the start");
+}
+
+#pragma mark - In-Memory Methods
+
+- (void)testInMemoryStore {
+    self.store = [[KIODBStore alloc] initInMemory];
+    XCTAssertTrue(self.store.inMemory);
+    for (int i = 0; i < 3; i++) {
+        XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID]);
+    }
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 3);
+    XCTAssertEqual([[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID] objectForKey:@"foo"] count], 3);
+    XCTAssertFalse([[NSFileManager defaultManager] fileExistsAtPath:[self databaseFile]], @"nothing written to disk");
+}
+
+- (void)testInMemoryStoresAreSeparate {
+    self.store = [[KIODBStore alloc] initInMemory];
+    KIODBStore *otherStore = [[KIODBStore alloc] initInMemory];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    XCTAssertEqual([otherStore getTotalEventCountWithProjectID:projectID], 0, @"each store has its own database");
+    [otherStore closeDB];
+}
+
+- (void)testInMemoryStoreSkipsReadConnection {
+    self.store = [[KIODBStore alloc] initInMemory];
+    self.store.concurrentReadsEnabled = YES;
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    [self.store addQuery:[@"{}" dataUsingEncoding:NSUTF8StringEncoding]
+               queryType:@"count"
+              collection:@"foo"
+               projectID:projectID];
+
+    XCTAssertEqual([self.store getTotalQueryCountWithProjectID:projectID], 1, @"reads see the in-memory database");
+}
+
+- (void)testAddEventPerformanceInMemory {
+    self.store = [[KIODBStore alloc] initInMemory];
+    NSData *event = [self benchmarkEvent];
+
+    // Same workload as the durability benchmarks, without any disk I/O
+    [self measureBlock:^{
+        for (int i = 0; i < 200; i++) {
+            [self.store addEvent:event collection:@"foo" projectID:projectID];
+        }
+    }];
+}
+
+#pragma mark - Maintenance Methods
+
+- (void)testNewDatabaseUsesIncrementalAutoVacuum {
+    self.store = [[KIODBStore alloc] init];
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA auto_vacuum;"], 2, @"new databases use incremental vacuum");
+}
+
+- (void)testMaintenanceReclaimsPages {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:2000];
+    [self.store deleteAllEvents];
+    [self.store drainQueue];
+    long long freePages = [self pragmaValueOnDisk:"PRAGMA freelist_count;"];
+    XCTAssertGreaterThan(freePages, 0, @"deleted events leave free pages behind");
+
+    self.store.maintenancePagesPerRun = 1000000;
+    [self.store performMaintenance];
+    XCTAssertEqual(self.store.maintenanceRunCount, 1);
+    XCTAssertEqual((long long)self.store.maintenancePagesReclaimed, freePages, @"every free page was reclaimed");
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA freelist_count;"], 0, @"no free pages left");
+}
+
+- (void)testMaintenanceIsBoundedPerRun {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:2000];
+    [self.store deleteAllEvents];
+    [self.store drainQueue];
+    long long freePages = [self pragmaValueOnDisk:"PRAGMA freelist_count;"];
+    XCTAssertGreaterThan(freePages, 4);
+
+    self.store.maintenancePagesPerRun = 4;
+    [self.store performMaintenance];
+    XCTAssertEqual(self.store.maintenancePagesReclaimed, 4, @"only pagesPerRun pages were reclaimed");
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA freelist_count;"], freePages - 4);
+
+    // 0 would mean every free page to SQLite
+    self.store.maintenancePagesPerRun = 0;
+    [self.store performMaintenance];
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA freelist_count;"], freePages - 5);
+}
+
+- (void)testMaintenanceConvertsExistingDatabase {
+    // A table created before the store opens the file means it can't pick auto_vacuum itself
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_open([[self databaseFile] UTF8String], &db);
+    keen_io_sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS old (x);", NULL, NULL, NULL);
+    keen_io_sqlite3_close(db);
+
+    self.store = [[KIODBStore alloc] init];
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA auto_vacuum;"], 0, @"existing database has no auto_vacuum");
+    [self insertEventRows:2000];
+    [self.store deleteAllEvents];
+    [self.store drainQueue];
+
+    [self.store performMaintenance];
+    XCTAssertGreaterThan(self.store.maintenancePagesReclaimed, 0, @"rebuilding reclaimed the free pages");
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA auto_vacuum;"], 2, @"database now uses incremental vacuum");
+}
+
+- (void)testIdleMaintenanceDoesntConvertExistingDatabase {
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_open([[self databaseFile] UTF8String], &db);
+    keen_io_sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS old (x);", NULL, NULL, NULL);
+    keen_io_sqlite3_close(db);
+
+    self.store = [[KIODBStore alloc] init];
+    self.store.maintenanceIdleInterval = 0.1;
+    [self insertEventRows:2000];
+    [self.store deleteAllEvents];
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5];
+    while (self.store.maintenanceRunCount == 0 && [deadline timeIntervalSinceNow] > 0) {
+        [NSThread sleepForTimeInterval:0.01];
+    }
+    XCTAssertEqual(self.store.maintenanceRunCount, 1, @"maintenance ran once the store went idle");
+    XCTAssertEqual(self.store.maintenancePagesReclaimed, 0, @"without rebuilding the database");
+    XCTAssertEqual([self pragmaValueOnDisk:"PRAGMA auto_vacuum;"], 0);
+}
+
+- (void)testMaintenanceRunsWhenIdle {
+    self.store = [[KIODBStore alloc] init];
+    self.store.maintenanceIdleInterval = 0.1;
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5];
+    while (self.store.maintenanceRunCount == 0 && [deadline timeIntervalSinceNow] > 0) {
+        [NSThread sleepForTimeInterval:0.01];
+    }
+    XCTAssertEqual(self.store.maintenanceRunCount, 1, @"maintenance ran once the store went idle");
+    XCTAssertGreaterThan(self.store.maintenanceTimeSpent, 0);
+}
+
+- (void)testMaintenanceDisabled {
+    self.store = [[KIODBStore alloc] init];
+    self.store.maintenanceEnabled = NO;
+    self.store.maintenanceIdleInterval = 0.1;
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    [NSThread sleepForTimeInterval:0.5];
+    XCTAssertEqual(self.store.maintenanceRunCount, 0, @"maintenance doesn't run when disabled");
+}
+
+#pragma mark - Async Add Methods
+
+- (void)testAsyncAddEventReportsStored {
+    self.store = [[KIODBStore alloc] init];
+    dispatch_queue_t completionQueue = dispatch_queue_create("io.keen.test", DISPATCH_QUEUE_SERIAL);
+    XCTestExpectation *stored = [self expectationWithDescription:@"event stored"];
+    [self.store addEvent:[self benchmarkEvent]
+               collection:@"foo"
+                projectID:projectID
+          completionQueue:completionQueue
+        completionHandler:^(BOOL wasStored) {
+            XCTAssertTrue(wasStored);
+            XCTAssertEqual(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), "io.keen.test"), 0);
+            [stored fulfill];
+        }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], 1);
+}
+
+- (void)testAsyncAddEventReportsDroppedEvent {
+    self.store = [[KIODBStore alloc] init];
+    NSData *event = [self benchmarkEvent];
+    self.store.maxBytesPerProject = event.length - 1;
+    XCTestExpectation *dropped = [self expectationWithDescription:@"oversized event dropped"];
+    [self.store addEvent:event
+               collection:@"foo"
+                projectID:projectID
+          completionQueue:nil
+        completionHandler:^(BOOL wasStored) {
+            XCTAssertFalse(wasStored);
+            XCTAssertTrue([NSThread isMainThread]);
+            [dropped fulfill];
+        }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+}
+
+- (void)testAsyncAddEventWithGroupCommitReportsOnceWritten {
+    self.store = [[KIODBStore alloc] init];
+    self.store.groupCommitEnabled = YES;
+    self.store.groupCommitInterval = 0.05;
+    XCTestExpectation *stored = [self expectationWithDescription:@"batch written"];
+    [self.store addEvent:[self benchmarkEvent]
+               collection:@"foo"
+                projectID:projectID
+          completionQueue:nil
+        completionHandler:^(BOOL wasStored) {
+            XCTAssertTrue(wasStored);
+            XCTAssertEqual([self eventRowsOnDisk], 1, @"reported after the row was committed");
+            [stored fulfill];
+        }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+}
+
+- (void)testAddEventCallerLatencySync {
+    [self measureAddEventCallerLatencyAsync:NO];
+}
+
+- (void)testAddEventCallerLatencyAsync {
+    [self measureAddEventCallerLatencyAsync:YES];
+}
+
+#pragma mark - Profiling Methods
+
+- (void)testProfilingOffByDefault {
+    self.store = [[KIODBStore alloc] init];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    NSDictionary *snapshot = [self.store profileSnapshot];
+    XCTAssertEqual([snapshot[kKIODBStoreProfileStatements] count], 0);
+    XCTAssertEqualObjects(snapshot[kKIODBStoreProfileQueueWait][kKIODBStoreProfileCount], @0);
+}
+
+- (void)testProfilingTimesStatementsAndQueue {
+    self.store = [[KIODBStore alloc] initWithDatabasePath:[self databaseFile]
+                                                  options:@{kKIODBStoreOptionProfiling: @YES}];
+    [self.store resetProfile];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+
+    NSDictionary *snapshot = [self.store profileSnapshot];
+    NSDictionary *insertTimings = nil;
+    for (NSString *sql in snapshot[kKIODBStoreProfileStatements]) {
+        if ([sql hasPrefix:@"INSERT INTO events"]) {
+            insertTimings = snapshot[kKIODBStoreProfileStatements][sql];
+        }
+    }
+    XCTAssertEqualObjects(insertTimings[kKIODBStoreProfileCount], @2, @"each insert is timed");
+    XCTAssertEqual([insertTimings[kKIODBStoreProfileHistogram] count], [KIODBStore profileHistogramBounds].count + 1);
+
+    NSDictionary *queueWait = snapshot[kKIODBStoreProfileQueueWait];
+    XCTAssertGreaterThanOrEqual([queueWait[kKIODBStoreProfileCount] intValue], 2);
+    XCTAssertEqualObjects([queueWait[kKIODBStoreProfileHistogram] valueForKeyPath:@"@sum.self"],
+                          queueWait[kKIODBStoreProfileCount]);
+
+    // Turning it off stops the timings without dropping them
+    self.store.profilingEnabled = NO;
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:projectID];
+    XCTAssertEqualObjects([self.store profileSnapshot][kKIODBStoreProfileQueueWait], queueWait);
+
+    [self.store resetProfile];
+    XCTAssertEqual([[self.store profileSnapshot][kKIODBStoreProfileStatements] count], 0);
+}
+
+- (void)testAddEventPerformanceProfiled {
+    // Compare with testAddEventPerformanceBalanced for the cost of profiling
+    [self measureAddEventWithOptions:@{kKIODBStoreOptionProfiling: @YES}];
+}
+
 #pragma mark - Helper Methods
 
+- (NSData *)benchmarkEvent {
+    return [@"{\"keen\":{\"timestamp\":\"2017-06-26T12:00:00.000Z\"},\"screen\":\"home\",\"user_id\":42}"
+        dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (NSString *)queryPlanForSQL:(NSString *)sql {
+    // Use a separate connection so the plan reflects the schema on disk
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_stmt *stmt = NULL;
+    NSMutableString *plan = [NSMutableString string];
+    keen_io_sqlite3_open([[self databaseFile] UTF8String], &db);
+    NSString *explain = [@"EXPLAIN QUERY PLAN " stringByAppendingString:sql];
+    if (keen_io_sqlite3_prepare_v2(db, [explain UTF8String], -1, &stmt, NULL) == SQLITE_OK) {
+        while (keen_io_sqlite3_step(stmt) == SQLITE_ROW) {
+            [plan appendFormat:@"%s\n", (char *)keen_io_sqlite3_column_text(stmt, 3)];
+        }
+    }
+    keen_io_sqlite3_finalize(stmt);
+    keen_io_sqlite3_close(db);
+    return plan;
+}
+
+- (void)insertEventRows:(int)rowCount {
+    // Bulk load through a separate connection in one transaction, split over two projects
+    // so that per-project lookups have rows to skip.
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_stmt *stmt = NULL;
+    keen_io_sqlite3_open([[self databaseFile] UTF8String], &db);
+    keen_io_sqlite3_exec(db,
+                         "BEGIN IMMEDIATE TRANSACTION;"
+                         "INSERT OR IGNORE INTO projects (projectID) VALUES ('pid'), ('otherpid');"
+                         "INSERT OR IGNORE INTO collections (collection) VALUES ('foo');",
+                         NULL,
+                         NULL,
+                         NULL);
+    keen_io_sqlite3_prepare_v2(db,
+                               "INSERT INTO events (projectKey, collectionKey, eventData, pending, attempts) VALUES "
+                               "((SELECT id FROM projects WHERE projectID=?), "
+                               "(SELECT id FROM collections WHERE collection='foo'), ?, ?, 0)",
+                               -1,
+                               &stmt,
+                               NULL);
+    NSData *event = [self benchmarkEvent];
+    for (int i = 0; i < rowCount; i++) {
+        keen_io_sqlite3_bind_text(stmt, 1, i % 2 ? "otherpid" : "pid", -1, SQLITE_STATIC);
+        keen_io_sqlite3_bind_blob(stmt, 2, [event bytes], (int)[event length], SQLITE_STATIC);
+        keen_io_sqlite3_bind_int(stmt, 3, i % 10 == 0);
+        keen_io_sqlite3_step(stmt);
+        keen_io_sqlite3_reset(stmt);
+    }
+    keen_io_sqlite3_finalize(stmt);
+    keen_io_sqlite3_exec(db, "COMMIT TRANSACTION;", NULL, NULL, NULL);
+    keen_io_sqlite3_close(db);
+}
+
+- (void)measureEventCountsWithRows:(int)rowCount {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:rowCount];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], rowCount / 2);
+
+    [self measureBlock:^{
+        for (int i = 0; i < 100; i++) {
+            [self.store getTotalEventCountWithProjectID:projectID];
+            [self.store getPendingEventCountWithProjectID:projectID];
+        }
+    }];
+}
+
+- (void)measureDeleteWithBulk:(BOOL)bulk {
+    self.store = [[KIODBStore alloc] init];
+
+    // Deletes 5000 events per iteration, the way an upload of that many would
+    [self measureMetrics:[[self class] defaultPerformanceMetrics]
+        automaticallyStartMeasuring:NO
+                           forBlock:^{
+                               [self insertEventRows:10000];
+                               NSArray *eventIds = [[[self.store getEventsWithMaxAttempts:3 andProjectID:projectID]
+                                   objectForKey:@"foo"] allKeys];
+
+                               [self startMeasuring];
+                               if (bulk) {
+                                   [self.store deleteEvents:eventIds];
+                               } else {
+                                   for (NSNumber *eventId in eventIds) {
+                                       [self.store deleteEvent:eventId];
+                                   }
+                               }
+                               [self.store drainQueue];
+                               [self stopMeasuring];
+                           }];
+}
+
+- (void)measureClaimMemoryWithRows:(int)rowCount {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:rowCount];
+
+    // Memory held by the claimed events: everything at once, then a single upload sized page
+    size_t allBytes = [self bytesHeldByClaim:^id {
+        return [self.store getEventsWithMaxAttempts:3 andProjectID:projectID];
+    }];
+    size_t pageBytes = [self bytesHeldByClaim:^id {
+        return [self.store claimEventsWithMaxAttempts:3
+                                            projectID:projectID
+                                         afterEventID:nil
+                                            maxEvents:500
+                                             maxBytes:256 * 1024
+                                        leaseDuration:0
+                                              leaseID:NULL
+                                          lastEventID:NULL];
+    }];
+    size_t batchBytes = [self bytesHeldByClaim:^id {
+        return [self.store claimEventBatchWithMaxAttempts:3
+                                                projectID:projectID
+                                             afterEventID:nil
+                                                maxEvents:500
+                                                 maxBytes:256 * 1024
+                                            leaseDuration:0
+                                                  leaseID:NULL
+                                              lastEventID:NULL];
+    }];
+    NSLog(@"%d stored events: %zu bytes claimed at once, %zu bytes per page, %zu bytes per batch",
+          rowCount,
+          allBytes,
+          pageBytes,
+          batchBytes);
+    XCTAssertTrue(pageBytes < allBytes, @"a page holds less than the whole store");
+}
+
+- (void)measureCollectionEvictionWithRows:(int)rowCount {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:rowCount];
+    NSData *event = [self benchmarkEvent];
+
+    // The collection starts full, so each of the 200 adds per iteration evicts the oldest event
+    self.store.maxEventsPerCollection = [self.store getEventCountWithProjectID:projectID collection:@"foo"];
+    [self measureBlock:^{
+        for (int i = 0; i < 200; i++) {
+            [self.store addEvent:event collection:@"foo" projectID:projectID];
+        }
+    }];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:projectID], rowCount / 2, @"collection stayed full");
+}
+
+- (void)measureClaimWithBatch:(BOOL)batch {
+    self.store = [[KIODBStore alloc] init];
+    [self insertEventRows:10000];
+
+    // Claims the 5000 events in the project as one page per iteration. Zero length
+    // leases leave them claimable by the next iteration.
+    [self measureBlock:^{
+        @autoreleasepool {
+            if (batch) {
+                [self.store claimEventBatchWithMaxAttempts:3
+                                                 projectID:projectID
+                                              afterEventID:nil
+                                                 maxEvents:0
+                                                  maxBytes:0
+                                             leaseDuration:0
+                                                   leaseID:NULL
+                                               lastEventID:NULL];
+            } else {
+                [self.store claimEventsWithMaxAttempts:3
+                                             projectID:projectID
+                                          afterEventID:nil
+                                             maxEvents:0
+                                              maxBytes:0
+                                         leaseDuration:0
+                                               leaseID:NULL
+                                           lastEventID:NULL];
+            }
+        }
+    }];
+}
+
+- (size_t)bytesHeldByClaim:(id (^)(void))claim {
+    malloc_statistics_t before, after;
+    id events;
+    @autoreleasepool {
+        malloc_zone_statistics(NULL, &before);
+        events = claim();
+    }
+    malloc_zone_statistics(NULL, &after);
+    events = nil;
+    return after.size_in_use > before.size_in_use ? after.size_in_use - before.size_in_use : 0;
+}
+
+- (void)measureAddEventWithDurability:(KIODBStoreDurability)durability {
+    self.store = [[KIODBStore alloc] init];
+    self.store.durability = durability;
+    NSData *event = [self benchmarkEvent];
+
+    // 200 inserts per iteration, so inserts/sec is 200 / the reported average
+    [self measureBlock:^{
+        for (int i = 0; i < 200; i++) {
+            [self.store addEvent:event collection:@"foo" projectID:projectID];
+        }
+    }];
+}
+
+- (void)measureAddEventWithOptions:(NSDictionary *)options {
+    self.store = [[KIODBStore alloc] initWithDatabasePath:[self databaseFile] options:options];
+    NSData *event = [self benchmarkEvent];
+
+    // Same workload as the durability benchmarks
+    [self measureBlock:^{
+        for (int i = 0; i < 200; i++) {
+            [self.store addEvent:event collection:@"foo" projectID:projectID];
+        }
+    }];
+}
+
+- (void)measureGetEventsWithDurability:(KIODBStoreDurability)durability {
+    self.store = [[KIODBStore alloc] init];
+    self.store.durability = durability;
+    NSData *event = [self benchmarkEvent];
+    for (int i = 0; i < 500; i++) {
+        [self.store addEvent:event collection:@"foo" projectID:projectID];
+    }
+
+    // Claims all 500 events for upload, resetting the ones claimed by the previous iteration
+    [self measureBlock:^{
+        [self.store getEventsWithMaxAttempts:3 andProjectID:projectID];
+    }];
+}
+
+- (void)measureReadLatencyWhileWritingWithConcurrentReads:(BOOL)concurrentReads {
+    self.store = [[KIODBStore alloc] init];
+    self.store.concurrentReadsEnabled = concurrentReads;
+    NSData *event = [self benchmarkEvent];
+    NSData *queryData = [@"query" dataUsingEncoding:NSUTF8StringEncoding];
+    [self.store addEvent:event collection:@"foo" projectID:projectID];
+    [self.store getTotalEventCountWithProjectID:projectID];
+
+    // A writer adds events in small transactions the whole time the counts are read
+    __block BOOL isWriting = YES;
+    dispatch_group_t writer = dispatch_group_create();
+    dispatch_group_async(writer, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        while (isWriting) {
+            [self.store addEvent:event collection:@"foo" projectID:projectID];
+            [self.store addQuery:queryData queryType:@"count" collection:@"foo" projectID:projectID];
+        }
+    });
+
+    // 200 reads of each kind per iteration, reporting the latency percentiles of event counts and
+    // query lookups separately
+    [self measureBlock:^{
+        NSMutableArray *countLatencies = [NSMutableArray array];
+        NSMutableArray *queryLatencies = [NSMutableArray array];
+        for (int i = 0; i < 200; i++) {
+            CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+            [self.store getTotalEventCountWithProjectID:projectID];
+            [self.store getPendingEventCountWithProjectID:projectID];
+            CFAbsoluteTime countEnd = CFAbsoluteTimeGetCurrent();
+            [self.store getTotalQueryCountWithProjectID:projectID];
+            [self.store getQuery:queryData queryType:@"count" collection:@"foo" projectID:projectID];
+            [countLatencies addObject:@(countEnd - start)];
+            [queryLatencies addObject:@(CFAbsoluteTimeGetCurrent() - countEnd)];
+        }
+        [countLatencies sortUsingSelector:@selector(compare:)];
+        [queryLatencies sortUsingSelector:@selector(compare:)];
+        NSLog(@"Event count latency while writing: p50 %.3fms, p99 %.3fms",
+              [countLatencies[countLatencies.count / 2] doubleValue] * 1000,
+              [countLatencies[countLatencies.count * 99 / 100] doubleValue] * 1000);
+        NSLog(@"Query read latency while writing: p50 %.3fms, p99 %.3fms",
+              [queryLatencies[queryLatencies.count / 2] doubleValue] * 1000,
+              [queryLatencies[queryLatencies.count * 99 / 100] doubleValue] * 1000);
+    }];
+
+    isWriting = NO;
+    dispatch_group_wait(writer, DISPATCH_TIME_FOREVER);
+}
+
+- (void)measureAddEventCallerLatencyAsync:(BOOL)async {
+    // Strict durability syncs every insert, the worst case for a caller waiting on it
+    NSDictionary *options = @{kKIODBStoreOptionDurability: @(KIODBStoreDurabilityStrict)};
+    self.store = [[KIODBStore alloc] initWithDatabasePath:[self databaseFile] options:options];
+    NSData *event = [self benchmarkEvent];
+    dispatch_queue_t completionQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+    // 200 adds per iteration, reporting the latency percentiles the calling thread sees
+    [self measureBlock:^{
+        NSMutableArray *latencies = [NSMutableArray array];
+        dispatch_group_t stored = dispatch_group_create();
+        for (int i = 0; i < 200; i++) {
+            CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+            if (async) {
+                dispatch_group_enter(stored);
+                [self.store addEvent:event
+                           collection:@"foo"
+                            projectID:projectID
+                      completionQueue:completionQueue
+                    completionHandler:^(BOOL wasStored) {
+                        dispatch_group_leave(stored);
+                    }];
+            } else {
+                [self.store addEvent:event collection:@"foo" projectID:projectID];
+            }
+            [latencies addObject:@(CFAbsoluteTimeGetCurrent() - start)];
+        }
+        // Every event is written before the next iteration starts
+        dispatch_group_wait(stored, DISPATCH_TIME_FOREVER);
+        [latencies sortUsingSelector:@selector(compare:)];
+        NSLog(@"addEvent %@ caller latency: p50 %.3fms, p99 %.3fms",
+              async ? @"async" : @"sync",
+              [latencies[latencies.count / 2] doubleValue] * 1000,
+              [latencies[latencies.count * 99 / 100] doubleValue] * 1000);
+    }];
+}
+
+- (NSData *)typicalEvent:(int)index {
+    // The shape KeenClient stores: keen properties, global properties, then the event's own
+    NSDictionary *event = @{
+        @"keen" : @{@"timestamp" : @"2017-06-26T12:00:00.000Z", @"location" : @{@"coordinates" : @[ @-122.4, @37.8 ]}},
+        @"app" : @{@"name" : @"Example", @"version" : @"4.2.0", @"build" : @"1234"},
+        @"device" : @{@"model" : @"iPhone9,3", @"os" : @"iOS", @"os_version" : @"10.3.2", @"locale" : @"en_US"},
+        @"user" : @{@"id" : @"4f0e6a5c-8f1e-4f57-9b0e-0c6a7b1d2e3f", @"plan" : @"free"},
+        @"screen" : @"home",
+        @"index" : @(index)
+    };
+    return [NSJSONSerialization dataWithJSONObject:event options:0 error:nil];
+}
+
+- (long long)storedEventBytes {
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_stmt *stmt = NULL;
+    long long bytes = -1;
+    keen_io_sqlite3_open([[self databaseFile] UTF8String], &db);
+    if (keen_io_sqlite3_prepare_v2(db, "SELECT total(length(eventData)) FROM events", -1, &stmt, NULL) == SQLITE_OK &&
+        keen_io_sqlite3_step(stmt) == SQLITE_ROW) {
+        bytes = keen_io_sqlite3_column_int64(stmt, 0);
+    }
+    keen_io_sqlite3_finalize(stmt);
+    keen_io_sqlite3_close(db);
+    return bytes;
+}
+
+- (void)measureCompression:(KIODBStoreCompression)compression withDictionary:(BOOL)withDictionary {
+    self.store = [[KIODBStore alloc] init];
+    self.store.compression = compression;
+    self.store.compressionDictionary = withDictionary ? [self typicalEvent:0] : nil;
+    NSMutableArray *events = [NSMutableArray array];
+    for (int i = 0; i < 500; i++) {
+        [events addObject:[self typicalEvent:i]];
+    }
+
+    // Each iteration adds 500 events and then fetches them, logging what they took up on disk
+    [self measureBlock:^{
+        [self.store deleteAllEvents];
+        for (NSData *event in events) {
+            [self.store addEvent:event collection:@"foo" projectID:projectID];
+        }
+        [self.store getEventsWithMaxAttempts:3 andProjectID:projectID];
+        NSLog(@"500 events stored in %lld bytes", [self storedEventBytes]);
+    }];
+}
+
+- (void)measureGroupCommitWithProducers:(size_t)producers {
+    self.store = [[KIODBStore alloc] init];
+    self.store.groupCommitEnabled = YES;
+    NSData *event = [self benchmarkEvent];
+
+    // 800 inserts per iteration spread over the producers, flushed before the iteration ends
+    [self measureBlock:^{
+        dispatch_apply(producers, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t producer) {
+            for (size_t i = 0; i < 800 / producers; i++) {
+                [self.store addEvent:event collection:@"foo" projectID:projectID];
+            }
+        });
+        [self.store flush];
+    }];
+}
+
+- (int)eventRowsOnDisk {
+    // Count through a separate connection so only committed rows are seen
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_stmt *stmt = NULL;
+    int rows = -1;
+    keen_io_sqlite3_open([[self databaseFile] UTF8String], &db);
+    if (keen_io_sqlite3_prepare_v2(db, "SELECT count(*) FROM events", -1, &stmt, NULL) == SQLITE_OK &&
+        keen_io_sqlite3_step(stmt) == SQLITE_ROW) {
+        rows = keen_io_sqlite3_column_int(stmt, 0);
+    }
+    keen_io_sqlite3_finalize(stmt);
+    keen_io_sqlite3_close(db);
+    return rows;
+}
+
+- (long long)pragmaValueOnDisk:(const char *)pragma {
+    // Read through a separate connection so the value reflects the file on disk
+    keen_io_sqlite3 *db = NULL;
+    keen_io_sqlite3_stmt *stmt = NULL;
+    long long value = -1;
+    keen_io_sqlite3_open([[self databaseFile] UTF8String], &db);
+    if (keen_io_sqlite3_prepare_v2(db, pragma, -1, &stmt, NULL) == SQLITE_OK &&
+        keen_io_sqlite3_step(stmt) == SQLITE_ROW) {
+        value = keen_io_sqlite3_column_int64(stmt, 0);
+    }
+    keen_io_sqlite3_finalize(stmt);
+    keen_io_sqlite3_close(db);
+    return value;
+}
+
+- (BOOL)waitForEventRowsOnDisk:(int)rows {
+    NSDate *deadline = [NSDate dateWithTimeIntervalSinceNow:5];
+    while ([self eventRowsOnDisk] != rows && [deadline timeIntervalSinceNow] > 0) {
+        [NSThread sleepForTimeInterval:0.01];
+    }
+    return [self eventRowsOnDisk] == rows;
+}
+
+- (NSString *)temporaryDatabasePath:(NSString *)name {
+    NSString *directory = [NSTemporaryDirectory() stringByAppendingPathComponent:@"KIODBStoreTests"];
+    [[NSFileManager defaultManager] removeItemAtPath:directory error:nil];
+    return [directory stringByAppendingPathComponent:name];
+}
+
 - (NSString *)databaseFile {
     return [KIODBStore getSqliteFullFileName];
 }
@@ -0,0 +1,13 @@
+//
+//  KIOSegmentedLogStoreTests.h
+//  KeenClient
+//
+//  Created by Keen Labs on 7/24/17.
+//  Copyright © 2017 Keen Labs. All rights reserved.
+//
+
+#import <XCTest/XCTest.h>
+
+@interface KIOSegmentedLogStoreTests : KeenTestCaseBase
+
+@end
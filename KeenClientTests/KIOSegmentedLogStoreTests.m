@@ -0,0 +1,462 @@
+//
+//  KIOSegmentedLogStoreTests.m
+//  KeenClient
+//
+//  Created by Keen Labs on 7/24/17.
+//  Copyright © 2017 Keen Labs. All rights reserved.
+//
+
+#import "KIODBStore.h"
+#import "KIOSegmentedLogStore.h"
+
+#import "KeenTestCaseBase.h"
+#import "KIOSegmentedLogStoreTests.h"
+#import "KIODBStorePrivate.h"
+
+@interface KIOSegmentedLogStoreTests ()
+
+@property NSString *projectID;
+
+@property NSString *logDirectory;
+
+@property KIOSegmentedLogStore *store;
+
+@property KIODBStore *dbStore;
+
+@end
+
+@implementation KIOSegmentedLogStoreTests
+
+- (void)setUp {
+    [super setUp];
+
+    self.projectID = @"pid";
+    self.logDirectory = [NSTemporaryDirectory() stringByAppendingPathComponent:@"keenEventsTest.log"];
+    [[NSFileManager defaultManager] removeItemAtPath:self.logDirectory error:nil];
+}
+
+- (void)tearDown {
+    [self.store close];
+    self.store = nil;
+    if (nil != self.dbStore) {
+        [self.dbStore drainQueue];
+        [self.dbStore closeDB];
+        self.dbStore = nil;
+    }
+    [[NSFileManager defaultManager] removeItemAtPath:self.logDirectory error:nil];
+
+    [super tearDown];
+}
+
+#pragma mark - Event Methods
+
+- (void)testAddAndClaim {
+    [self openLogWithSegmentSize:4096];
+    XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID]);
+    XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"bar" projectID:self.projectID]);
+    XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:@"otherpid"]);
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 2);
+    XCTAssertEqual([self.store getBytesUsedWithProjectID:self.projectID], [self benchmarkEvent].length * 2);
+    XCTAssertEqual([self.store getTotalBytesUsed], [self benchmarkEvent].length * 3);
+
+    KIOEventBatch *batch = [self claimAllWithLease:60];
+    XCTAssertEqual(batch.count, 2, @"only the project's events are claimed");
+    XCTAssertEqualObjects([batch collectionAtIndex:0], @"foo");
+    XCTAssertEqualObjects([batch collectionAtIndex:1], @"bar");
+    XCTAssertEqualObjects([batch eventDataAtIndex:0], [self benchmarkEvent]);
+    XCTAssertLessThan([batch eventIDAtIndex:0], [batch eventIDAtIndex:1], @"events are claimed oldest first");
+}
+
+- (void)testClaimPages {
+    [self openLogWithSegmentSize:4096];
+    for (int i = 0; i < 100; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+
+    // Pages run across segment boundaries
+    NSNumber *afterEventID = nil;
+    NSNumber *lastEventID = nil;
+    NSUInteger claimed = 0;
+    do {
+        KIOEventBatch *batch = [self.store claimEventBatchWithMaxAttempts:3
+                                                                projectID:self.projectID
+                                                             afterEventID:afterEventID
+                                                                maxEvents:30
+                                                                 maxBytes:0
+                                                            leaseDuration:60
+                                                                  leaseID:NULL
+                                                              lastEventID:&lastEventID];
+        XCTAssertLessThanOrEqual(batch.count, 30);
+        claimed += batch.count;
+        afterEventID = lastEventID;
+    } while (nil != lastEventID);
+    XCTAssertEqual(claimed, 100, @"every event was claimed once");
+    XCTAssertGreaterThan(self.store.segmentCount, 1);
+}
+
+- (void)testLeaseHoldsEvents {
+    [self openLogWithSegmentSize:4096];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+
+    NSNumber *leaseID = nil;
+    [self.store claimEventBatchWithMaxAttempts:3
+                                     projectID:self.projectID
+                                  afterEventID:nil
+                                     maxEvents:0
+                                      maxBytes:0
+                                 leaseDuration:60
+                                       leaseID:&leaseID
+                                   lastEventID:NULL];
+    XCTAssertNotNil(leaseID);
+    XCTAssertEqual([self claimAllWithLease:60].count, 0, @"leased events aren't claimed again");
+
+    [self.store releaseLease:leaseID];
+    XCTAssertEqual([self claimAllWithLease:60].count, 1, @"released events can be claimed");
+}
+
+- (void)testAckRemovesFinishedSegments {
+    [self openLogWithSegmentSize:4096];
+    for (int i = 0; i < 200; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+    NSUInteger segmentCount = self.store.segmentCount;
+    XCTAssertGreaterThan(segmentCount, 2);
+
+    [self.store deleteEvents:[self eventIDsOfBatch:[self claimAllWithLease:60]]];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 0);
+    XCTAssertEqual([self.store getTotalBytesUsed], 0);
+    XCTAssertEqual(self.store.segmentCount, 1, @"only the segment being appended to is left");
+    NSArray *files = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:self.logDirectory error:nil];
+    XCTAssertEqual([[files filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"self ENDSWITH '.log'"]]
+                       count],
+                   1);
+}
+
+- (void)testAttemptsSkipEvents {
+    [self openLogWithSegmentSize:4096];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    NSArray *eventIDs = [self eventIDsOfBatch:[self claimAllWithLease:0]];
+    for (int i = 0; i < 3; i++) {
+        [self.store incrementUploadAttemptsForEvents:eventIDs];
+    }
+
+    XCTAssertEqual([self claimAllWithLease:0].count, 0, @"events out of attempts aren't claimed");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 1, @"but are kept");
+}
+
+- (void)testReopenKeepsState {
+    [self openLogWithSegmentSize:4096];
+    for (int i = 0; i < 100; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+    NSArray *eventIDs = [self eventIDsOfBatch:[self claimAllWithLease:0]];
+    [self.store deleteEvents:[eventIDs subarrayWithRange:NSMakeRange(0, 60)]];
+    [self.store incrementUploadAttemptsForEvents:@[ eventIDs[99] ]];
+
+    [self.store close];
+    [self openLogWithSegmentSize:4096];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 40, @"acks survive reopening");
+    KIOEventBatch *batch = [self.store claimEventBatchWithMaxAttempts:1
+                                                            projectID:self.projectID
+                                                         afterEventID:nil
+                                                            maxEvents:0
+                                                             maxBytes:0
+                                                        leaseDuration:0
+                                                              leaseID:NULL
+                                                          lastEventID:NULL];
+    XCTAssertEqual(batch.count, 39, @"attempts survive reopening");
+    XCTAssertEqualObjects(@([batch eventIDAtIndex:0]), eventIDs[60], @"ids survive reopening");
+
+    XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID]);
+    XCTAssertEqual([self eventIDsOfBatch:[self claimAllWithLease:0]].lastObject.longLongValue,
+                   [eventIDs[99] longLongValue] + 1,
+                   @"new events carry on from the last id");
+}
+
+- (void)testTornRecordIsDropped {
+    [self openLogWithSegmentSize:4096];
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+    [self.store close];
+
+    // Flip a byte in the last record's event data, the way a write cut short by a crash would leave it
+    NSString *segmentPath = [self.logDirectory stringByAppendingPathComponent:@"00000000000000000001.log"];
+    NSMutableData *segment = [NSMutableData dataWithContentsOfFile:segmentPath];
+    NSRange lastEvent = [segment rangeOfData:[self benchmarkEvent] options:NSDataSearchBackwards
+                                       range:NSMakeRange(0, segment.length)];
+    XCTAssertNotEqual(lastEvent.location, NSNotFound);
+    ((uint8_t *)segment.mutableBytes)[lastEvent.location] ^= 0xff;
+    [segment writeToFile:segmentPath atomically:NO];
+
+    [self openLogWithSegmentSize:4096];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 2, @"the torn record was dropped");
+    XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID]);
+    XCTAssertEqual([self claimAllWithLease:0].count, 3, @"and its space reused");
+}
+
+- (void)testUnreadableSegmentIsKept {
+    [self openLogWithSegmentSize:4096];
+    for (int i = 0; i < 3; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+    [self.store close];
+
+    // Like a file protected until the device is first unlocked
+    NSString *segmentPath = [self.logDirectory stringByAppendingPathComponent:@"00000000000000000001.log"];
+    [[NSFileManager defaultManager] setAttributes:@{NSFilePosixPermissions: @0}
+                                     ofItemAtPath:segmentPath
+                                            error:nil];
+    [self openLogWithSegmentSize:4096];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 0);
+    XCTAssertTrue([self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID]);
+    [self.store close];
+    XCTAssertTrue([[NSFileManager defaultManager] fileExistsAtPath:segmentPath], @"the segment is left on disk");
+
+    [[NSFileManager defaultManager] setAttributes:@{NSFilePosixPermissions: @0644}
+                                     ofItemAtPath:segmentPath
+                                            error:nil];
+    [self openLogWithSegmentSize:4096];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 4, @"and read once it can be");
+    KIOEventBatch *batch = [self claimAllWithLease:0];
+    XCTAssertEqual(batch.count, 4);
+    XCTAssertGreaterThan([batch eventIDAtIndex:3], [batch eventIDAtIndex:2], @"without reusing its ids");
+}
+
+- (void)testOversizedEventIsRejected {
+    [self openLogWithSegmentSize:4096];
+    NSMutableData *event = [NSMutableData dataWithLength:8192];
+    XCTAssertFalse([self.store addEvent:event collection:@"foo" projectID:self.projectID]);
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 0);
+}
+
+- (void)testAsyncAddReportsEachEvent {
+    [self openLogWithSegmentSize:4096];
+    XCTestExpectation *stored = [self expectationWithDescription:@"event appended"];
+    XCTestExpectation *rejected = [self expectationWithDescription:@"oversized event rejected"];
+    [self.store addEvent:[self benchmarkEvent]
+               collection:@"foo"
+                projectID:self.projectID
+          completionQueue:nil
+        completionHandler:^(BOOL wasStored) {
+            XCTAssertTrue(wasStored);
+            [stored fulfill];
+        }];
+    [self.store addEvent:[NSMutableData dataWithLength:8192]
+               collection:@"foo"
+                projectID:self.projectID
+          completionQueue:nil
+        completionHandler:^(BOOL wasStored) {
+            XCTAssertFalse(wasStored);
+            [rejected fulfill];
+        }];
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 1);
+}
+
+- (void)testReleaseDuringAsyncAdd {
+    XCTestExpectation *stored = [self expectationWithDescription:@"event appended"];
+    @autoreleasepool {
+        // The add is the last thing holding the store, so it's deallocated on the log's own queue
+        KIOSegmentedLogStore *store = [[KIOSegmentedLogStore alloc] initWithDirectory:self.logDirectory
+                                                                          segmentSize:4096];
+        [store addEvent:[self benchmarkEvent]
+                   collection:@"foo"
+                    projectID:self.projectID
+              completionQueue:nil
+            completionHandler:^(BOOL wasStored) {
+                XCTAssertTrue(wasStored);
+                [stored fulfill];
+            }];
+    }
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    [self openLogWithSegmentSize:4096];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 1);
+}
+
+- (void)testDeleteAllEvents {
+    [self openLogWithSegmentSize:4096];
+    for (int i = 0; i < 100; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+    [self.store deleteAllEvents];
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 0);
+    XCTAssertEqual(self.store.segmentCount, 0);
+    XCTAssertEqual([self claimAllWithLease:0].count, 0);
+}
+
+- (void)testCollectionCapPerProject {
+    [self openLogWithSegmentSize:4096];
+    self.store.maxEventsPerCollection = 4;
+    [self.store setMaxEventsPerCollection:2 eventsToEvict:1 forProjectID:self.projectID];
+    for (int i = 0; i < 6; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:@"otherpid"];
+    }
+
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:self.projectID], 2, @"project cap");
+    XCTAssertEqual([self.store getTotalEventCountWithProjectID:@"otherpid"], 4, @"default cap");
+}
+
+- (void)testCollectionCapEvictsOldest {
+    [self openLogWithSegmentSize:4096];
+    self.store.maxEventsPerCollection = 5;
+    self.store.eventsToEvictPerCollection = 2;
+    for (int i = 0; i < 6; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+    [self.store addEvent:[self benchmarkEvent] collection:@"bar" projectID:self.projectID];
+
+    KIOEventBatch *batch = [self claimAllWithLease:0];
+    XCTAssertEqual(batch.count, 5, @"2 foo events were aged out to make room for the 6th");
+    XCTAssertEqual([batch eventIDAtIndex:0], 3, @"the oldest ones");
+    XCTAssertEqualObjects([batch collectionAtIndex:4], @"bar", @"other collections are left alone");
+}
+
+- (void)testByteBudgetsEvictOldest {
+    [self openLogWithSegmentSize:4096];
+    NSUInteger eventLength = [self benchmarkEvent].length;
+    self.store.maxBytesPerProject = eventLength * 3;
+    for (int i = 0; i < 4; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+    XCTAssertEqual([self.store getBytesUsedWithProjectID:self.projectID], eventLength * 3);
+    XCTAssertEqual([[self claimAllWithLease:0] eventIDAtIndex:0], 2, @"the oldest event was aged out");
+
+    // A log that never uploads stops growing, and gives back the segments it ages out
+    self.store.maxBytesPerProject = 0;
+    self.store.maxTotalBytes = eventLength * 100;
+    for (int i = 0; i < 1000; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:i % 2 ? @"otherpid" : self.projectID];
+    }
+    XCTAssertEqual([self.store getTotalBytesUsed], eventLength * 100);
+    XCTAssertLessThan(self.store.segmentCount, 10);
+
+    self.store.maxTotalBytes = eventLength;
+    XCTAssertFalse([self.store addEvent:[NSMutableData dataWithLength:eventLength + 1]
+                             collection:@"foo"
+                              projectID:self.projectID],
+                   @"events bigger than the budget aren't added");
+}
+
+- (void)testCursorsSkipAcknowledgedEvents {
+    [self openLogWithSegmentSize:4096];
+    self.store.maxEventsPerCollection = 5;
+    self.store.eventsToEvictPerCollection = 2;
+    [self.store addEvent:[self benchmarkEvent] collection:@"bar" projectID:self.projectID];
+    for (int i = 0; i < 1000; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    }
+
+    // The quiet collection's event is kept in front of everything the noisy one aged out
+    KIOEventBatch *batch = [self claimAllWithLease:0];
+    XCTAssertEqual(batch.count, 5);
+    XCTAssertEqualObjects([batch collectionAtIndex:0], @"bar");
+    XCTAssertEqual([batch eventIDAtIndex:1], 998, @"the newest foo events");
+
+    // Once everything is acknowledged the cursors are past the whole log, and new events are still found
+    [self.store deleteEvents:[self eventIDsOfBatch:batch]];
+    XCTAssertEqual([self claimAllWithLease:0].count, 0);
+    [self.store addEvent:[self benchmarkEvent] collection:@"bar" projectID:self.projectID];
+    [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+    XCTAssertEqual([self claimAllWithLease:0].count, 2);
+}
+
+#pragma mark - Performance Methods
+
+- (void)testInsertPerformanceDBStore {
+    self.dbStore = [[KIODBStore alloc] init];
+    [self measureInsertWithStore:self.dbStore];
+}
+
+- (void)testInsertPerformanceSegmentedLog {
+    [self openLogWithSegmentSize:1024 * 1024];
+    [self measureInsertWithStore:self.store];
+}
+
+- (void)testCappedCollectionInsertPerformanceSegmentedLog {
+    // A collection at its cap interleaved with a quiet one, so every add evicts
+    [self openLogWithSegmentSize:1024 * 1024];
+    self.store.maxEventsPerCollection = 1000;
+    for (int i = 0; i < 1000; i++) {
+        [self.store addEvent:[self benchmarkEvent] collection:@"foo" projectID:self.projectID];
+        [self.store addEvent:[self benchmarkEvent] collection:@"bar" projectID:self.projectID];
+    }
+    [self measureInsertWithStore:self.store];
+}
+
+- (void)testClaimPerformanceDBStore {
+    self.dbStore = [[KIODBStore alloc] init];
+    [self measureClaimWithStore:self.dbStore];
+}
+
+- (void)testClaimPerformanceSegmentedLog {
+    [self openLogWithSegmentSize:1024 * 1024];
+    [self measureClaimWithStore:self.store];
+}
+
+#pragma mark - Helper Methods
+
+- (void)openLogWithSegmentSize:(NSUInteger)segmentSize {
+    self.store = [[KIOSegmentedLogStore alloc] initWithDirectory:self.logDirectory segmentSize:segmentSize];
+}
+
+- (NSData *)benchmarkEvent {
+    return [@"{\"keen\":{\"timestamp\":\"2017-06-26T12:00:00.000Z\"},\"screen\":\"home\",\"user_id\":42}"
+        dataUsingEncoding:NSUTF8StringEncoding];
+}
+
+- (KIOEventBatch *)claimAllWithLease:(NSTimeInterval)leaseDuration {
+    return [self.store claimEventBatchWithMaxAttempts:3
+                                            projectID:self.projectID
+                                         afterEventID:nil
+                                            maxEvents:0
+                                             maxBytes:0
+                                        leaseDuration:leaseDuration
+                                              leaseID:NULL
+                                          lastEventID:NULL];
+}
+
+- (NSArray<NSNumber *> *)eventIDsOfBatch:(KIOEventBatch *)batch {
+    NSMutableArray *eventIDs = [NSMutableArray array];
+    for (NSUInteger i = 0; i < batch.count; i++) {
+        [eventIDs addObject:@([batch eventIDAtIndex:i])];
+    }
+    return eventIDs;
+}
+
+- (void)measureInsertWithStore:(id<KIOEventStore>)store {
+    NSData *event = [self benchmarkEvent];
+
+    // 1000 inserts per iteration, so inserts/sec is 1000 / the reported average
+    [self measureBlock:^{
+        for (int i = 0; i < 1000; i++) {
+            [store addEvent:event collection:@"foo" projectID:self.projectID];
+        }
+    }];
+}
+
+- (void)measureClaimWithStore:(id<KIOEventStore>)store {
+    NSData *event = [self benchmarkEvent];
+    for (int i = 0; i < 10000; i++) {
+        [store addEvent:event collection:@"foo" projectID:self.projectID];
+    }
+
+    // Claims a 500 event upload page per iteration. Zero length leases leave the events
+    // claimable by the next iteration.
+    [self measureBlock:^{
+        @autoreleasepool {
+            [store claimEventBatchWithMaxAttempts:3
+                                        projectID:self.projectID
+                                     afterEventID:nil
+                                        maxEvents:500
+                                         maxBytes:0
+                                    leaseDuration:0
+                                          leaseID:NULL
+                                      lastEventID:NULL];
+        }
+    }];
+}
+
+@end
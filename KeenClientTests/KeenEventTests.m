@@ -9,6 +9,8 @@
 #import "KeenClient.h"
 #import "KIOUtil.h"
 #import "HTTPCodes.h"
+#import "KeenConstants.h"
+#import "KIOSegmentedLogStore.h"
 
 #import "KeenClientTestable.h"
 #import "KeenTestConstants.h"
@@ -99,6 +101,40 @@
     XCTAssertNil(error, @"an okay event should return YES");
 }
 
+- (void)testAddEventAsync {
+    KeenClient *clientI = [[KeenClient alloc] initWithProjectID:kDefaultProjectID
+                                                    andWriteKey:kDefaultWriteKey
+                                                     andReadKey:kDefaultReadKey];
+
+    // invalid events are rejected up front, without calling the completion handler
+    NSError *error = nil;
+    XCTAssertFalse([clientI addEvent:nil
+                    toEventCollection:@"foo"
+                      completionQueue:nil
+                    completionHandler:^(BOOL stored) {
+                        XCTFail(@"not called for an invalid event");
+                    }
+                                error:&error],
+                   @"addEvent should fail");
+    XCTAssertNotNil(error, @"nil dict should return NO");
+    error = nil;
+
+    XCTestExpectation *stored = [self expectationWithDescription:@"event stored"];
+    XCTAssertTrue([clientI addEvent:@{ @"a": @"apple" }
+                   toEventCollection:@"foo"
+                     completionQueue:nil
+                   completionHandler:^(BOOL wasStored) {
+                       XCTAssertTrue(wasStored);
+                       [stored fulfill];
+                   }
+                               error:&error],
+                  @"addEvent should succeed");
+    XCTAssertNil(error, @"no error should be returned");
+    [self waitForExpectationsWithTimeout:5 handler:nil];
+
+    XCTAssertEqual([KIODBStore.sharedInstance getTotalEventCountWithProjectID:clientI.config.projectID], 1);
+}
+
 - (void)testAddEventNoWriteKey {
     KeenClient *client = [KeenClient sharedClientWithProjectID:kDefaultProjectID andWriteKey:nil andReadKey:nil];
     KeenClient *clientI = [[KeenClient alloc] initWithProjectID:kDefaultProjectID andWriteKey:nil andReadKey:nil];
@@ -979,6 +1015,40 @@
                   @"There should be exactly four events.");
 }
 
+- (void)testTooManyEventsCachedEventStore {
+    NSString *logDirectory = [NSTemporaryDirectory() stringByAppendingPathComponent:@"keenEventsClientTest.log"];
+    [[NSFileManager defaultManager] removeItemAtPath:logDirectory error:nil];
+    KIOSegmentedLogStore *eventStore = [[KIOSegmentedLogStore alloc] initWithDirectory:logDirectory segmentSize:4096];
+    KeenClient *client = [[KeenClient alloc] initWithProjectID:kDefaultProjectID
+                                                   andWriteKey:kDefaultWriteKey
+                                                    andReadKey:kDefaultReadKey
+                                                    eventStore:eventStore];
+    client.isRunningTests = YES;
+    NSDictionary *event = [NSDictionary dictionaryWithObjectsAndKeys:@"bar", @"foo", nil];
+    for (int i = 0; i < 6; i++) {
+        [client addEvent:event toEventCollection:@"something" error:nil];
+    }
+    // the cap applies to the store the client writes to, so there should be 4 left (5 - 2 + 1)
+    XCTAssertEqual([eventStore getTotalEventCountWithProjectID:client.config.projectID], 4);
+
+    [eventStore close];
+    [[NSFileManager defaultManager] removeItemAtPath:logDirectory error:nil];
+}
+
+- (void)testByteBudgetSetByAppStands {
+    KeenClient *client = [[KeenClient alloc] initWithProjectID:kDefaultProjectID
+                                                   andWriteKey:kDefaultWriteKey
+                                                    andReadKey:kDefaultReadKey];
+    client.isRunningTests = YES;
+    XCTAssertEqual(KIODBStore.sharedInstance.maxBytesPerProject, kKeenMaxBytesPerProject, @"the default budget");
+
+    KIODBStore.sharedInstance.maxBytesPerProject = 1024 * 1024;
+    [client addEvent:@{ @"foo": @"bar" } toEventCollection:@"something" error:nil];
+    XCTAssertEqual(KIODBStore.sharedInstance.maxBytesPerProject, 1024 * 1024, @"adding an event leaves it alone");
+
+    KIODBStore.sharedInstance.maxBytesPerProject = kKeenMaxBytesPerProject;
+}
+
 - (void)testInvalidEventCollection {
     KeenClient *client = [KeenClient sharedClientWithProjectID:kDefaultProjectID
                                                    andWriteKey:kDefaultWriteKey
@@ -46,13 +46,17 @@
 - (void)lockAndCleanDatabase:(NSString *)databasePath {
     [[self.class sharedLock] lock];
 
-    // Blow away any existing database so we start fresh
+    // Blow away any existing database so we start fresh. The WAL and shared
+    // memory files have to go too, or the new database would replay a stale log.
     NSFileManager *fileManager = [NSFileManager defaultManager];
-    if ([fileManager fileExistsAtPath:databasePath]) {
-        if ([fileManager removeItemAtPath:databasePath error:NULL] == YES) {
-            NSLog(@"Removed database file.");
-        } else {
-            NSLog(@"Failed to remove database file.");
+    for (NSString *suffix in @[ @"", @"-wal", @"-shm" ]) {
+        NSString *path = [databasePath stringByAppendingString:suffix];
+        if ([fileManager fileExistsAtPath:path]) {
+            if ([fileManager removeItemAtPath:path error:NULL] == YES) {
+                NSLog(@"Removed database file %@.", path);
+            } else {
+                NSLog(@"Failed to remove database file %@.", path);
+            }
         }
     }
 }